@@ -0,0 +1,986 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <core/gp_common.h>
+#include <core/gp_debug.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HAVE_X86 1
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+# include <arm_neon.h>
+# define HAVE_NEON 1
+#endif
+
+#include "audio_convert.h"
+
+#define S16_SCALE 32768.0f
+#define S24_SCALE 8388608.0f
+#define S32_SCALE 2147483648.0f
+/* Largest float below 2^31, anything above does not fit into int32_t */
+#define S32_MAX 2147483520.0f
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+# define SWAP_LE 0
+# define SWAP_BE 1
+#else
+# define SWAP_LE 1
+# define SWAP_BE 0
+#endif
+
+typedef void (*to_float_fn)(float *dst, const void *src, size_t samples);
+typedef void (*from_float_fn)(void *dst, const float *src, size_t samples);
+
+struct convert_impl {
+	const char *name;
+	to_float_fn to_float[AUDIO_FORMAT_CNT];
+	from_float_fn from_float[AUDIO_FORMAT_CNT];
+	/* Stereo only, other channel counts are handled by the scalar code */
+	void (*deinterleave2)(float *l, float *r, const float *src, size_t frames);
+	void (*interleave2)(float *dst, const float *l, const float *r, size_t frames);
+};
+
+/*
+ * Scalar reference implementation.
+ *
+ * Values are clamped before conversion the same way the SSE min/max
+ * instructions do, i.e. NaN ends up as the minimum, and rounded to nearest
+ * even, so that the vectorized versions produce identical results.
+ */
+static inline float clampf(float v, float min, float max)
+{
+	v = v > min ? v : min;
+	return v < max ? v : max;
+}
+
+static inline void scalar_s16_to_float(float *dst, const uint16_t *src, size_t n, int swap)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint16_t v = swap ? __builtin_bswap16(src[i]) : src[i];
+
+		dst[i] = (int16_t)v * (1.0f / S16_SCALE);
+	}
+}
+
+static inline void scalar_float_to_s16(uint16_t *dst, const float *src, size_t n, int swap)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint16_t v = (int16_t)lrintf(clampf(src[i] * S16_SCALE, -S16_SCALE, S16_SCALE - 1));
+
+		dst[i] = swap ? __builtin_bswap16(v) : v;
+	}
+}
+
+static inline void scalar_s32_to_float(float *dst, const uint32_t *src, size_t n, int swap)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint32_t v = swap ? __builtin_bswap32(src[i]) : src[i];
+
+		dst[i] = (float)(int32_t)v * (1.0f / S32_SCALE);
+	}
+}
+
+static inline void scalar_float_to_s32(uint32_t *dst, const float *src, size_t n, int swap)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint32_t v = (int32_t)lrintf(clampf(src[i] * S32_SCALE, -S32_SCALE, S32_MAX));
+
+		dst[i] = swap ? __builtin_bswap32(v) : v;
+	}
+}
+
+static inline void scalar_f32_copy(uint32_t *dst, const uint32_t *src, size_t n, int swap)
+{
+	size_t i;
+
+	if (!swap) {
+		memcpy(dst, src, n * sizeof(float));
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		dst[i] = __builtin_bswap32(src[i]);
+}
+
+static void s24le_to_float(float *dst, const void *src, size_t n)
+{
+	const uint8_t *p = src;
+	size_t i;
+
+	for (i = 0; i < n; i++, p += 3) {
+		int32_t v = (int32_t)((uint32_t)p[0]<<8 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<24) >> 8;
+
+		dst[i] = v * (1.0f / S24_SCALE);
+	}
+}
+
+static void s24be_to_float(float *dst, const void *src, size_t n)
+{
+	const uint8_t *p = src;
+	size_t i;
+
+	for (i = 0; i < n; i++, p += 3) {
+		int32_t v = (int32_t)((uint32_t)p[2]<<8 | (uint32_t)p[1]<<16 | (uint32_t)p[0]<<24) >> 8;
+
+		dst[i] = v * (1.0f / S24_SCALE);
+	}
+}
+
+static void float_to_s24le(void *dst, const float *src, size_t n)
+{
+	uint8_t *p = dst;
+	size_t i;
+
+	for (i = 0; i < n; i++, p += 3) {
+		int32_t v = lrintf(clampf(src[i] * S24_SCALE, -S24_SCALE, S24_SCALE - 1));
+
+		p[0] = v;
+		p[1] = v>>8;
+		p[2] = v>>16;
+	}
+}
+
+static void float_to_s24be(void *dst, const float *src, size_t n)
+{
+	uint8_t *p = dst;
+	size_t i;
+
+	for (i = 0; i < n; i++, p += 3) {
+		int32_t v = lrintf(clampf(src[i] * S24_SCALE, -S24_SCALE, S24_SCALE - 1));
+
+		p[2] = v;
+		p[1] = v>>8;
+		p[0] = v>>16;
+	}
+}
+
+static void scalar_deinterleave2(float *l, float *r, const float *src, size_t frames)
+{
+	size_t i;
+
+	for (i = 0; i < frames; i++) {
+		l[i] = src[2*i];
+		r[i] = src[2*i+1];
+	}
+}
+
+static void scalar_interleave2(float *dst, const float *l, const float *r, size_t frames)
+{
+	size_t i;
+
+	for (i = 0; i < frames; i++) {
+		dst[2*i] = l[i];
+		dst[2*i+1] = r[i];
+	}
+}
+
+/*
+ * Generates entry points for all byte orders from kernels with a swap flag.
+ */
+#define KERNELS(simd, attr) \
+static attr void simd##_s16_to_floatle(float *dst, const void *src, size_t n) \
+{ \
+	simd##_s16_to_float(dst, src, n, SWAP_LE); \
+} \
+static attr void simd##_s16_to_floatbe(float *dst, const void *src, size_t n) \
+{ \
+	simd##_s16_to_float(dst, src, n, SWAP_BE); \
+} \
+static attr void simd##_float_to_s16le(void *dst, const float *src, size_t n) \
+{ \
+	simd##_float_to_s16(dst, src, n, SWAP_LE); \
+} \
+static attr void simd##_float_to_s16be(void *dst, const float *src, size_t n) \
+{ \
+	simd##_float_to_s16(dst, src, n, SWAP_BE); \
+} \
+static attr void simd##_s32_to_floatle(float *dst, const void *src, size_t n) \
+{ \
+	simd##_s32_to_float(dst, src, n, SWAP_LE); \
+} \
+static attr void simd##_s32_to_floatbe(float *dst, const void *src, size_t n) \
+{ \
+	simd##_s32_to_float(dst, src, n, SWAP_BE); \
+} \
+static attr void simd##_float_to_s32le(void *dst, const float *src, size_t n) \
+{ \
+	simd##_float_to_s32(dst, src, n, SWAP_LE); \
+} \
+static attr void simd##_float_to_s32be(void *dst, const float *src, size_t n) \
+{ \
+	simd##_float_to_s32(dst, src, n, SWAP_BE); \
+} \
+static attr void simd##_f32_to_floatle(float *dst, const void *src, size_t n) \
+{ \
+	simd##_f32_copy((uint32_t *)dst, src, n, SWAP_LE); \
+} \
+static attr void simd##_f32_to_floatbe(float *dst, const void *src, size_t n) \
+{ \
+	simd##_f32_copy((uint32_t *)dst, src, n, SWAP_BE); \
+} \
+static attr void simd##_float_to_f32le(void *dst, const float *src, size_t n) \
+{ \
+	simd##_f32_copy(dst, (const uint32_t *)src, n, SWAP_LE); \
+} \
+static attr void simd##_float_to_f32be(void *dst, const float *src, size_t n) \
+{ \
+	simd##_f32_copy(dst, (const uint32_t *)src, n, SWAP_BE); \
+}
+
+#define IMPL(simd) { \
+	.name = #simd, \
+	.to_float = { \
+		[AUDIO_FORMAT_S16LE] = simd##_s16_to_floatle, \
+		[AUDIO_FORMAT_S16BE] = simd##_s16_to_floatbe, \
+		[AUDIO_FORMAT_S32LE] = simd##_s32_to_floatle, \
+		[AUDIO_FORMAT_S32BE] = simd##_s32_to_floatbe, \
+		[AUDIO_FORMAT_S24LE] = s24le_to_float, \
+		[AUDIO_FORMAT_S24BE] = s24be_to_float, \
+		[AUDIO_FORMAT_FLOATLE] = simd##_f32_to_floatle, \
+		[AUDIO_FORMAT_FLOATBE] = simd##_f32_to_floatbe, \
+	}, \
+	.from_float = { \
+		[AUDIO_FORMAT_S16LE] = simd##_float_to_s16le, \
+		[AUDIO_FORMAT_S16BE] = simd##_float_to_s16be, \
+		[AUDIO_FORMAT_S32LE] = simd##_float_to_s32le, \
+		[AUDIO_FORMAT_S32BE] = simd##_float_to_s32be, \
+		[AUDIO_FORMAT_S24LE] = float_to_s24le, \
+		[AUDIO_FORMAT_S24BE] = float_to_s24be, \
+		[AUDIO_FORMAT_FLOATLE] = simd##_float_to_f32le, \
+		[AUDIO_FORMAT_FLOATBE] = simd##_float_to_f32be, \
+	}, \
+	.deinterleave2 = simd##_deinterleave2, \
+	.interleave2 = simd##_interleave2, \
+}
+
+KERNELS(scalar, )
+
+static const struct convert_impl scalar_impl = IMPL(scalar);
+
+#ifdef HAVE_X86
+
+/*
+ * SSE2, the packed 24 bit formats are left to the scalar code.
+ */
+#define SSE2 __attribute__((target("sse2")))
+
+static inline SSE2 __m128i sse2_bswap16(__m128i x)
+{
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static inline SSE2 __m128i sse2_bswap32(__m128i x)
+{
+	x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+	x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+
+	return sse2_bswap16(x);
+}
+
+static inline SSE2 void sse2_s16_to_float(float *dst, const uint16_t *src, size_t n, int swap)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / S16_SCALE);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+
+		if (swap)
+			x = sse2_bswap16(x);
+
+		/* Sign extend by an arithmetic shift */
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+
+	scalar_s16_to_float(dst + i, src + i, n - i, swap);
+}
+
+static inline SSE2 void sse2_float_to_s16(uint16_t *dst, const float *src, size_t n, int swap)
+{
+	const __m128 scale = _mm_set1_ps(S16_SCALE);
+	const __m128 min = _mm_set1_ps(-S16_SCALE);
+	const __m128 max = _mm_set1_ps(S16_SCALE - 1);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+
+		a = _mm_min_ps(_mm_max_ps(a, min), max);
+		b = _mm_min_ps(_mm_max_ps(b, min), max);
+
+		__m128i x = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+
+		if (swap)
+			x = sse2_bswap16(x);
+
+		_mm_storeu_si128((__m128i *)(dst + i), x);
+	}
+
+	scalar_float_to_s16(dst + i, src + i, n - i, swap);
+}
+
+static inline SSE2 void sse2_s32_to_float(float *dst, const uint32_t *src, size_t n, int swap)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / S32_SCALE);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+
+		if (swap)
+			x = sse2_bswap32(x);
+
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+	}
+
+	scalar_s32_to_float(dst + i, src + i, n - i, swap);
+}
+
+static inline SSE2 void sse2_float_to_s32(uint32_t *dst, const float *src, size_t n, int swap)
+{
+	const __m128 scale = _mm_set1_ps(S32_SCALE);
+	const __m128 min = _mm_set1_ps(-S32_SCALE);
+	const __m128 max = _mm_set1_ps(S32_MAX);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+		__m128i x = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(a, min), max));
+
+		if (swap)
+			x = sse2_bswap32(x);
+
+		_mm_storeu_si128((__m128i *)(dst + i), x);
+	}
+
+	scalar_float_to_s32(dst + i, src + i, n - i, swap);
+}
+
+static inline SSE2 void sse2_f32_copy(uint32_t *dst, const uint32_t *src, size_t n, int swap)
+{
+	size_t i;
+
+	if (!swap) {
+		memcpy(dst, src, n * sizeof(float));
+		return;
+	}
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+
+		_mm_storeu_si128((__m128i *)(dst + i), sse2_bswap32(x));
+	}
+
+	scalar_f32_copy(dst + i, src + i, n - i, swap);
+}
+
+static SSE2 void sse2_deinterleave2(float *l, float *r, const float *src, size_t frames)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		__m128 a = _mm_loadu_ps(src + 2*i);
+		__m128 b = _mm_loadu_ps(src + 2*i + 4);
+
+		_mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+
+	scalar_deinterleave2(l + i, r + i, src + 2*i, frames - i);
+}
+
+static SSE2 void sse2_interleave2(float *dst, const float *l, const float *r, size_t frames)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		__m128 a = _mm_loadu_ps(l + i);
+		__m128 b = _mm_loadu_ps(r + i);
+
+		_mm_storeu_ps(dst + 2*i, _mm_unpacklo_ps(a, b));
+		_mm_storeu_ps(dst + 2*i + 4, _mm_unpackhi_ps(a, b));
+	}
+
+	scalar_interleave2(dst + 2*i, l + i, r + i, frames - i);
+}
+
+KERNELS(sse2, SSE2)
+
+static const struct convert_impl sse2_impl = IMPL(sse2);
+
+/*
+ * AVX2, twice the width and byte shuffles for the byte swaps.
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i avx2_bswap(__m256i x, int bytes)
+{
+	const __m128i swap16 = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+	                                     9, 8, 11, 10, 13, 12, 15, 14);
+	const __m128i swap32 = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+	                                     11, 10, 9, 8, 15, 14, 13, 12);
+
+	return _mm256_shuffle_epi8(x, _mm256_broadcastsi128_si256(bytes == 2 ? swap16 : swap32));
+}
+
+static inline AVX2 void avx2_s16_to_float(float *dst, const uint16_t *src, size_t n, int swap)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / S16_SCALE);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		if (swap)
+			x = avx2_bswap(x, 2);
+
+		__m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+		__m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+		_mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+	}
+
+	scalar_s16_to_float(dst + i, src + i, n - i, swap);
+}
+
+static inline AVX2 void avx2_float_to_s16(uint16_t *dst, const float *src, size_t n, int swap)
+{
+	const __m256 scale = _mm256_set1_ps(S16_SCALE);
+	const __m256 min = _mm256_set1_ps(-S16_SCALE);
+	const __m256 max = _mm256_set1_ps(S16_SCALE - 1);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+		__m256 b = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale);
+
+		a = _mm256_min_ps(_mm256_max_ps(a, min), max);
+		b = _mm256_min_ps(_mm256_max_ps(b, min), max);
+
+		/* Packs within 128 bit lanes, the permute restores the order */
+		__m256i x = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+		x = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 1, 2, 0));
+
+		if (swap)
+			x = avx2_bswap(x, 2);
+
+		_mm256_storeu_si256((__m256i *)(dst + i), x);
+	}
+
+	scalar_float_to_s16(dst + i, src + i, n - i, swap);
+}
+
+static inline AVX2 void avx2_s32_to_float(float *dst, const uint32_t *src, size_t n, int swap)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / S32_SCALE);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		if (swap)
+			x = avx2_bswap(x, 4);
+
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+	}
+
+	scalar_s32_to_float(dst + i, src + i, n - i, swap);
+}
+
+static inline AVX2 void avx2_float_to_s32(uint32_t *dst, const float *src, size_t n, int swap)
+{
+	const __m256 scale = _mm256_set1_ps(S32_SCALE);
+	const __m256 min = _mm256_set1_ps(-S32_SCALE);
+	const __m256 max = _mm256_set1_ps(S32_MAX);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+		__m256i x = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(a, min), max));
+
+		if (swap)
+			x = avx2_bswap(x, 4);
+
+		_mm256_storeu_si256((__m256i *)(dst + i), x);
+	}
+
+	scalar_float_to_s32(dst + i, src + i, n - i, swap);
+}
+
+static inline AVX2 void avx2_f32_copy(uint32_t *dst, const uint32_t *src, size_t n, int swap)
+{
+	size_t i;
+
+	if (!swap) {
+		memcpy(dst, src, n * sizeof(float));
+		return;
+	}
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		_mm256_storeu_si256((__m256i *)(dst + i), avx2_bswap(x, 4));
+	}
+
+	scalar_f32_copy(dst + i, src + i, n - i, swap);
+}
+
+/* Lane crossing shuffles are not worth it for two channels */
+#define avx2_deinterleave2 sse2_deinterleave2
+#define avx2_interleave2 sse2_interleave2
+
+KERNELS(avx2, AVX2)
+
+static const struct convert_impl avx2_impl = IMPL(avx2);
+
+#endif /* HAVE_X86 */
+
+#ifdef HAVE_NEON
+
+/*
+ * NEON, AArch64 only since we need the round to nearest conversions.
+ *
+ * The minnm/maxnm instructions return the number if one of the operands is
+ * NaN, which matches the scalar clampf().
+ */
+
+static inline int16x8_t neon_bswap16(int16x8_t x)
+{
+	return vreinterpretq_s16_u8(vrev16q_u8(vreinterpretq_u8_s16(x)));
+}
+
+static inline int32x4_t neon_bswap32(int32x4_t x)
+{
+	return vreinterpretq_s32_u8(vrev32q_u8(vreinterpretq_u8_s32(x)));
+}
+
+static inline float32x4_t neon_clamp(float32x4_t v, float min, float max)
+{
+	return vminnmq_f32(vmaxnmq_f32(v, vdupq_n_f32(min)), vdupq_n_f32(max));
+}
+
+static inline void neon_s16_to_float(float *dst, const uint16_t *src, size_t n, int swap)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		int16x8_t x = vld1q_s16((const int16_t *)src + i);
+
+		if (swap)
+			x = neon_bswap16(x);
+
+		float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+		float32x4_t hi = vcvtq_f32_s32(vmovl_high_s16(x));
+
+		vst1q_f32(dst + i, vmulq_n_f32(lo, 1.0f / S16_SCALE));
+		vst1q_f32(dst + i + 4, vmulq_n_f32(hi, 1.0f / S16_SCALE));
+	}
+
+	scalar_s16_to_float(dst + i, src + i, n - i, swap);
+}
+
+static inline void neon_float_to_s16(uint16_t *dst, const float *src, size_t n, int swap)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		float32x4_t a = vmulq_n_f32(vld1q_f32(src + i), S16_SCALE);
+		float32x4_t b = vmulq_n_f32(vld1q_f32(src + i + 4), S16_SCALE);
+
+		a = neon_clamp(a, -S16_SCALE, S16_SCALE - 1);
+		b = neon_clamp(b, -S16_SCALE, S16_SCALE - 1);
+
+		int16x8_t x = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)),
+		                           vqmovn_s32(vcvtnq_s32_f32(b)));
+
+		if (swap)
+			x = neon_bswap16(x);
+
+		vst1q_s16((int16_t *)dst + i, x);
+	}
+
+	scalar_float_to_s16(dst + i, src + i, n - i, swap);
+}
+
+static inline void neon_s32_to_float(float *dst, const uint32_t *src, size_t n, int swap)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		int32x4_t x = vld1q_s32((const int32_t *)src + i);
+
+		if (swap)
+			x = neon_bswap32(x);
+
+		vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(x), 1.0f / S32_SCALE));
+	}
+
+	scalar_s32_to_float(dst + i, src + i, n - i, swap);
+}
+
+static inline void neon_float_to_s32(uint32_t *dst, const float *src, size_t n, int swap)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		float32x4_t a = vmulq_n_f32(vld1q_f32(src + i), S32_SCALE);
+		int32x4_t x = vcvtnq_s32_f32(neon_clamp(a, -S32_SCALE, S32_MAX));
+
+		if (swap)
+			x = neon_bswap32(x);
+
+		vst1q_s32((int32_t *)dst + i, x);
+	}
+
+	scalar_float_to_s32(dst + i, src + i, n - i, swap);
+}
+
+static inline void neon_f32_copy(uint32_t *dst, const uint32_t *src, size_t n, int swap)
+{
+	size_t i;
+
+	if (!swap) {
+		memcpy(dst, src, n * sizeof(float));
+		return;
+	}
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		int32x4_t x = vld1q_s32((const int32_t *)src + i);
+
+		vst1q_s32((int32_t *)dst + i, neon_bswap32(x));
+	}
+
+	scalar_f32_copy(dst + i, src + i, n - i, swap);
+}
+
+static void neon_deinterleave2(float *l, float *r, const float *src, size_t frames)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		float32x4x2_t x = vld2q_f32(src + 2*i);
+
+		vst1q_f32(l + i, x.val[0]);
+		vst1q_f32(r + i, x.val[1]);
+	}
+
+	scalar_deinterleave2(l + i, r + i, src + 2*i, frames - i);
+}
+
+static void neon_interleave2(float *dst, const float *l, const float *r, size_t frames)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		float32x4x2_t x = {{vld1q_f32(l + i), vld1q_f32(r + i)}};
+
+		vst2q_f32(dst + 2*i, x);
+	}
+
+	scalar_interleave2(dst + 2*i, l + i, r + i, frames - i);
+}
+
+KERNELS(neon, )
+
+static const struct convert_impl neon_impl = IMPL(neon);
+
+#endif /* HAVE_NEON */
+
+static const struct convert_impl *impl = &scalar_impl;
+
+void audio_to_float(enum audio_format fmt, float *dst, const void *src, size_t samples)
+{
+	impl->to_float[fmt](dst, src, samples);
+}
+
+void audio_from_float(enum audio_format fmt, void *dst, const float *src, size_t samples)
+{
+	impl->from_float[fmt](dst, src, samples);
+}
+
+void audio_deinterleave(float *const *dst, const float *src,
+                        unsigned int channels, size_t frames)
+{
+	unsigned int ch;
+	size_t i;
+
+	switch (channels) {
+	case 1:
+		memcpy(dst[0], src, frames * sizeof(float));
+	break;
+	case 2:
+		impl->deinterleave2(dst[0], dst[1], src, frames);
+	break;
+	default:
+		for (ch = 0; ch < channels; ch++) {
+			for (i = 0; i < frames; i++)
+				dst[ch][i] = src[i * channels + ch];
+		}
+	}
+}
+
+void audio_interleave(float *dst, float *const *src,
+                      unsigned int channels, size_t frames)
+{
+	unsigned int ch;
+	size_t i;
+
+	switch (channels) {
+	case 1:
+		memcpy(dst, src[0], frames * sizeof(float));
+	break;
+	case 2:
+		impl->interleave2(dst, src[0], src[1], frames);
+	break;
+	default:
+		for (ch = 0; ch < channels; ch++) {
+			for (i = 0; i < frames; i++)
+				dst[i * channels + ch] = src[ch][i];
+		}
+	}
+}
+
+const char *audio_convert_impl(void)
+{
+	return impl->name;
+}
+
+/*
+ * Test data, odd length so that the scalar tails are exercised as well.
+ */
+#define TEST_SAMPLES 4099
+
+static const char *fmt_names[AUDIO_FORMAT_CNT] = {
+	[AUDIO_FORMAT_S16LE] = "S16LE",
+	[AUDIO_FORMAT_S16BE] = "S16BE",
+	[AUDIO_FORMAT_S32LE] = "S32LE",
+	[AUDIO_FORMAT_S32BE] = "S32BE",
+	[AUDIO_FORMAT_S24LE] = "S24LE",
+	[AUDIO_FORMAT_S24BE] = "S24BE",
+	[AUDIO_FORMAT_FLOATLE] = "FLOATLE",
+	[AUDIO_FORMAT_FLOATBE] = "FLOATBE",
+};
+
+static uint32_t test_rand(uint32_t *seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed;
+}
+
+/*
+ * Float samples covering clipping, both ends of the range and halfway points
+ * between integer steps, which are the interesting cases for rounding.
+ */
+static void test_floats(float *buf, size_t n)
+{
+	static const float special[] = {
+		0.0f, -0.0f, 1.0f, -1.0f, 1.5f, -1.5f, 0.5f / S16_SCALE,
+		-0.5f / S16_SCALE, 1.5f / S16_SCALE, 2.5f / S16_SCALE,
+		1.0f - 1.0f / S16_SCALE, 0.5f / S24_SCALE, NAN,
+	};
+	uint32_t seed = 42;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint32_t r = test_rand(&seed);
+
+		if (i < GP_ARRAY_SIZE(special))
+			buf[i] = special[i];
+		else if (r & 1)
+			buf[i] = (int32_t)r / S32_SCALE * 1.25f;
+		else
+			buf[i] = ((int16_t)(r>>16) + 0.5f) / S16_SCALE;
+	}
+}
+
+/* Integer samples are any bit pattern, floats have to be valid numbers */
+static void test_samples(enum audio_format fmt, void *buf, size_t n)
+{
+	uint8_t *p = buf;
+	uint32_t seed = 7;
+	size_t i;
+
+	if (fmt == AUDIO_FORMAT_FLOATLE || fmt == AUDIO_FORMAT_FLOATBE) {
+		float tmp[TEST_SAMPLES];
+
+		test_floats(tmp, n);
+		scalar_impl.from_float[fmt](buf, tmp, n);
+		return;
+	}
+
+	for (i = 0; i < n * audio_format_size(fmt); i++)
+		p[i] = test_rand(&seed) >> 24;
+}
+
+static int check_impl(const struct convert_impl *simd)
+{
+	static float in[TEST_SAMPLES], ref[TEST_SAMPLES], out[TEST_SAMPLES];
+	static uint8_t raw[4 * TEST_SAMPLES], raw_ref[4 * TEST_SAMPLES];
+	float *planar_ref[2] = {ref, ref + TEST_SAMPLES/2};
+	float *planar_out[2] = {out, out + TEST_SAMPLES/2};
+	enum audio_format fmt;
+	int ret = 0;
+
+	test_floats(in, TEST_SAMPLES);
+
+	for (fmt = 0; fmt < AUDIO_FORMAT_CNT; fmt++) {
+		size_t size = TEST_SAMPLES * audio_format_size(fmt);
+
+		test_samples(fmt, raw, TEST_SAMPLES);
+		scalar_impl.to_float[fmt](ref, raw, TEST_SAMPLES);
+		simd->to_float[fmt](out, raw, TEST_SAMPLES);
+
+		if (memcmp(ref, out, sizeof(ref))) {
+			GP_WARN("%s %s to float differs from scalar", simd->name, fmt_names[fmt]);
+			ret = 1;
+		}
+
+		scalar_impl.from_float[fmt](raw_ref, in, TEST_SAMPLES);
+		simd->from_float[fmt](raw, in, TEST_SAMPLES);
+
+		if (memcmp(raw_ref, raw, size)) {
+			GP_WARN("%s float to %s differs from scalar", simd->name, fmt_names[fmt]);
+			ret = 1;
+		}
+	}
+
+	scalar_impl.deinterleave2(planar_ref[0], planar_ref[1], in, TEST_SAMPLES/2);
+	simd->deinterleave2(planar_out[0], planar_out[1], in, TEST_SAMPLES/2);
+
+	if (memcmp(ref, out, sizeof(float) * (TEST_SAMPLES & ~1))) {
+		GP_WARN("%s deinterleave differs from scalar", simd->name);
+		ret = 1;
+	}
+
+	scalar_impl.interleave2(ref, in, in + TEST_SAMPLES/2, TEST_SAMPLES/2);
+	simd->interleave2(out, in, in + TEST_SAMPLES/2, TEST_SAMPLES/2);
+
+	if (memcmp(ref, out, sizeof(float) * (TEST_SAMPLES & ~1))) {
+		GP_WARN("%s interleave differs from scalar", simd->name);
+		ret = 1;
+	}
+
+	return ret;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define BENCH_ROUNDS 256
+
+static double bench_to(to_float_fn fn, float *dst, const void *src)
+{
+	uint64_t start = now_ns();
+	unsigned int i;
+
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		fn(dst, src, TEST_SAMPLES);
+
+	return (double)(now_ns() - start) / (BENCH_ROUNDS * TEST_SAMPLES);
+}
+
+static double bench_from(from_float_fn fn, void *dst, const float *src)
+{
+	uint64_t start = now_ns();
+	unsigned int i;
+
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		fn(dst, src, TEST_SAMPLES);
+
+	return (double)(now_ns() - start) / (BENCH_ROUNDS * TEST_SAMPLES);
+}
+
+static void bench_impl(const struct convert_impl *simd)
+{
+	static float in[TEST_SAMPLES], out[TEST_SAMPLES];
+	static uint8_t raw[4 * TEST_SAMPLES];
+	enum audio_format fmt;
+
+	test_floats(in, TEST_SAMPLES);
+
+	for (fmt = 0; fmt < AUDIO_FORMAT_CNT; fmt++) {
+		test_samples(fmt, raw, TEST_SAMPLES);
+
+		GP_DEBUG(1, "Convert %-7s to float: scalar %.2f %s %.2f ns/sample",
+		         fmt_names[fmt], bench_to(scalar_impl.to_float[fmt], out, raw),
+		         simd->name, bench_to(simd->to_float[fmt], out, raw));
+
+		GP_DEBUG(1, "Convert float to %-7s: scalar %.2f %s %.2f ns/sample",
+		         fmt_names[fmt], bench_from(scalar_impl.from_float[fmt], raw, in),
+		         simd->name, bench_from(simd->from_float[fmt], raw, in));
+	}
+}
+
+static void convert_init(void)
+{
+	const struct convert_impl *simd = NULL;
+
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		simd = &avx2_impl;
+	else if (__builtin_cpu_supports("sse2"))
+		simd = &sse2_impl;
+#endif
+
+#ifdef HAVE_NEON
+	simd = &neon_impl;
+#endif
+
+	if (!simd) {
+		GP_DEBUG(1, "Using scalar sample conversions");
+		return;
+	}
+
+	if (check_impl(simd)) {
+		GP_WARN("Falling back to scalar sample conversions");
+		return;
+	}
+
+	if (gp_get_debug_level() >= 1)
+		bench_impl(simd);
+
+	GP_DEBUG(1, "Using %s sample conversions", simd->name);
+
+	impl = simd;
+}
+
+void audio_convert_init(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	/* Streams of all decoder instances share the selection */
+	pthread_once(&once, convert_init);
+}
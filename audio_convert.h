@@ -0,0 +1,79 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Sample format conversions to and from the internal float format.
+ *
+ * Float samples are in [-1, 1) range, conversions to integer formats round to
+ * nearest and saturate. The kernels are vectorized where possible, the
+ * implementation is selected at runtime by audio_convert_init(), before that
+ * the scalar reference implementation is used.
+ */
+
+#ifndef AUDIO_CONVERT_H__
+#define AUDIO_CONVERT_H__
+
+#include <stddef.h>
+
+#include "audio_output.h"
+
+/**
+ * @brief Selects the fastest implementation supported by the CPU.
+ *
+ * The vectorized kernels are checked against the scalar reference first and
+ * are not used if they differ. The selection is done only on the first call.
+ */
+void audio_convert_init(void);
+
+/**
+ * @brief Returns the selected implementation name.
+ */
+const char *audio_convert_impl(void);
+
+/**
+ * @brief Converts samples into floats.
+ *
+ * @param fmt A source sample format.
+ * @param dst A destination buffer.
+ * @param src A source buffer.
+ * @param samples Number of samples, i.e. frames * channels.
+ */
+void audio_to_float(enum audio_format fmt, float *dst, const void *src, size_t samples);
+
+/**
+ * @brief Converts floats into samples.
+ *
+ * @param fmt A destination sample format.
+ * @param dst A destination buffer.
+ * @param src A source buffer.
+ * @param samples Number of samples, i.e. frames * channels.
+ */
+void audio_from_float(enum audio_format fmt, void *dst, const float *src, size_t samples);
+
+/**
+ * @brief Splits interleaved frames into per channel buffers.
+ *
+ * @param dst An array of channels destination buffers.
+ * @param src Interleaved frames.
+ * @param channels Number of channels.
+ * @param frames Number of frames.
+ */
+void audio_deinterleave(float *const *dst, const float *src,
+                        unsigned int channels, size_t frames);
+
+/**
+ * @brief Merges per channel buffers into interleaved frames.
+ *
+ * @param dst A destination buffer for the interleaved frames.
+ * @param src An array of channels source buffers.
+ * @param channels Number of channels.
+ * @param frames Number of frames.
+ */
+void audio_interleave(float *dst, float *const *src,
+                      unsigned int channels, size_t frames);
+
+#endif /* AUDIO_CONVERT_H__ */
@@ -12,43 +12,49 @@
 #include "audio_decoder.h"
 
 const struct audio_decoder audio_decoders[] = {
+	{.name = "auto", .create = audio_decoder_auto},
 #ifdef HAVE_MPV_CLIENT_H
-	{.name = "mpv", .init = audio_decoder_mpv},
+	{.name = "mpv", .create = audio_decoder_mpv},
 #endif
 #ifdef HAVE_MPG123_H
-	{.name = "mpg123", .init = audio_decoder_mpg123},
+	{.name = "mpg123", .create = audio_decoder_mpg123},
 #endif
+	{.name = "wav", .create = audio_decoder_wav},
 	{}
 };
 
-const struct audio_decoder_ops *audio_decoder_init(const char *name, const struct audio_decoder_callbacks *cbs)
+struct audio_decoder_inst *audio_decoder_create(const char *name,
+                                                const struct audio_decoder_callbacks *cbs,
+                                                void *priv)
 {
 	unsigned int i;
 
 	if (!name || !name[0])
-		return audio_decoders[0].init(cbs);
+		return audio_decoders[0].create(cbs, priv);
 
 	for (i = 0; audio_decoders[i].name; i++) {
 		if (!strcmp(name, audio_decoders[i].name))
-			return audio_decoders[i].init(cbs);
+			return audio_decoders[i].create(cbs, priv);
 	}
 
 	GP_WARN("Audio decoder '%s' not available falling back to '%s'",
 		name, audio_decoders[0].name);
 
-	return audio_decoders[0].init(cbs);
+	return audio_decoders[0].create(cbs, priv);
 }
 
 __attribute__((weak))
-const struct audio_decoder_ops *audio_decoder_mpg123(const struct audio_decoder_callbacks *cbs)
+struct audio_decoder_inst *audio_decoder_mpg123(const struct audio_decoder_callbacks *cbs, void *priv)
 {
 	(void) cbs;
+	(void) priv;
 	return NULL;
 }
 
 __attribute__((weak))
-const struct audio_decoder_ops *audio_decoder_mpv(const struct audio_decoder_callbacks *cbs)
+struct audio_decoder_inst *audio_decoder_mpv(const struct audio_decoder_callbacks *cbs, void *priv)
 {
 	(void) cbs;
+	(void) priv;
 	return NULL;
 }
@@ -10,6 +10,8 @@
 
 #include <stddef.h>
 
+struct audio_decoder_inst;
+
 /**
  * @brief Maximum softvolume gain is 130%
  */
@@ -36,18 +38,53 @@ enum audio_decoder_softvol_op {
 };
 
 /**
- * @brief Audio decoder options.
+ * @brief Resampler quality.
+ */
+enum audio_decoder_resample {
+	/** @brief Sample rate changes are passed to the output. */
+	AUDIO_DECODER_RESAMPLE_OFF,
+	/** @brief Resample with the lowest CPU usage. */
+	AUDIO_DECODER_RESAMPLE_FAST,
+	/** @brief Resample with a medium quality. */
+	AUDIO_DECODER_RESAMPLE_MEDIUM,
+	/** @brief Resample with the best quality. */
+	AUDIO_DECODER_RESAMPLE_BEST,
+	AUDIO_DECODER_RESAMPLE_MAX = AUDIO_DECODER_RESAMPLE_BEST,
+};
+
+/**
+ * @brief Audio decoder operations.
  *
- * This structure should be returned by the audio decoder init function.
+ * All operations are passed the decoder instance they operate on.
  */
 struct audio_decoder_ops {
 	/**
 	 * @brief Loads a new track.
 	 *
+	 * The load may finish asynchronously, in that case the track info and
+	 * duration callbacks are called from tick() once the track has been
+	 * opened, decoders that implement poll_fd() signal the completion on
+	 * the file descriptor.
+	 *
+	 * A track that fails to load asynchronously is reported as finished
+	 * before its duration has been reported.
+	 *
 	 * @param path A path to the file.
-	 * @return Zero on success.
+	 * @return Zero on success or if the load has been queued.
+	 */
+	int (*track_load)(struct audio_decoder_inst *self, const char *path);
+	/**
+	 * @brief Prepares a track that is likely to be loaded next.
+	 *
+	 * Optional, if implemented the decoder may continue with the track
+	 * without a gap once the current track has ended. The application
+	 * still calls track_load() when it's notified that the track has
+	 * finished.
+	 *
+	 * @param path A path to the file, NULL drops a preloaded track.
+	 * @return Zero on success or if the preload has been queued.
 	 */
-	int (*track_load)(const char *path);
+	int (*track_preload)(struct audio_decoder_inst *self, const char *path);
 	/**
 	 * @brief Seeks in the current track.
 	 *
@@ -56,13 +93,13 @@ struct audio_decoder_ops {
 	 *
 	 * @return Zero on success.
 	 */
-	int (*track_seek)(long offset_ms);
+	int (*track_seek)(struct audio_decoder_inst *self, long offset_ms);
 	/**
 	 * @brief Playback control.
 	 *
 	 * @param playback A playback operation.
 	 */
-	int (*track_ctrl)(enum audio_decoder_ctrl ctrl);
+	int (*track_ctrl)(struct audio_decoder_inst *self, enum audio_decoder_ctrl ctrl);
 	/**
 	 * @brief Software volume control.
 	 *
@@ -70,7 +107,8 @@ struct audio_decoder_ops {
 	 *
 	 * @return Zero for set, current volume for cur and maximal volume for max.
 	 */
-	unsigned long (*softvol)(enum audio_decoder_softvol_op op, unsigned long vol);
+	unsigned long (*softvol)(struct audio_decoder_inst *self,
+	                         enum audio_decoder_softvol_op op, unsigned long vol);
 	/**
 	 * @brief Processes events, fills buffers, etc.
 	 *
@@ -78,47 +116,129 @@ struct audio_decoder_ops {
 	 *
 	 * @return An interval before next call to this function in miliseconds.
 	 */
-	unsigned long (*tick)(void);
+	unsigned long (*tick)(struct audio_decoder_inst *self);
+	/**
+	 * @brief Returns a file descriptor to poll for decoder events.
+	 *
+	 * If implemented tick() is called when the file descriptor is readable
+	 * instead of being called on a timer.
+	 *
+	 * @return A file descriptor.
+	 */
+	int (*poll_fd)(struct audio_decoder_inst *self);
+	/**
+	 * @brief Sets the resampler quality.
+	 *
+	 * Optional, if enabled all tracks are resampled to a single output
+	 * sample rate so that the output is not reconfigured between tracks.
+	 * Applies to tracks loaded afterwards.
+	 *
+	 * @param quality A resampler quality.
+	 */
+	void (*resample)(struct audio_decoder_inst *self, enum audio_decoder_resample quality);
+	/**
+	 * @brief Sets a limit of memory for tracks read into RAM.
+	 *
+	 * Optional, decoders that read the current and the preloaded track
+	 * into RAM do not access the disk during playback. Tracks that do not
+	 * fit are read from the disk. Applies to tracks loaded afterwards.
+	 *
+	 * @param limit A limit in bytes, zero disables reading tracks into RAM.
+	 */
+	void (*mem_limit)(struct audio_decoder_inst *self, size_t limit);
+	/**
+	 * @brief Stops the playback and frees the instance.
+	 */
+	void (*destroy)(struct audio_decoder_inst *self);
+};
+
+/**
+ * @brief An audio decoder instance.
+ *
+ * Decoders embed this structure into their per instance state, any number
+ * of instances can be created and each of them plays on its own output.
+ */
+struct audio_decoder_inst {
+	/** @brief Instance operations. */
+	const struct audio_decoder_ops *ops;
+	/** @brief Application callbacks. */
+	const struct audio_decoder_callbacks *cbs;
+	/** @brief Application private pointer. */
+	void *priv;
 };
 
-static inline int audio_decoder_track_load(const struct audio_decoder_ops *ops, const char *path)
+static inline int audio_decoder_track_load(struct audio_decoder_inst *self, const char *path)
+{
+	return self->ops->track_load(self, path);
+}
+
+static inline int audio_decoder_track_preload(struct audio_decoder_inst *self, const char *path)
+{
+	if (!self->ops->track_preload)
+		return 0;
+
+	return self->ops->track_preload(self, path);
+}
+
+static inline unsigned long audio_decoder_tick(struct audio_decoder_inst *self)
+{
+	return self->ops->tick(self);
+}
+
+static inline int audio_decoder_poll_fd(struct audio_decoder_inst *self)
+{
+	if (!self->ops->poll_fd)
+		return -1;
+
+	return self->ops->poll_fd(self);
+}
+
+static inline void audio_decoder_resample(struct audio_decoder_inst *self,
+                                          enum audio_decoder_resample quality)
 {
-	return ops->track_load(path);
+	if (self->ops->resample)
+		self->ops->resample(self, quality);
 }
 
-static inline unsigned long audio_decoder_tick(const struct audio_decoder_ops *ops)
+static inline void audio_decoder_mem_limit(struct audio_decoder_inst *self, size_t limit)
 {
-	return ops->tick();
+	if (self->ops->mem_limit)
+		self->ops->mem_limit(self, limit);
 }
 
-static inline void audio_decoder_track_pause(const struct audio_decoder_ops *ops)
+static inline void audio_decoder_track_pause(struct audio_decoder_inst *self)
 {
-	ops->track_ctrl(AUDIO_DECODER_PAUSE);
+	self->ops->track_ctrl(self, AUDIO_DECODER_PAUSE);
 }
 
-static inline void audio_decoder_track_play(const struct audio_decoder_ops *ops)
+static inline void audio_decoder_track_play(struct audio_decoder_inst *self)
 {
-	ops->track_ctrl(AUDIO_DECODER_PLAY);
+	self->ops->track_ctrl(self, AUDIO_DECODER_PLAY);
 }
 
-static inline void audio_decoder_track_seek(const struct audio_decoder_ops *ops, unsigned long offset_ms)
+static inline void audio_decoder_track_seek(struct audio_decoder_inst *self, unsigned long offset_ms)
 {
-	ops->track_seek(offset_ms);
+	self->ops->track_seek(self, offset_ms);
 }
 
-static inline unsigned long audio_decoder_softvol_max(const struct audio_decoder_ops *ops)
+static inline unsigned long audio_decoder_softvol_max(struct audio_decoder_inst *self)
 {
-	return ops->softvol(AUDIO_DECODER_SOFTVOL_MAX, 0);
+	return self->ops->softvol(self, AUDIO_DECODER_SOFTVOL_MAX, 0);
 }
 
-static inline unsigned long audio_decoder_softvol_get(const struct audio_decoder_ops *ops)
+static inline unsigned long audio_decoder_softvol_get(struct audio_decoder_inst *self)
 {
-	return ops->softvol(AUDIO_DECODER_SOFTVOL_GET, 0);
+	return self->ops->softvol(self, AUDIO_DECODER_SOFTVOL_GET, 0);
 }
 
-static inline unsigned long audio_decoder_softvol_set(const struct audio_decoder_ops *ops, unsigned long vol)
+static inline unsigned long audio_decoder_softvol_set(struct audio_decoder_inst *self, unsigned long vol)
 {
-	return ops->softvol(AUDIO_DECODER_SOFTVOL_SET, vol);
+	return self->ops->softvol(self, AUDIO_DECODER_SOFTVOL_SET, vol);
+}
+
+static inline void audio_decoder_destroy(struct audio_decoder_inst *self)
+{
+	self->ops->destroy(self);
 }
 
 /**
@@ -131,15 +251,18 @@ struct audio_decoder_callbacks {
 	 * @brief Audio track info callback.
 	 *
 	 * This is called when track is loaded to set or clear the track info.
+	 *
+	 * @param self A decoder instance the track is played by.
 	 */
-	void (*track_info)(const char *artist, const char *album, const char *title);
+	void (*track_info)(struct audio_decoder_inst *self, const char *artist,
+	                   const char *album, const char *title);
 	/**
 	 * @brief Audio track duration callback.
 	 *
 	 * @param duration_ms A duration of currently plaing song. If zero
 	 *                    currently plaing song had finished.
 	 */
-	void (*track_duration)(long duration_ms);
+	void (*track_duration)(struct audio_decoder_inst *self, long duration_ms);
 	/**
 	 * @brief Audio track art callback.
 	 *
@@ -148,13 +271,65 @@ struct audio_decoder_callbacks {
 	 * @param buf A bufer with image that was embedded in the audio file.
 	 * @param buf_len A buffer lenght in bytes.
 	 */
-	void (*track_art)(void *buf, size_t buf_len);
+	void (*track_art)(struct audio_decoder_inst *self, void *buf, size_t buf_len);
 	/**
 	 * @brief Updates current song offset from the start.
 	 *
 	 * @param offset_ms Current offset from the start of the song in miliseconds.
 	 */
-	void (*track_pos)(long offset_ms);
+	void (*track_pos)(struct audio_decoder_inst *self, long offset_ms);
+	/**
+	 * @brief Returns a stored output buffer latency.
+	 *
+	 * @param device An audio output device name.
+	 *
+	 * @return A latency in microseconds or zero if not known.
+	 */
+	unsigned int (*output_latency_get)(struct audio_decoder_inst *self, const char *device);
+	/**
+	 * @brief Stores an output buffer latency adapted by the decoder.
+	 *
+	 * @param device An audio output device name.
+	 * @param latency_us A latency in microseconds.
+	 */
+	void (*output_latency_set)(struct audio_decoder_inst *self, const char *device,
+	                           unsigned int latency_us);
+	/**
+	 * @brief Returns a stored synth decoder for a CPU model.
+	 *
+	 * The mpg123 decoder benchmarks the synth decoders the library
+	 * supports and stores the fastest one so that the benchmark runs only
+	 * once on a machine.
+	 *
+	 * @param cpu A CPU model name.
+	 * @param synth A buffer for the synth decoder name.
+	 * @param size A buffer size.
+	 *
+	 * @return Zero if a synth decoder was stored.
+	 */
+	int (*synth_get)(struct audio_decoder_inst *self, const char *cpu,
+	                 char *synth, size_t size);
+	/**
+	 * @brief Stores the fastest synth decoder for a CPU model.
+	 *
+	 * @param cpu A CPU model name.
+	 * @param synth A synth decoder name.
+	 */
+	void (*synth_set)(struct audio_decoder_inst *self, const char *cpu, const char *synth);
+	/**
+	 * @brief Returns a path to a decoder cache file.
+	 *
+	 * The decoder caches data that are expensive to compute, e.g. seek
+	 * indexes. The cache directory is created if it does not exist.
+	 *
+	 * Unlike the other callbacks this one is called from the decoder
+	 * threads and has to be thread safe.
+	 *
+	 * @param fname A cache file name.
+	 *
+	 * @return An allocated path to be freed by the caller or NULL.
+	 */
+	char *(*cache_path)(struct audio_decoder_inst *self, const char *fname);
 };
 
 /**
@@ -164,13 +339,14 @@ struct audio_decoder {
 	/** @brief An audio decoder name. */
 	const char *name;
 	/**
-	 * @brief An audio decoder init funciton.
+	 * @brief Creates an audio decoder instance.
 	 *
 	 * @param cbs An audio decoder app callbacks.
+	 * @param priv An application private pointer stored in the instance.
 	 *
-	 * @return An audio decoder ops.
+	 * @return A new decoder instance or NULL on failure.
 	 */
-	const struct audio_decoder_ops *(*init)(const struct audio_decoder_callbacks *cbs);
+	struct audio_decoder_inst *(*create)(const struct audio_decoder_callbacks *cbs, void *priv);
 };
 
 /**
@@ -179,33 +355,49 @@ struct audio_decoder {
 extern const struct audio_decoder audio_decoders[];
 
 /**
- * @brief Initialize audio decoder by name.
+ * @brief Creates audio decoder instance by name.
  *
  * The function falls back to first available decoder if decoder with a name
  * wasn't found.
  *
  * @param name An audio decoder name.
  * @param cbs An audio decoder app callbacks.
+ * @param priv An application private pointer stored in the instance.
+ *
+ * @return A new decoder instance or NULL on failure.
  */
-const struct audio_decoder_ops *audio_decoder_init(const char *name,
-                                                   const struct audio_decoder_callbacks *cbs);
+struct audio_decoder_inst *audio_decoder_create(const char *name,
+                                                const struct audio_decoder_callbacks *cbs,
+                                                void *priv);
 
 /**
- * @brief A mpg123 init function.
+ * @brief Creates a decoder multiplexer instance.
  *
- * @param cbs An audio decoder app callbacks.
+ * Routes each track to the cheapest of the other decoders that can play it.
+ */
+struct audio_decoder_inst *audio_decoder_auto(const struct audio_decoder_callbacks *cbs, void *priv);
+
+/**
+ * @brief Creates a mpg123 decoder instance.
  *
- * @return An mpg123 decoder ops or NULL if mpg123 is not compiled in.
+ * The mpg123 library is initialized once for all instances.
+ *
+ * @return A new instance or NULL if mpg123 is not compiled in.
  */
-const struct audio_decoder_ops *audio_decoder_mpg123(const struct audio_decoder_callbacks *cbs);
+struct audio_decoder_inst *audio_decoder_mpg123(const struct audio_decoder_callbacks *cbs, void *priv);
 
 /**
- * @brief A mpv init function.
+ * @brief Creates a mpv decoder instance.
  *
- * @param cbs An audio decoder app callbacks.
+ * @return A new instance or NULL if mpv is not compiled in.
+ */
+struct audio_decoder_inst *audio_decoder_mpv(const struct audio_decoder_callbacks *cbs, void *priv);
+
+/**
+ * @brief Creates a native WAVE decoder instance.
  *
- * @return An mpv decoder ops or NULL if mpv is not compiled in.
+ * Plays uncompressed PCM from RIFF/WAVE, RF64 and Wave64 files.
  */
-const struct audio_decoder_ops *audio_decoder_mpv(const struct audio_decoder_callbacks *cbs);
+struct audio_decoder_inst *audio_decoder_wav(const struct audio_decoder_callbacks *cbs, void *priv);
 
 #endif /* AUDIO_DECODER_H */
@@ -0,0 +1,820 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Decoder multiplexer.
+ *
+ * Each track is routed to the cheapest decoder that can play it. The file
+ * type is sniffed from the first bytes of the file and the decoders are tried
+ * in the order given for the type in the routes table. A decoder that fails
+ * to open the track reports it as finished before reporting its duration, in
+ * that case the next decoder in the chain is tried.
+ *
+ * The file types are cached per extension once a file has been played, files
+ * with a known extension are routed without reading them at all and are
+ * sniffed only when no decoder on the route could play them. Decoders that
+ * fail to initialize are skipped from then on.
+ *
+ * Decoders are initialized lazily on first use and only one of them exists at
+ * a time. Each decoder keeps its audio device open and opening a device that
+ * is already in use blocks on hardware without dmix, hence the previous
+ * decoder is destroyed before another one is initialized. A preload that
+ * would need a different decoder is dropped, the track is loaded once the
+ * current one has finished. Each multiplexer instance owns its own set of
+ * decoder instances.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <core/gp_common.h>
+#include <core/gp_debug.h>
+
+#include "audio_decoder_priv.h"
+
+/* Maximal number of decoders to try for a file type */
+#define ROUTE_MAX 3
+
+/* Number of cached extensions */
+#define EXT_CACHE_SIZE 32
+
+/* Bytes needed to tell the file types apart */
+#define SNIFF_SIZE 16
+
+enum file_type {
+	FILE_UNKNOWN,
+	FILE_MPEG,
+	FILE_WAVE,
+	FILE_FLAC,
+	FILE_OGG,
+	FILE_MP4,
+	FILE_TYPE_CNT,
+};
+
+static const char *const file_type_names[FILE_TYPE_CNT] = {
+	[FILE_UNKNOWN] = "unknown",
+	[FILE_MPEG] = "mpeg",
+	[FILE_WAVE] = "wave",
+	[FILE_FLAC] = "flac",
+	[FILE_OGG] = "ogg",
+	[FILE_MP4] = "mp4",
+};
+
+/* Decoders to try in this order, cheapest first */
+static const char *const routes[FILE_TYPE_CNT][ROUTE_MAX] = {
+	[FILE_UNKNOWN] = {"mpv", "mpg123", "wav"},
+	[FILE_MPEG] = {"mpg123", "mpv"},
+	[FILE_WAVE] = {"wav", "mpv"},
+	[FILE_FLAC] = {"mpv"},
+	[FILE_OGG] = {"mpv"},
+	[FILE_MP4] = {"mpv"},
+};
+
+struct backend {
+	const struct audio_decoder *decoder;
+	/* Decoder instance, its private pointer points back to the backend */
+	struct audio_decoder_inst *inst;
+	struct ad_auto *ad;
+	int init_failed;
+};
+
+struct ext_cache {
+	char ext[8];
+	enum file_type type;
+};
+
+struct ad_auto {
+	struct audio_decoder_inst inst;
+
+	/* Backends indexed as audio_decoders[], this decoder is skipped */
+	struct backend *backends;
+	unsigned int backends_cnt;
+
+	/* Backend that plays the current track, callbacks from others are dropped */
+	struct backend *active;
+	/*
+	 * Set while the backends are ticked, their callbacks must not destroy
+	 * them, loads are deferred to the next tick() instead.
+	 */
+	int ticking;
+	int load_pending;
+
+	/* Track being loaded until its duration is reported */
+	char *load_path;
+	enum file_type load_type;
+	/* Next decoder on the route to try */
+	unsigned int load_route_idx;
+	int load_sniffed;
+
+	struct ext_cache ext_cache[EXT_CACHE_SIZE];
+	unsigned int ext_cache_next;
+
+	/* Application settings applied to the backends on init */
+	unsigned long softvol;
+	enum audio_decoder_resample resample;
+	int resample_set;
+	size_t mem_limit;
+	int mem_limit_set;
+	int paused;
+
+	/* Polls all backend file descriptors and the event_fd */
+	int epoll_fd;
+	/* Signalled when all backends failed to load a track */
+	int event_fd;
+	int failed;
+};
+
+static struct ad_auto *to_ad_auto(struct audio_decoder_inst *self)
+{
+	return (struct ad_auto *)self;
+}
+
+/*
+ * File type sniffing.
+ */
+static enum file_type sniff_buf(const unsigned char *b, size_t len)
+{
+	if (len >= 4 && !memcmp(b, "fLaC", 4))
+		return FILE_FLAC;
+
+	if (len >= 4 && !memcmp(b, "OggS", 4))
+		return FILE_OGG;
+
+	if (len >= 8 && !memcmp(b + 4, "ftyp", 4))
+		return FILE_MP4;
+
+	if (len >= 12 && !memcmp(b + 8, "WAVE", 4) &&
+	    (!memcmp(b, "RIFF", 4) || !memcmp(b, "RF64", 4) || !memcmp(b, "BW64", 4)))
+		return FILE_WAVE;
+
+	/* Wave64 riff GUID */
+	if (len >= 16 && !memcmp(b, "riff\x2e\x91\xcf\x11\xa5\xd6\x28\xdb\x04\xc1\x00\x00", 16))
+		return FILE_WAVE;
+
+	if (len >= 3 && !memcmp(b, "ID3", 3))
+		return FILE_MPEG;
+
+	/* MPEG audio frame sync, a valid layer and a valid bitrate */
+	if (len >= 3 && b[0] == 0xff && (b[1] & 0xe0) == 0xe0 &&
+	    (b[1] & 0x06) && (b[2] & 0xf0) != 0xf0)
+		return FILE_MPEG;
+
+	return FILE_UNKNOWN;
+}
+
+static enum file_type sniff(const char *path)
+{
+	unsigned char buf[SNIFF_SIZE];
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		GP_DEBUG(1, "Failed to open '%s': %s", path, strerror(errno));
+		return FILE_UNKNOWN;
+	}
+
+	len = read(fd, buf, sizeof(buf));
+
+	close(fd);
+
+	if (len < 0)
+		return FILE_UNKNOWN;
+
+	return sniff_buf(buf, len);
+}
+
+static int file_ext(const char *path, char ext[8])
+{
+	const char *dot = strrchr(path, '.');
+	size_t i;
+
+	if (!dot || strchr(dot, '/'))
+		return 0;
+
+	for (i = 0; dot[i + 1] && i < 7; i++)
+		ext[i] = tolower((unsigned char)dot[i + 1]);
+
+	if (dot[i + 1] || !i)
+		return 0;
+
+	ext[i] = 0;
+
+	return 1;
+}
+
+static struct ext_cache *ext_cache_lookup(struct ad_auto *ad, const char *ext)
+{
+	unsigned int i;
+
+	for (i = 0; i < EXT_CACHE_SIZE; i++) {
+		if (!strcmp(ad->ext_cache[i].ext, ext))
+			return &ad->ext_cache[i];
+	}
+
+	return NULL;
+}
+
+static void ext_cache_insert(struct ad_auto *ad, const char *path, enum file_type type)
+{
+	struct ext_cache *entry;
+	char ext[8];
+
+	if (type == FILE_UNKNOWN || !file_ext(path, ext))
+		return;
+
+	entry = ext_cache_lookup(ad, ext);
+	if (!entry) {
+		entry = &ad->ext_cache[ad->ext_cache_next];
+		ad->ext_cache_next = (ad->ext_cache_next + 1) % EXT_CACHE_SIZE;
+		strcpy(entry->ext, ext);
+	}
+
+	entry->type = type;
+}
+
+static const struct audio_decoder_callbacks auto_cbs;
+
+/*
+ * Backends.
+ */
+static void backend_apply(struct backend *backend)
+{
+	struct ad_auto *ad = backend->ad;
+
+	audio_decoder_softvol_set(backend->inst, ad->softvol);
+
+	if (ad->resample_set)
+		audio_decoder_resample(backend->inst, ad->resample);
+
+	if (ad->mem_limit_set)
+		audio_decoder_mem_limit(backend->inst, ad->mem_limit);
+}
+
+static struct backend *backend_find(struct ad_auto *ad, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ad->backends_cnt; i++) {
+		struct backend *backend = &ad->backends[i];
+
+		if (backend->decoder && !backend->init_failed &&
+		    !strcmp(backend->decoder->name, name))
+			return backend;
+	}
+
+	return NULL;
+}
+
+/*
+ * Destroys the decoder instance, which closes its audio device.
+ */
+static void backend_release(struct backend *backend)
+{
+	struct ad_auto *ad = backend->ad;
+
+	GP_DEBUG(1, "Releasing '%s' decoder", backend->decoder->name);
+
+	epoll_ctl(ad->epoll_fd, EPOLL_CTL_DEL, audio_decoder_poll_fd(backend->inst), NULL);
+	audio_decoder_destroy(backend->inst);
+	backend->inst = NULL;
+
+	if (ad->active == backend)
+		ad->active = NULL;
+}
+
+/*
+ * Returns an initialized backend, any other backend is released first.
+ *
+ * Must not be called from the backend callbacks, the backend that calls
+ * them may be destroyed.
+ */
+static struct backend *backend_get(struct ad_auto *ad, const char *name)
+{
+	struct backend *backend = backend_find(ad, name);
+	struct epoll_event ev = {.events = EPOLLIN};
+	unsigned int i;
+	int fd;
+
+	if (!backend)
+		return NULL;
+
+	if (backend->inst)
+		return backend;
+
+	for (i = 0; i < ad->backends_cnt; i++) {
+		if (ad->backends[i].inst)
+			backend_release(&ad->backends[i]);
+	}
+
+	GP_DEBUG(1, "Initializing '%s' decoder", name);
+
+	backend->inst = backend->decoder->create(&auto_cbs, backend);
+	if (!backend->inst) {
+		GP_WARN("Failed to initialize '%s' decoder", name);
+		backend->init_failed = 1;
+		return NULL;
+	}
+
+	fd = audio_decoder_poll_fd(backend->inst);
+	ev.data.ptr = backend;
+
+	if (fd < 0 || epoll_ctl(ad->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		GP_WARN("Cannot poll '%s' decoder", name);
+		backend->init_failed = 1;
+		audio_decoder_destroy(backend->inst);
+		backend->inst = NULL;
+		return NULL;
+	}
+
+	backend_apply(backend);
+
+	return backend;
+}
+
+static void backend_activate(struct backend *backend)
+{
+	struct ad_auto *ad = backend->ad;
+
+	if (ad->active == backend)
+		return;
+
+	ad->active = backend;
+
+	if (ad->paused)
+		audio_decoder_track_pause(backend->inst);
+	else
+		audio_decoder_track_play(backend->inst);
+}
+
+/*
+ * Callbacks from the backends.
+ */
+static int from_active(struct audio_decoder_inst *self)
+{
+	struct backend *backend = self->priv;
+
+	return backend == backend->ad->active;
+}
+
+static struct ad_auto *backend_ad(struct audio_decoder_inst *self)
+{
+	struct backend *backend = self->priv;
+
+	return backend->ad;
+}
+
+static void load_done(struct ad_auto *ad)
+{
+	free(ad->load_path);
+	ad->load_path = NULL;
+}
+
+static int load_try(struct ad_auto *ad);
+
+static void auto_track_duration(struct audio_decoder_inst *self, long duration_ms)
+{
+	struct ad_auto *ad = backend_ad(self);
+
+	if (!from_active(self))
+		return;
+
+	if (ad->load_path) {
+		if (duration_ms) {
+			/* Loaded, remember the file type for the extension */
+			if (ad->load_sniffed)
+				ext_cache_insert(ad, ad->load_path, ad->load_type);
+			load_done(ad);
+		} else {
+			/* Loading failed, try the next decoder from tick() */
+			GP_DEBUG(1, "Decoder '%s' failed to load '%s'",
+			         ad->active->decoder->name, ad->load_path);
+			ad->load_pending = 1;
+			eventfd_write(ad->event_fd, 1);
+			return;
+		}
+	}
+
+	audio_decoder_track_duration(&ad->inst, duration_ms);
+}
+
+static void auto_track_info(struct audio_decoder_inst *self, const char *artist,
+                            const char *album, const char *title)
+{
+	if (from_active(self))
+		audio_decoder_track_info(&backend_ad(self)->inst, artist, album, title);
+}
+
+static void auto_track_art(struct audio_decoder_inst *self, void *buf, size_t buf_len)
+{
+	if (from_active(self))
+		audio_decoder_track_art(&backend_ad(self)->inst, buf, buf_len);
+}
+
+static void auto_track_pos(struct audio_decoder_inst *self, long offset_ms)
+{
+	if (from_active(self))
+		audio_decoder_track_pos(&backend_ad(self)->inst, offset_ms);
+}
+
+static unsigned int auto_output_latency_get(struct audio_decoder_inst *self, const char *device)
+{
+	return audio_decoder_output_latency_get(&backend_ad(self)->inst, device);
+}
+
+static void auto_output_latency_set(struct audio_decoder_inst *self,
+                                    const char *device, unsigned int latency_us)
+{
+	audio_decoder_output_latency_set(&backend_ad(self)->inst, device, latency_us);
+}
+
+static int auto_synth_get(struct audio_decoder_inst *self, const char *cpu,
+                          char *synth, size_t size)
+{
+	return audio_decoder_synth_get(&backend_ad(self)->inst, cpu, synth, size);
+}
+
+static void auto_synth_set(struct audio_decoder_inst *self, const char *cpu, const char *synth)
+{
+	audio_decoder_synth_set(&backend_ad(self)->inst, cpu, synth);
+}
+
+static char *auto_cache_path(struct audio_decoder_inst *self, const char *fname)
+{
+	return audio_decoder_cache_path(&backend_ad(self)->inst, fname);
+}
+
+static const struct audio_decoder_callbacks auto_cbs = {
+	.track_info = auto_track_info,
+	.track_duration = auto_track_duration,
+	.track_art = auto_track_art,
+	.track_pos = auto_track_pos,
+	.output_latency_get = auto_output_latency_get,
+	.output_latency_set = auto_output_latency_set,
+	.synth_get = auto_synth_get,
+	.synth_set = auto_synth_set,
+	.cache_path = auto_cache_path,
+};
+
+/*
+ * Routing.
+ */
+
+/*
+ * Tries the decoders on the route starting at load_route_idx.
+ *
+ * Returns zero if a decoder has accepted the track, the failure is reported
+ * from tick() otherwise.
+ */
+static int load_try(struct ad_auto *ad)
+{
+	const char *path = ad->load_path;
+
+	for (;;) {
+		const char *const *route = routes[ad->load_type];
+		unsigned int i = ad->load_route_idx++;
+		struct backend *backend;
+
+		if (i >= ROUTE_MAX) {
+			enum file_type type;
+
+			if (ad->load_sniffed)
+				break;
+
+			/* Extension has lied, find out what the file really is */
+			ad->load_sniffed = 1;
+			type = sniff(path);
+
+			if (type == ad->load_type)
+				break;
+
+			GP_DEBUG(1, "File '%s' is %s", path, file_type_names[type]);
+
+			ad->load_type = type;
+			ad->load_route_idx = 0;
+			continue;
+		}
+
+		if (!route[i] || !(backend = backend_get(ad, route[i])))
+			continue;
+
+		GP_DEBUG(1, "Loading '%s' (%s) with '%s'", path,
+		         file_type_names[ad->load_type], route[i]);
+
+		backend_activate(backend);
+
+		if (!audio_decoder_track_load(backend->inst, path))
+			return 0;
+	}
+
+	GP_WARN("No decoder can play '%s'", path);
+
+	/* Report the failure from tick() to avoid recursion in the application */
+	ad->failed = 1;
+	eventfd_write(ad->event_fd, 1);
+
+	return 1;
+}
+
+/*
+ * Returns the file type from the extension cache or sniffs the file.
+ */
+static enum file_type route_lookup(struct ad_auto *ad, const char *path, int *sniffed)
+{
+	struct ext_cache *entry;
+	char ext[8];
+
+	*sniffed = 0;
+
+	if (file_ext(path, ext) && (entry = ext_cache_lookup(ad, ext)))
+		return entry->type;
+
+	*sniffed = 1;
+
+	return sniff(path);
+}
+
+/*
+ * Returns the backend for the path, the backend may not be initialized yet.
+ */
+static struct backend *route_backend(struct ad_auto *ad, const char *path)
+{
+	enum file_type type;
+	unsigned int i;
+	int sniffed;
+
+	type = route_lookup(ad, path, &sniffed);
+
+	for (i = 0; i < ROUTE_MAX; i++) {
+		struct backend *backend;
+
+		if (routes[type][i] && (backend = backend_find(ad, routes[type][i])))
+			return backend;
+	}
+
+	return NULL;
+}
+
+static int audio_decoder_track_load_auto(struct audio_decoder_inst *self, const char *path)
+{
+	struct ad_auto *ad = to_ad_auto(self);
+	char *new_path = strdup(path);
+
+	if (!new_path) {
+		GP_WARN("Malloc failed :(");
+		return 1;
+	}
+
+	load_done(ad);
+
+	ad->load_path = new_path;
+	ad->load_route_idx = 0;
+	ad->load_pending = 0;
+	ad->failed = 0;
+	ad->load_type = route_lookup(ad, path, &ad->load_sniffed);
+
+	if (ad->ticking) {
+		ad->load_pending = 1;
+		eventfd_write(ad->event_fd, 1);
+		return 0;
+	}
+
+	return load_try(ad);
+}
+
+static int audio_decoder_track_preload_auto(struct audio_decoder_inst *self, const char *path)
+{
+	struct ad_auto *ad = to_ad_auto(self);
+	struct backend *backend;
+
+	if (!path) {
+		if (ad->active)
+			return audio_decoder_track_preload(ad->active->inst, NULL);
+		return 0;
+	}
+
+	backend = route_backend(ad, path);
+	if (!backend)
+		return 1;
+
+	/*
+	 * Other decoder cannot continue without a gap and cannot be
+	 * initialized while the active one holds the audio device, drop the
+	 * stale preload and load the track once the current one has finished.
+	 */
+	if (ad->active && ad->active != backend) {
+		GP_DEBUG(1, "Not preloading '%s', needs '%s' decoder",
+		         path, backend->decoder->name);
+		return audio_decoder_track_preload(ad->active->inst, NULL);
+	}
+
+	backend = backend_get(ad, backend->decoder->name);
+	if (!backend)
+		return 1;
+
+	return audio_decoder_track_preload(backend->inst, path);
+}
+
+static int audio_decoder_track_ctrl_auto(struct audio_decoder_inst *self, enum audio_decoder_ctrl ctrl)
+{
+	struct ad_auto *ad = to_ad_auto(self);
+	ad->paused = ctrl == AUDIO_DECODER_PAUSE;
+
+	if (!ad->active)
+		return 0;
+
+	return ad->active->inst->ops->track_ctrl(ad->active->inst, ctrl);
+}
+
+static int audio_decoder_track_seek_auto(struct audio_decoder_inst *self, long offset_ms)
+{
+	struct ad_auto *ad = to_ad_auto(self);
+	if (!ad->active)
+		return 0;
+
+	return ad->active->inst->ops->track_seek(ad->active->inst, offset_ms);
+}
+
+static unsigned long audio_decoder_softvol_auto(struct audio_decoder_inst *self,
+                                                enum audio_decoder_softvol_op op, unsigned long vol)
+{
+	struct ad_auto *ad = to_ad_auto(self);
+	unsigned int i;
+
+	switch (op) {
+	case AUDIO_DECODER_SOFTVOL_SET:
+		ad->softvol = vol;
+		for (i = 0; i < ad->backends_cnt; i++) {
+			if (ad->backends[i].inst)
+				audio_decoder_softvol_set(ad->backends[i].inst, vol);
+		}
+	break;
+	case AUDIO_DECODER_SOFTVOL_GET:
+		return ad->softvol;
+	}
+
+	return 0;
+}
+
+static void audio_decoder_resample_auto(struct audio_decoder_inst *self, enum audio_decoder_resample quality)
+{
+	struct ad_auto *ad = to_ad_auto(self);
+	unsigned int i;
+
+	ad->resample = quality;
+	ad->resample_set = 1;
+
+	for (i = 0; i < ad->backends_cnt; i++) {
+		if (ad->backends[i].inst)
+			audio_decoder_resample(ad->backends[i].inst, quality);
+	}
+}
+
+static void audio_decoder_mem_limit_auto(struct audio_decoder_inst *self, size_t limit)
+{
+	struct ad_auto *ad = to_ad_auto(self);
+	unsigned int i;
+
+	ad->mem_limit = limit;
+	ad->mem_limit_set = 1;
+
+	for (i = 0; i < ad->backends_cnt; i++) {
+		if (ad->backends[i].inst)
+			audio_decoder_mem_limit(ad->backends[i].inst, limit);
+	}
+}
+
+static unsigned long audio_decoder_tick_auto(struct audio_decoder_inst *self)
+{
+	struct ad_auto *ad = to_ad_auto(self);
+	eventfd_t val;
+	unsigned int i;
+
+	if (!eventfd_read(ad->event_fd, &val) && ad->load_pending && ad->load_path) {
+		ad->load_pending = 0;
+		load_try(ad);
+	}
+
+	if (ad->failed) {
+		ad->failed = 0;
+		load_done(ad);
+		audio_decoder_track_info(self, NULL, NULL, NULL);
+		audio_decoder_track_finished(self);
+	}
+
+	ad->ticking = 1;
+
+	for (i = 0; i < ad->backends_cnt; i++) {
+		struct backend *backend = &ad->backends[i];
+
+		if (backend->inst)
+			audio_decoder_tick(backend->inst);
+	}
+
+	ad->ticking = 0;
+
+	return 0;
+}
+
+static int audio_decoder_poll_fd_auto(struct audio_decoder_inst *self)
+{
+	struct ad_auto *ad = to_ad_auto(self);
+	return ad->epoll_fd;
+}
+
+static void audio_decoder_destroy_auto(struct audio_decoder_inst *self)
+{
+	struct ad_auto *ad = to_ad_auto(self);
+	unsigned int i;
+
+	for (i = 0; i < ad->backends_cnt; i++) {
+		if (ad->backends[i].inst)
+			audio_decoder_destroy(ad->backends[i].inst);
+	}
+
+	load_done(ad);
+	close(ad->epoll_fd);
+	close(ad->event_fd);
+	free(ad->backends);
+	free(ad);
+}
+
+static const struct audio_decoder_ops audio_decoder_ops_auto = {
+	.track_load = audio_decoder_track_load_auto,
+	.track_preload = audio_decoder_track_preload_auto,
+	.track_ctrl = audio_decoder_track_ctrl_auto,
+	.track_seek = audio_decoder_track_seek_auto,
+	.softvol = audio_decoder_softvol_auto,
+	.tick = audio_decoder_tick_auto,
+	.poll_fd = audio_decoder_poll_fd_auto,
+	.resample = audio_decoder_resample_auto,
+	.mem_limit = audio_decoder_mem_limit_auto,
+	.destroy = audio_decoder_destroy_auto,
+};
+
+struct audio_decoder_inst *audio_decoder_auto(const struct audio_decoder_callbacks *cbs, void *priv)
+{
+	struct epoll_event ev = {.events = EPOLLIN};
+	struct ad_auto *ad;
+	unsigned int i;
+
+	ad = calloc(1, sizeof(*ad));
+	if (!ad) {
+		GP_WARN("Malloc failed :(");
+		return NULL;
+	}
+
+	audio_decoder_inst_init(&ad->inst, &audio_decoder_ops_auto, cbs, priv);
+	ad->softvol = 100;
+	ad->epoll_fd = -1;
+	ad->event_fd = -1;
+
+	for (i = 0; audio_decoders[i].name; i++);
+
+	ad->backends = calloc(i, sizeof(*ad->backends));
+	if (!ad->backends) {
+		GP_WARN("Malloc failed :(");
+		goto err;
+	}
+
+	ad->backends_cnt = i;
+
+	for (i = 0; i < ad->backends_cnt; i++) {
+		ad->backends[i].ad = ad;
+		if (audio_decoders[i].create != audio_decoder_auto)
+			ad->backends[i].decoder = &audio_decoders[i];
+	}
+
+	ad->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	ad->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (ad->epoll_fd < 0 || ad->event_fd < 0) {
+		GP_WARN("Failed to create poll fds: %s", strerror(errno));
+		goto err;
+	}
+
+	if (epoll_ctl(ad->epoll_fd, EPOLL_CTL_ADD, ad->event_fd, &ev)) {
+		GP_WARN("Failed to add event_fd: %s", strerror(errno));
+		goto err;
+	}
+
+	return &ad->inst;
+err:
+	if (ad->epoll_fd >= 0)
+		close(ad->epoll_fd);
+	if (ad->event_fd >= 0)
+		close(ad->event_fd);
+	free(ad->backends);
+	free(ad);
+	return NULL;
+}
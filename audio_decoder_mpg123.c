@@ -5,20 +5,116 @@
 
  */
 
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <mpg123.h>
 #include <core/gp_common.h>
 #include <core/gp_debug.h>
 
-static const struct audio_decoder_callbacks *audio_decoder_cbs;
-
 #include "audio_output.h"
+#include "audio_stream.h"
 #include "audio_decoder_priv.h"
 
-static struct ad_mpg123 {
+struct ad_file;
+struct ad_index;
+
+struct ad_track {
 	mpg123_handle *handle;
-	struct audio_output *out;
+	/* Track data in RAM, NULL if the track is read from the disk */
+	struct ad_file *file;
+	char *path;
 	long rate;
-} ad_mpg123;
+	int channels;
+	enum audio_format fmt;
+	long duration;
+	/* Length in samples */
+	off_t length;
+	/* Cache key, see index_load() */
+	off_t file_size;
+	struct timespec file_mtime;
+	/* Cached seek index is up to date */
+	int indexed;
+};
+
+struct ad_mpg123 {
+	struct audio_decoder_inst inst;
+	/* Currently decoded track */
+	struct ad_track cur;
+	/* Preloaded next track, owned by the decoder thread if next_ready is set */
+	struct ad_track next;
+	int next_ready;
+	/* Decoder thread switched to the next track */
+	int switched;
+	/* Output has reached the end of the previous track after a switch */
+	int switch_eof;
+	enum audio_decoder_resample resample;
+	struct audio_output *out;
+	struct audio_stream stream;
+
+	/*
+	 * Tracks are opened by the loader thread, requests and results are
+	 * protected by the stream lock. The loader owns the next handle while
+	 * loading is set.
+	 */
+	pthread_t loader_thread;
+	pthread_cond_t loader_cond;
+	/* Set when the instance is being destroyed */
+	int loader_exit;
+	char *load_req;
+	char *preload_req;
+	int loading;
+	/* A load request is being processed */
+	int load_active;
+	/* Preload was cancelled while the loader was opening the track */
+	int preload_drop;
+	/* Resampling was changed while the loader was opening the track */
+	int next_renegotiate;
+	/* Track info should be sent from tick() */
+	int loaded;
+	/* Seek index to be written by the loader thread */
+	struct ad_index *index_req;
+
+	/* Memory used by the tracks read into RAM */
+	size_t mem_used;
+	atomic_size_t mem_limit;
+
+	/* Time to first audio statistics */
+	uint64_t load_ns;
+	int ttfa_pending;
+	unsigned int ttfa_cnt;
+	uint64_t ttfa_sum_ns;
+	uint64_t ttfa_max_ns;
+};
+
+static struct ad_mpg123 *to_ad_mpg123(struct audio_decoder_inst *self)
+{
+	return (struct ad_mpg123 *)self;
+}
+
+/* Loader thread finished a load */
+#define EV_LOADED AUDIO_STREAM_EV_USER
+/* Loader thread failed to open a track */
+#define EV_FAILED (AUDIO_STREAM_EV_USER<<1)
+
+static const struct {
+	int encoding;
+	enum audio_format fmt;
+} encodings[] = {
+	{MPG123_ENC_SIGNED_16, AUDIO_FORMAT_S16},
+	{MPG123_ENC_SIGNED_24, AUDIO_FORMAT_S24},
+	{MPG123_ENC_SIGNED_32, AUDIO_FORMAT_S32},
+	{MPG123_ENC_FLOAT_32, AUDIO_FORMAT_FLOAT},
+};
 
 static enum audio_format convert_fmt(int encoding)
 {
@@ -26,204 +122,1382 @@ static enum audio_format convert_fmt(int encoding)
 	case MPG123_ENC_SIGNED_16:
 		return AUDIO_FORMAT_S16;
 	break;
+	case MPG123_ENC_SIGNED_24:
+		return AUDIO_FORMAT_S24;
+	break;
 	case MPG123_ENC_SIGNED_32:
 		return AUDIO_FORMAT_S32;
 	break;
+	case MPG123_ENC_FLOAT_32:
+		return AUDIO_FORMAT_FLOAT;
+	break;
 	default:
-		printf("format %0x\n", encoding);
+		GP_WARN("Unsupported mpg123 encoding %x", encoding);
 		return -1;
 	}
 }
 
-static int audio_decoder_track_load_mpg123(const char *name)
+/*
+ * Seek index cache.
+ *
+ * Exact track length and frame accurate seeks require the mpg123 frame index,
+ * which is built by reading the whole file. That is slow on SD cards and
+ * network filesystems, hence the index and length are cached on disk keyed by
+ * the file path, size and modification time.
+ */
+#define INDEX_MAGIC "gpidx01"
+
+struct index_hdr {
+	char magic[8];
+	uint64_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t length;
+	int64_t step;
+	uint64_t fill;
+	uint32_t path_len;
+};
+
+/* Index copied out of a handle so that it can be written without locks */
+struct ad_index {
+	struct index_hdr hdr;
+	char *path;
+	int64_t offsets[];
+};
+
+static char *index_path(struct ad_mpg123 *ad, const char *name)
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	char fname[64];
+
+	/* FNV-1a */
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 0x100000001b3;
+	}
+
+	snprintf(fname, sizeof(fname), "mpg123-%016llx.idx", (unsigned long long)hash);
+
+	return audio_decoder_cache_path(&ad->inst, fname);
+}
+
+/*
+ * Loads the cached index into the handle.
+ *
+ * Returns zero on success, non-zero if there is no valid cache entry.
+ */
+static int index_load(struct ad_mpg123 *ad, struct ad_track *track, const char *name)
+{
+	size_t path_len = strlen(name);
+	struct index_hdr hdr;
+	char *path, *fpath = NULL;
+	int64_t *offsets = NULL;
+	off_t *index = NULL;
+	FILE *f;
+	size_t i;
+	int ret = 1;
+
+	path = index_path(ad, name);
+	if (!path)
+		return 1;
+
+	f = fopen(path, "rb");
+	if (!f)
+		goto err0;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.path_len != path_len)
+		goto err1;
+
+	if ((off_t)hdr.file_size != track->file_size ||
+	    hdr.mtime_sec != track->file_mtime.tv_sec ||
+	    hdr.mtime_nsec != track->file_mtime.tv_nsec) {
+		GP_DEBUG(1, "Seek index for '%s' is stale", name);
+		goto err1;
+	}
+
+	/* Sanity limit, an hour long track has about 140k frames */
+	if (!hdr.fill || hdr.fill > (1<<24) || hdr.step <= 0 || hdr.length <= 0)
+		goto err1;
+
+	fpath = malloc(path_len);
+	offsets = malloc(sizeof(*offsets) * hdr.fill);
+	index = malloc(sizeof(*index) * hdr.fill);
+
+	if (!fpath || !offsets || !index)
+		goto err1;
+
+	/* Hash collision */
+	if (fread(fpath, path_len, 1, f) != 1 || memcmp(fpath, name, path_len))
+		goto err1;
+
+	if (fread(offsets, sizeof(*offsets), hdr.fill, f) != hdr.fill)
+		goto err1;
+
+	for (i = 0; i < hdr.fill; i++)
+		index[i] = offsets[i];
+
+	if (mpg123_set_index(track->handle, index, hdr.step, hdr.fill) != MPG123_OK) {
+		GP_WARN("Failed to set seek index: %s", mpg123_strerror(track->handle));
+		goto err1;
+	}
+
+	track->length = hdr.length;
+	track->indexed = 1;
+	ret = 0;
+
+	GP_DEBUG(1, "Loaded seek index for '%s' %zu entries", name, (size_t)hdr.fill);
+err1:
+	free(index);
+	free(offsets);
+	free(fpath);
+	fclose(f);
+err0:
+	free(path);
+	return ret;
+}
+
+/*
+ * Copies the handle index, has to be called only once the index covers the
+ * whole file, i.e. after a scan or when the track has been decoded.
+ *
+ * Returns NULL if there is nothing to store.
+ */
+static struct ad_index *index_get(struct ad_track *track)
 {
+	struct ad_index *idx;
+	off_t *index, step;
+	size_t i, fill;
+	off_t length;
+
+	if (track->indexed || !track->file_size)
+		return NULL;
+
+	length = mpg123_length(track->handle);
+	if (length <= 0)
+		return NULL;
+
+	if (mpg123_index(track->handle, &index, &step, &fill) != MPG123_OK || !fill)
+		return NULL;
+
+	idx = malloc(sizeof(*idx) + fill * sizeof(idx->offsets[0]));
+	if (!idx)
+		return NULL;
+
+	idx->path = strdup(track->path);
+	if (!idx->path) {
+		free(idx);
+		return NULL;
+	}
+
+	idx->hdr = (struct index_hdr) {
+		.magic = INDEX_MAGIC,
+		.file_size = track->file_size,
+		.mtime_sec = track->file_mtime.tv_sec,
+		.mtime_nsec = track->file_mtime.tv_nsec,
+		.length = length,
+		.step = step,
+		.fill = fill,
+		.path_len = strlen(track->path),
+	};
+
+	for (i = 0; i < fill; i++)
+		idx->offsets[i] = index[i];
+
+	track->length = length;
+	track->indexed = 1;
+
+	return idx;
+}
+
+static void index_free(struct ad_index *idx)
+{
+	if (!idx)
+		return;
+
+	free(idx->path);
+	free(idx);
+}
+
+/*
+ * Stores a copied index and frees it, does the file I/O hence must not be
+ * called with the stream lock held.
+ */
+static void index_save(struct ad_mpg123 *ad, struct ad_index *idx)
+{
+	char *path, *tmp_path = NULL;
+	FILE *f;
+
+	if (!idx)
+		return;
+
+	path = index_path(ad, idx->path);
+	if (!path)
+		goto err1;
+
+	/* Rename is atomic, we never leave a partially written file behind */
+	if (asprintf(&tmp_path, "%s.tmp", path) < 0) {
+		tmp_path = NULL;
+		goto err0;
+	}
+
+	f = fopen(tmp_path, "wb");
+	if (!f) {
+		GP_WARN("Failed to open '%s': %s", tmp_path, strerror(errno));
+		goto err0;
+	}
+
+	fwrite(&idx->hdr, sizeof(idx->hdr), 1, f);
+	fwrite(idx->path, idx->hdr.path_len, 1, f);
+	fwrite(idx->offsets, sizeof(idx->offsets[0]), idx->hdr.fill, f);
+
+	if (ferror(f) | fclose(f)) {
+		GP_WARN("Failed to write '%s'", tmp_path);
+		unlink(tmp_path);
+		goto err0;
+	}
+
+	if (rename(tmp_path, path)) {
+		GP_WARN("Failed to rename '%s': %s", tmp_path, strerror(errno));
+		unlink(tmp_path);
+		goto err0;
+	}
+
+	GP_DEBUG(1, "Stored seek index for '%s' %zu entries",
+	         idx->path, (size_t)idx->hdr.fill);
+err0:
+	free(tmp_path);
+	free(path);
+err1:
+	index_free(idx);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Tracks are read into RAM in a single sequential read when they are opened,
+ * so that the playback does not wait for the disk and the disk can idle
+ * between tracks. Both the current and the preloaded track count against the
+ * memory limit, tracks that do not fit are read from the disk by mpg123.
+ */
+#define MEM_LIMIT_DEFAULT (128 * 1024 * 1024)
+
+struct ad_file {
+	unsigned char *data;
+	size_t size;
+	size_t pos;
+};
+
+static ssize_t file_read(void *priv, void *buf, size_t count)
+{
+	struct ad_file *file = priv;
+
+	count = GP_MIN(count, file->size - file->pos);
+
+	memcpy(buf, file->data + file->pos, count);
+	file->pos += count;
+
+	return count;
+}
+
+static off_t file_lseek(void *priv, off_t offset, int whence)
+{
+	struct ad_file *file = priv;
+	off_t pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+	break;
+	case SEEK_CUR:
+		pos = file->pos + offset;
+	break;
+	case SEEK_END:
+		pos = file->size + offset;
+	break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pos < 0 || (size_t)pos > file->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	file->pos = pos;
+
+	return pos;
+}
+
+/*
+ * Called from the loader thread, which is the only one that changes
+ * mem_used.
+ */
+static void file_free(struct ad_mpg123 *ad, struct ad_track *track)
+{
+	if (!track->file)
+		return;
+
+	ad->mem_used -= track->file->size;
+	free(track->file->data);
+	free(track->file);
+	track->file = NULL;
+}
+
+static struct ad_file *file_load(struct ad_mpg123 *ad, const char *name, size_t size)
+{
+	size_t limit = ad->mem_limit;
+	uint64_t start = now_ns();
+	struct ad_file *file;
+	size_t off = 0;
+	ssize_t ret;
+	int fd;
+
+	if (!size || ad->mem_used + size > limit) {
+		GP_DEBUG(1, "'%s' does not fit into %zu KiB limit, reading from disk",
+		         name, limit / 1024);
+		return NULL;
+	}
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	file = malloc(sizeof(*file));
+	if (!file)
+		goto err0;
+
+	file->data = malloc(size);
+	if (!file->data)
+		goto err1;
+
+	file->size = size;
+	file->pos = 0;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+	while (off < size) {
+		ret = read(fd, file->data + off, size - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			GP_WARN("Failed to read '%s': %s", name,
+			        ret ? strerror(errno) : "Unexpected EOF");
+			goto err2;
+		}
+
+		off += ret;
+	}
+
+	close(fd);
+
+	ad->mem_used += size;
+
+	GP_DEBUG(1, "Read '%s' %zu KiB in %.1f ms, %zu KiB in RAM", name, size / 1024,
+	         (now_ns() - start) / 1000000.0, ad->mem_used / 1024);
+
+	return file;
+err2:
+	free(file->data);
+err1:
+	free(file);
+err0:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Opens a track and gathers the information needed to play it.
+ *
+ * Must not be called on a track the decoder thread currently decodes.
+ */
+static int track_open(struct ad_mpg123 *ad, struct ad_track *track, const char *name)
+{
+	mpg123_handle *mh = track->handle;
+	long rate, delay, padding, accurate = 0;
+	int channels, encoding;
+	struct stat st;
 	int ret;
-	mpg123_handle *mh = ad_mpg123.handle;
-	struct audio_output *out = ad_mpg123.out;
 
-	if ((ret = mpg123_open(mh, name)) != MPG123_OK) {
+	free(track->path);
+	track->path = NULL;
+	track->indexed = 0;
+	track->file_size = 0;
+
+	mpg123_close(mh);
+	file_free(ad, track);
+
+	if (!stat(name, &st)) {
+		track->file_size = st.st_size;
+		track->file_mtime = st.st_mtim;
+		track->file = file_load(ad, name, st.st_size);
+	}
+
+	if (track->file)
+		ret = mpg123_open_handle(mh, track->file);
+	else
+		ret = mpg123_open(mh, name);
+
+	if (ret != MPG123_OK) {
 		GP_WARN("Failed to open '%s': %s",
 		        name, mpg123_plain_strerror(ret));
 		return 1;
 	}
 
-	// Setup alsa output
-	long rate;
-	int channels;
-	int encoding;
-
 	if ((ret = mpg123_getformat(mh, &rate, &channels, &encoding)) != MPG123_OK) {
 		GP_WARN("Failed to get format: %s", mpg123_plain_strerror(ret));
 		return 1;
 	}
 
-	ad_mpg123.rate = rate;
+	track->rate = rate;
+	track->channels = channels;
+	track->fmt = convert_fmt(encoding);
 
-	if (audio_output_setup(out, channels, convert_fmt(encoding), rate)) {
-		GP_WARN("Failed to set output format");
+	if ((int)track->fmt < 0) {
+		GP_WARN("Unsupported output format");
 		return 1;
 	}
 
-	// Now id3 tags
+	track->path = strdup(name);
+
+	/*
+	 * Length from a Xing/LAME header is exact, the seek index is then
+	 * built while the track is decoded and stored at its end.
+	 */
+	if (index_load(ad, track, name)) {
+		mpg123_getstate(mh, MPG123_ACCURATE, &accurate, NULL);
+
+		if (!accurate) {
+			GP_DEBUG(1, "Scanning '%s'", name);
+			mpg123_scan(mh);
+			index_save(ad, index_get(track));
+		}
+
+		track->length = mpg123_length(mh);
+	}
+
+	track->duration = 1000.0 * (double)track->length / rate + 0.5;
+
+	/* Encoder delay and padding are skipped by the MPG123_GAPLESS flag */
+	if (!mpg123_getstate(mh, MPG123_ENC_DELAY, &delay, NULL) &&
+	    !mpg123_getstate(mh, MPG123_ENC_PADDING, &padding, NULL))
+		GP_DEBUG(1, "Encoder delay %li padding %li samples", delay, padding);
+
+	return 0;
+}
+
+static void track_send_info(struct ad_mpg123 *ad, struct ad_track *track)
+{
+	mpg123_handle *mh = track->handle;
 	mpg123_id3v1 *v1 = NULL;
 	mpg123_id3v2 *v2 = NULL;
+	int ret;
+
+	audio_decoder_track_duration(&ad->inst, track->duration);
 
 	if ((ret = mpg123_id3(mh, &v1, &v2))) {
 		GP_DEBUG(1, "Failed to fetch id3 tags: %s",
 		            mpg123_plain_strerror(ret));
 	}
 
-	// Do scan to compute length correctly
-//	if (config.scan_duration)
-		mpg123_scan(mh);
-
-	long duration = 1000.0 * (double)mpg123_length(mh) / rate + 0.5;
-
-	audio_decoder_track_duration(duration);
-
 	if (v2) {
-		audio_decoder_track_info(v2->artist ? v2->artist->p : NULL,
+		audio_decoder_track_info(&ad->inst, v2->artist ? v2->artist->p : NULL,
 				         v2->album ? v2->album->p : NULL,
 				         v2->title ? v2->title->p : NULL);
 
 		size_t i;
 
 		for (i = 0; i < v2->pictures; i++)
-			audio_decoder_track_art(v2->picture[i].data, v2->picture[i].size);
+			audio_decoder_track_art(&ad->inst, v2->picture[i].data, v2->picture[i].size);
 
-		return 0;
+		return;
 	}
 
 	if (v1) {
-		audio_decoder_track_info(v1->artist, v1->album, v1->title);
+		audio_decoder_track_info(&ad->inst, v1->artist, v1->album, v1->title);
+		return;
+	}
+
+	audio_decoder_track_info(&ad->inst, NULL, NULL, NULL);
+}
+
+static int track_is(struct ad_track *track, const char *name)
+{
+	return track->path && !strcmp(track->path, name);
+}
+
+/*
+ * Starts playing the opened next track, called with the stream lock held.
+ */
+static void track_start_next(struct ad_mpg123 *ad)
+{
+	ad->next_ready = 0;
+	GP_SWAP(ad->cur, ad->next);
+
+	audio_stream_start(&ad->stream, ad->cur.channels,
+	                   ad->cur.fmt, ad->cur.rate, 0);
+
+	ad->loaded = 1;
+	ad->ttfa_pending = 1;
+	audio_stream_event_post(&ad->stream, EV_LOADED);
+}
+
+static void negotiate_format(struct ad_mpg123 *ad, mpg123_handle *mh);
+
+/*
+ * Opens a track on the next handle with the stream lock released.
+ */
+static int loader_open(struct ad_mpg123 *ad, const char *path)
+{
+	struct audio_stream *stream = &ad->stream;
+	int ret;
+
+	ad->next_ready = 0;
+	ad->loading = 1;
+
+	audio_stream_unlock(stream);
+	ret = track_open(ad, &ad->next, path);
+	audio_stream_lock(stream);
+
+	ad->loading = 0;
+	ad->next_ready = !ret && !ad->preload_drop;
+	ad->preload_drop = 0;
+
+	if (ad->next_renegotiate) {
+		ad->next_renegotiate = 0;
+		negotiate_format(ad, ad->next.handle);
+	}
+
+	return ret;
+}
+
+static void loader_load(struct ad_mpg123 *ad, char *path)
+{
+	if (!ad->next_ready || !track_is(&ad->next, path)) {
+		if (loader_open(ad, path)) {
+			if (!ad->load_req)
+				audio_stream_event_post(&ad->stream, EV_FAILED);
+			return;
+		}
+	}
+
+	/* Superseded while we were opening the file */
+	if (ad->load_req)
+		return;
+
+	track_start_next(ad);
+
+	GP_DEBUG(1, "Loaded '%s' in %.1f ms", path,
+	         (now_ns() - ad->load_ns) / 1000000.0);
+}
+
+static void loader_preload(struct ad_mpg123 *ad, char *path)
+{
+	/*
+	 * The next handle holds the tail of the previous track until the
+	 * application loads the track the decoder has switched to.
+	 */
+	if (ad->switched ||
+	    (ad->next_ready && track_is(&ad->next, path)))
+		return;
+
+	GP_DEBUG(1, "Preloading '%s'", path);
+
+	loader_open(ad, path);
+}
+
+/*
+ * Opens files, reads tags and scans for the seek index, which may take long,
+ * so that the application main loop does not block. Also stores the seek
+ * indexes built by the decoder thread.
+ */
+static void *loader_thread(void *priv)
+{
+	struct ad_mpg123 *ad = priv;
+	struct audio_stream *stream = &ad->stream;
+	struct ad_index *idx;
+	char *path;
+
+	audio_stream_lock(stream);
+
+	while (!ad->loader_exit) {
+		if ((path = ad->load_req)) {
+			ad->load_req = NULL;
+			ad->load_active = 1;
+			loader_load(ad, path);
+			ad->load_active = 0;
+		} else if ((path = ad->preload_req)) {
+			ad->preload_req = NULL;
+			loader_preload(ad, path);
+		} else if ((idx = ad->index_req)) {
+			ad->index_req = NULL;
+			audio_stream_unlock(stream);
+			index_save(ad, idx);
+			audio_stream_lock(stream);
+			continue;
+		} else {
+			pthread_cond_wait(&ad->loader_cond, &stream->lock);
+			continue;
+		}
+
+		free(path);
+	}
+
+	audio_stream_unlock(stream);
+
+	return NULL;
+}
+
+static void loader_request(struct ad_mpg123 *ad, char **req, const char *path)
+{
+	char *new_path = strdup(path);
+
+	if (!new_path) {
+		GP_WARN("Malloc failed :(");
+		return;
+	}
+
+	free(*req);
+	*req = new_path;
+
+	pthread_cond_signal(&ad->loader_cond);
+}
+
+/*
+ * Loads are asynchronous, the track starts playing and the info is sent from
+ * tick() once the loader thread has opened the file.
+ */
+static int audio_decoder_track_load_mpg123(struct audio_decoder_inst *self, const char *name)
+{
+	struct ad_mpg123 *ad = to_ad_mpg123(self);
+	struct audio_stream *stream = &ad->stream;
+
+	audio_stream_lock(stream);
+
+	ad->load_ns = now_ns();
+
+	/* Decoder has already switched to the track seamlessly */
+	if (ad->switched && track_is(&ad->cur, name)) {
+		ad->switched = 0;
+
+		/*
+		 * Loaded before the previous track has finished, e.g. skipped
+		 * by the user, the end of the previous track is still in the
+		 * ring, start from the beginning instead.
+		 */
+		if (!ad->switch_eof) {
+			GP_DEBUG(1, "Restarting '%s'", name);
+			mpg123_seek(ad->cur.handle, 0, SEEK_SET);
+			audio_stream_start(stream, ad->cur.channels,
+			                   ad->cur.fmt, ad->cur.rate, 0);
+		} else {
+			GP_DEBUG(1, "Gapless switch to '%s'", name);
+		}
+
+		track_send_info(ad, &ad->cur);
+		audio_stream_unlock(stream);
 		return 0;
 	}
 
-	audio_decoder_track_info(NULL, NULL, NULL);
+	ad->switched = 0;
+
+	/* Preloaded track does not need the loader */
+	if (!ad->loading && !ad->load_req &&
+	    ad->next_ready && track_is(&ad->next, name)) {
+		track_start_next(ad);
+		audio_stream_unlock(stream);
+		return 0;
+	}
+
+	audio_stream_stop(stream);
+	loader_request(ad, &ad->load_req, name);
+
+	audio_stream_unlock(stream);
 
 	return 0;
 }
 
-static int audio_decoder_track_ctrl_mpg123(enum audio_decoder_ctrl ctrl)
+static int audio_decoder_track_preload_mpg123(struct audio_decoder_inst *self, const char *name)
 {
+	struct ad_mpg123 *ad = to_ad_mpg123(self);
+	struct audio_stream *stream = &ad->stream;
+
+	audio_stream_lock(stream);
+
+	if (name) {
+		loader_request(ad, &ad->preload_req, name);
+	} else {
+		free(ad->preload_req);
+		ad->preload_req = NULL;
+
+		/* The next handle holds the previous track after a switch */
+		if (ad->loading)
+			ad->preload_drop = 1;
+		else if (!ad->switched)
+			ad->next_ready = 0;
+	}
+
+	audio_stream_unlock(stream);
+
+	return 0;
+}
+
+static int audio_decoder_track_ctrl_mpg123(struct audio_decoder_inst *self, enum audio_decoder_ctrl ctrl)
+{
+	struct ad_mpg123 *ad = to_ad_mpg123(self);
 	switch (ctrl) {
 	case AUDIO_DECODER_PLAY:
-		audio_output_start(ad_mpg123.out);
+		audio_stream_pause(&ad->stream, 0);
 	break;
 	case AUDIO_DECODER_PAUSE:
-		audio_output_stop(ad_mpg123.out);
+		audio_stream_pause(&ad->stream, 1);
 	break;
 	}
 
 	return 0;
 }
 
-static unsigned long audio_decoder_tick_mpg123(void)
+/*
+ * Runs in the stream decoder thread with the stream lock held.
+ */
+static int decode_mpg123(struct audio_stream *self, void *buf, size_t buf_size, size_t *size)
 {
-	size_t size;
-	mpg123_handle *mh = ad_mpg123.handle;
-	struct audio_output *out = ad_mpg123.out;
-	int avail = audio_buf_avail(out);
-	unsigned char buf[avail];
+	struct ad_mpg123 *ad = self->priv;
+	struct ad_track *next = &ad->next;
 	int ret;
-	static unsigned long tick_ms = 1;
 
-	if (avail < 1024) {
-		tick_ms = GP_MIN(100u, tick_ms * 2);
-		GP_DEBUG(1, "Autotune timer tick to %lu (avail=%i)", tick_ms, avail);
-		return tick_ms;
+	ret = mpg123_read(ad->cur.handle, buf, buf_size, size);
+
+	switch (ret) {
+	case MPG123_OK:
+	case MPG123_NEW_FORMAT:
+		return 0;
+	case MPG123_DONE:
+		if (ad->cur.path && !ad->cur.indexed) {
+			/* Written by the loader thread, a pending one is dropped */
+			index_free(ad->index_req);
+			ad->index_req = index_get(&ad->cur);
+			pthread_cond_signal(&ad->loader_cond);
+		}
+	break;
+	default:
+		GP_WARN("Decoding failed: %s", mpg123_plain_strerror(ret));
+		return 1;
+	}
+
+	if (!ad->next_ready)
+		return 1;
+
+	/* Continue with the preloaded track without a gap */
+	GP_DEBUG(1, "Switching to '%s'", next->path);
+
+	GP_SWAP(ad->cur, ad->next);
+	ad->next_ready = 0;
+	ad->switched = 1;
+	ad->switch_eof = 0;
+
+	audio_stream_queue(self, ad->cur.channels, ad->cur.fmt,
+	                   ad->cur.rate);
+
+	return 0;
+}
+
+/*
+ * Time to first audio, from track_load() to the first frames written to the
+ * device, is logged for each load so that regressions are easy to spot.
+ */
+static void ttfa_update(struct ad_mpg123 *ad, uint64_t started_ns)
+{
+	uint64_t ttfa;
+
+	if (!ad->ttfa_pending)
+		return;
+
+	ad->ttfa_pending = 0;
+
+	ttfa = started_ns - ad->load_ns;
+
+	ad->ttfa_cnt++;
+	ad->ttfa_sum_ns += ttfa;
+	ad->ttfa_max_ns = GP_MAX(ad->ttfa_max_ns, ttfa);
+
+	GP_DEBUG(1, "Time to first audio %.1f ms (avg %.1f ms max %.1f ms over %u loads)",
+	         ttfa / 1000000.0,
+	         ad->ttfa_sum_ns / 1000000.0 / ad->ttfa_cnt,
+	         ad->ttfa_max_ns / 1000000.0, ad->ttfa_cnt);
+}
+
+static unsigned long audio_decoder_tick_mpg123(struct audio_decoder_inst *self)
+{
+	struct ad_mpg123 *ad = to_ad_mpg123(self);
+	struct audio_stream *stream = &ad->stream;
+	unsigned int events = audio_stream_events(stream);
+
+	if (events & EV_LOADED) {
+		audio_stream_lock(stream);
+
+		if (ad->loaded) {
+			ad->loaded = 0;
+			track_send_info(ad, &ad->cur);
+		}
+
+		audio_stream_unlock(stream);
 	}
 
-	if (avail > 8196) {
-		tick_ms = GP_MAX(1u, tick_ms/2);
-		GP_DEBUG(1, "Autotune timer tick to %lu (avail=%i)", tick_ms, avail);
+	if (events & AUDIO_STREAM_EV_STARTED)
+		ttfa_update(ad, audio_stream_started_ns(stream));
+
+	/* Skip files we cannot play */
+	if (events & EV_FAILED) {
+		audio_decoder_track_info(&ad->inst, NULL, NULL, NULL);
+		audio_decoder_track_finished(self);
 	}
 
-	ret = mpg123_read(mh, buf, sizeof(buf), &size);
+	if (events & AUDIO_STREAM_EV_POS)
+		audio_decoder_track_pos(self, audio_stream_pos_ms(stream));
 
-	if (ret == MPG123_DONE)
-		audio_decoder_track_finished();
-	else
-		audio_output_write(out, buf, AUDIO_BUFSIZE_TO_SAMPLES(out, size));
+	if (events & AUDIO_STREAM_EV_FINISHED) {
+		/* The application loads the track we have switched to */
+		audio_stream_lock(stream);
+		ad->switch_eof = ad->switched;
+		audio_stream_unlock(stream);
+
+		audio_decoder_track_finished(self);
+	}
 
-	long off = 1000.0 * (double)mpg123_tell(mh) / out->sample_rate + 0.5;
+	if (events & AUDIO_STREAM_EV_LATENCY) {
+		audio_decoder_output_latency_set(self, ad->out->device,
+		                                 audio_stream_latency_us(stream));
+	}
 
-	audio_decoder_track_pos(off);
+	return 0;
+}
 
-	return tick_ms;
+static int audio_decoder_poll_fd_mpg123(struct audio_decoder_inst *self)
+{
+	struct ad_mpg123 *ad = to_ad_mpg123(self);
+	return ad->stream.event_fd;
 }
 
-static int audio_decoder_track_seek_mpg123(long seek_ms)
+static int audio_decoder_track_seek_mpg123(struct audio_decoder_inst *self, long seek_ms)
 {
-	mpg123_seek(ad_mpg123.handle, seek_ms * ad_mpg123.rate / 1000, SEEK_SET);
+	struct ad_mpg123 *ad = to_ad_mpg123(self);
+	struct audio_stream *stream = &ad->stream;
+	struct ad_track *cur = &ad->cur;
+	off_t pos;
+
+	audio_stream_lock(stream);
+
+	/* The current track is being replaced */
+	if (ad->load_req || ad->load_active) {
+		audio_stream_unlock(stream);
+		return 0;
+	}
+
+	/*
+	 * The previous track is still being played, switch back, the part of
+	 * the next track that has been decoded is dropped from the ring.
+	 */
+	if (ad->switched) {
+		GP_SWAP(ad->cur, ad->next);
+		mpg123_seek(ad->next.handle, 0, SEEK_SET);
+		ad->next_ready = 1;
+		ad->switched = 0;
+	}
+
+	pos = mpg123_seek(cur->handle, seek_ms * cur->rate / 1000, SEEK_SET);
+	if (pos >= 0)
+		audio_stream_start(stream, cur->channels, cur->fmt, cur->rate, pos);
+
+	audio_stream_unlock(stream);
+
 	return 0;
 }
 
-unsigned long audio_decoder_softvol_mpg123(enum audio_decoder_softvol_op op, unsigned long vol)
+static unsigned long audio_decoder_softvol_mpg123(struct audio_decoder_inst *self, enum audio_decoder_softvol_op op, unsigned long vol)
 {
-	double ret;
+	struct ad_mpg123 *ad = to_ad_mpg123(self);
+	struct audio_stream *stream = &ad->stream;
 
 	switch (op) {
 	case AUDIO_DECODER_SOFTVOL_SET:
-		mpg123_volume(ad_mpg123.handle, 1.0 * vol / 100);
+		audio_stream_volume_set(stream, vol);
 	break;
 	case AUDIO_DECODER_SOFTVOL_GET:
-		mpg123_getvolume(ad_mpg123.handle, &ret, NULL, NULL);
-		return 100 * ret;
-	break;
+		return audio_stream_volume(stream);
 	}
 
 	return 0;
 }
 
+static void audio_decoder_resample_mpg123(struct audio_decoder_inst *self, enum audio_decoder_resample quality)
+{
+	struct ad_mpg123 *ad = to_ad_mpg123(self);
+	struct audio_stream *stream = &ad->stream;
+	struct audio_output *out = ad->out;
+
+	audio_stream_lock(stream);
+
+	ad->resample = quality;
+	audio_stream_resample_set(stream, (enum audio_resample_quality)quality,
+	                          audio_output_rate_preferred(out));
+
+	/*
+	 * Applies to files opened afterwards, the next handle is owned by the
+	 * loader thread while it's opening a track, it's updated by the loader
+	 * once the track is opened.
+	 */
+	negotiate_format(ad, ad->cur.handle);
+
+	if (ad->loading)
+		ad->next_renegotiate = 1;
+	else
+		negotiate_format(ad, ad->next.handle);
+
+	audio_stream_unlock(stream);
+}
+
+static void audio_decoder_mem_limit_mpg123(struct audio_decoder_inst *self, size_t limit)
+{
+	struct ad_mpg123 *ad = to_ad_mpg123(self);
+
+	/* Applies to tracks opened afterwards */
+	ad->mem_limit = limit;
+}
+
+static void audio_decoder_destroy_mpg123(struct audio_decoder_inst *self);
+
 static const struct audio_decoder_ops audio_decoder_ops_mpg123 = {
 	.track_load = audio_decoder_track_load_mpg123,
+	.track_preload = audio_decoder_track_preload_mpg123,
 	.track_ctrl = audio_decoder_track_ctrl_mpg123,
 	.track_seek = audio_decoder_track_seek_mpg123,
 	.softvol = audio_decoder_softvol_mpg123,
 	.tick = audio_decoder_tick_mpg123,
+	.poll_fd = audio_decoder_poll_fd_mpg123,
+	.resample = audio_decoder_resample_mpg123,
+	.mem_limit = audio_decoder_mem_limit_mpg123,
+	.destroy = audio_decoder_destroy_mpg123,
 };
 
-const struct audio_decoder_ops *audio_decoder_mpg123(const struct audio_decoder_callbacks *cbs)
+/*
+ * Restricts decoder output to formats the device takes natively, so that the
+ * tracks play without conversions in the alsa plug layer.
+ */
+static void negotiate_format(struct ad_mpg123 *ad, mpg123_handle *mh)
+{
+	struct audio_output *out = ad->out;
+	int any_rate = ad->resample != AUDIO_DECODER_RESAMPLE_OFF;
+	int supported = mpg123_encodings2();
+	int encs = 0, channels = 0;
+	const long *rates;
+	size_t i, rates_cnt, native_rates = 0;
+
+	for (i = 0; i < GP_ARRAY_SIZE(encodings); i++) {
+		if ((supported & encodings[i].encoding) == encodings[i].encoding &&
+		    audio_output_fmt_native(out, encodings[i].fmt))
+			encs |= encodings[i].encoding;
+	}
+
+	if (audio_output_channels_native(out, 1))
+		channels |= MPG123_MONO;
+
+	if (audio_output_channels_native(out, 2))
+		channels |= MPG123_STEREO;
+
+	if (!encs || !channels) {
+		GP_DEBUG(1, "No native output format, leaving conversions to alsa");
+		return;
+	}
+
+	mpg123_rates(&rates, &rates_cnt);
+
+	for (i = 0; i < rates_cnt; i++)
+		native_rates += audio_output_rate_native(out, rates[i]);
+
+	mpg123_format_none(mh);
+
+	/*
+	 * Resampling is left to mpg123 unless no rate is supported natively or
+	 * our resampler is enabled.
+	 */
+	for (i = 0; i < rates_cnt; i++) {
+		if (any_rate || !native_rates || audio_output_rate_native(out, rates[i]))
+			mpg123_format(mh, rates[i], channels, encs);
+	}
+
+	GP_DEBUG(1, "Negotiated encodings 0x%x channels 0x%x, %zu native rates",
+	         encs, channels, native_rates);
+}
+
+/*
+ * The library is shared by all instances, it's initialized when the first
+ * instance is created and released with the last one.
+ */
+static pthread_mutex_t lib_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int lib_refs;
+
+static int lib_get(void)
 {
-	mpg123_pars *mp;
+	int res = MPG123_OK;
+
+	pthread_mutex_lock(&lib_lock);
+
+	if (!lib_refs)
+		res = mpg123_init();
+
+	if (res == MPG123_OK)
+		lib_refs++;
+	else
+		GP_WARN("Failed to initalize mpg123: %s", mpg123_plain_strerror(res));
+
+	pthread_mutex_unlock(&lib_lock);
+
+	return res != MPG123_OK;
+}
+
+static void lib_put(void)
+{
+	pthread_mutex_lock(&lib_lock);
+
+	if (!--lib_refs)
+		mpg123_exit();
+
+	pthread_mutex_unlock(&lib_lock);
+}
+
+/*
+ * The fastest synth decoder depends on the CPU and the library default is not
+ * always the best choice. The supported decoders are timed once on a built-in
+ * bitstream and the winner is stored per CPU model.
+ */
+#define BENCH_FRAMES 128
+#define BENCH_RUNS 3
+/* MPEG 1 Layer III, 128 kbit/s, 44.1 kHz, joint stereo, no CRC */
+#define BENCH_HEADER 0xfffb9064
+#define BENCH_FRAME_SIZE 417
+#define BENCH_RATE 44100
+
+/* Selected synth decoder, empty for the library default */
+static char synth[32];
+static int synth_selected;
+
+static void cpu_model(char *buf, size_t size)
+{
+	static const char *const keys[] = {"model name", "cpu model", "cpu", "CPU part"};
+	unsigned int i, best = GP_ARRAY_SIZE(keys);
+	char line[256];
+	FILE *f;
+
+	snprintf(buf, size, "unknown");
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return;
+
+	while (best && fgets(line, sizeof(line), f)) {
+		char *val = strchr(line, ':');
+		char *end;
+
+		if (!val)
+			continue;
+
+		for (end = val; end > line && isspace(end[-1]); end--);
+		*end = 0;
+
+		for (val++; isspace(*val); val++);
+		val[strcspn(val, "\n")] = 0;
+
+		for (i = 0; i < best; i++) {
+			if (!strcmp(line, keys[i]) && *val) {
+				snprintf(buf, size, "%s", val);
+				best = i;
+				break;
+			}
+		}
+	}
+
+	fclose(f);
+}
+
+/*
+ * Silent frames, all side information is zero which still runs the full
+ * synthesis filterbank.
+ */
+static unsigned char *bench_stream(size_t *size)
+{
+	unsigned char *buf;
+	unsigned int i;
+
+	*size = BENCH_FRAMES * BENCH_FRAME_SIZE;
+
+	buf = calloc(1, *size);
+	if (!buf)
+		return NULL;
+
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		unsigned char *frame = buf + i * BENCH_FRAME_SIZE;
+
+		frame[0] = (BENCH_HEADER >> 24) & 0xff;
+		frame[1] = (BENCH_HEADER >> 16) & 0xff;
+		frame[2] = (BENCH_HEADER >> 8) & 0xff;
+		frame[3] = BENCH_HEADER & 0xff;
+	}
+
+	return buf;
+}
+
+/*
+ * Returns the best real time factor of a few runs or zero on a failure.
+ */
+static double bench_synth(const char *name, const unsigned char *stream, size_t size)
+{
+	unsigned char out[4 * 1152];
+	double best = 0;
+	mpg123_handle *mh;
+	unsigned int run;
 	int res;
 
-	if ((res = mpg123_init()) != MPG123_OK) {
-		GP_WARN("Failed to initalize mpg123: %s",
-		           mpg123_plain_strerror(res));
-		goto err0;
+	mh = mpg123_new(name, &res);
+	if (!mh)
+		return 0;
+
+	mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+	mpg123_format_none(mh);
+	mpg123_format(mh, BENCH_RATE, MPG123_STEREO, MPG123_ENC_SIGNED_16);
+
+	for (run = 0; run < BENCH_RUNS; run++) {
+		size_t done, bytes = 0;
+		uint64_t start;
+		double rtf;
+
+		if (mpg123_open_feed(mh) != MPG123_OK)
+			break;
+
+		start = now_ns();
+
+		mpg123_feed(mh, stream, size);
+
+		do {
+			res = mpg123_read(mh, out, sizeof(out), &done);
+			bytes += done;
+		} while (res == MPG123_OK || res == MPG123_NEW_FORMAT);
+
+		rtf = (double)bytes / (4 * BENCH_RATE) / ((now_ns() - start) / 1e9);
+
+		mpg123_close(mh);
+
+		if (!bytes)
+			break;
+
+		best = GP_MAX(best, rtf);
 	}
 
-	mp = mpg123_new_pars(&res);
+	mpg123_delete(mh);
 
-	if (!mp) {
-		GP_WARN("Failed to get mpg123 parameters: %s",
-		           mpg123_plain_strerror(res));
-		goto err1;
+	return best;
+}
+
+static int synth_supported(const char *name)
+{
+	const char **decoders = mpg123_supported_decoders();
+	unsigned int i;
+
+	for (i = 0; decoders[i]; i++) {
+		if (!strcmp(decoders[i], name))
+			return 1;
 	}
 
-	ad_mpg123.handle = mpg123_new(NULL, &res);
+	return 0;
+}
+
+static void synth_bench(void)
+{
+	const char **decoders = mpg123_supported_decoders();
+	double rtf, best_rtf = 0;
+	unsigned char *stream;
+	unsigned int i;
+	size_t size;
+
+	stream = bench_stream(&size);
+	if (!stream)
+		return;
+
+	for (i = 0; decoders[i]; i++) {
+		rtf = bench_synth(decoders[i], stream, size);
+
+		GP_DEBUG(1, "mpg123 synth '%s' %.0fx real time", decoders[i], rtf);
+
+		if (rtf > best_rtf) {
+			best_rtf = rtf;
+			snprintf(synth, sizeof(synth), "%s", decoders[i]);
+		}
+	}
+
+	free(stream);
+
+	if (synth[0])
+		GP_DEBUG(1, "Fastest mpg123 synth '%s' %.0fx real time", synth, best_rtf);
+}
+
+/*
+ * Selects the synth decoder once for all instances, the stored selection is
+ * used unless the library no longer supports it.
+ */
+static void synth_select(struct ad_mpg123 *ad)
+{
+	char cpu[128];
+
+	pthread_mutex_lock(&lib_lock);
+
+	if (synth_selected)
+		goto out;
+
+	synth_selected = 1;
+
+	cpu_model(cpu, sizeof(cpu));
+
+	if (!audio_decoder_synth_get(&ad->inst, cpu, synth, sizeof(synth))) {
+		if (synth_supported(synth)) {
+			GP_DEBUG(1, "Using stored mpg123 synth '%s' for '%s'", synth, cpu);
+			goto out;
+		}
+
+		GP_DEBUG(1, "Stored mpg123 synth '%s' not supported", synth);
+		synth[0] = 0;
+	}
 
-	if (!ad_mpg123.handle) {
+	synth_bench();
+
+	if (synth[0])
+		audio_decoder_synth_set(&ad->inst, cpu, synth);
+out:
+	pthread_mutex_unlock(&lib_lock);
+}
+
+static mpg123_handle *new_handle(struct ad_mpg123 *ad)
+{
+	mpg123_handle *mh;
+	int res;
+
+	mh = mpg123_new(synth[0] ? synth : NULL, &res);
+	if (!mh) {
 		GP_WARN("Failed to create mpg123 handle: %s",
 		           mpg123_plain_strerror(res));
-		goto err1;
+		return NULL;
 	}
 
-	mpg123_param(ad_mpg123.handle, MPG123_ADD_FLAGS, MPG123_PICTURE, 1.0);
+	mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_PICTURE, 1.0);
+	mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_GAPLESS, 1.0);
+	mpg123_replace_reader_handle(mh, file_read, file_lseek, NULL);
 
-	ad_mpg123.out = audio_output_create(AUDIO_DEVICE_DEFAULT, 2, AUDIO_FORMAT_S16, 48000);
-	if (!ad_mpg123.out) {
+	negotiate_format(ad, mh);
+
+	GP_DEBUG(1, "Created mpg123 handle with '%s' synth", mpg123_current_decoder(mh));
+
+	return mh;
+}
+
+static void track_free(struct ad_mpg123 *ad, struct ad_track *track)
+{
+	if (track->handle)
+		mpg123_delete(track->handle);
+
+	file_free(ad, track);
+	free(track->path);
+}
+
+static void audio_decoder_destroy_mpg123(struct audio_decoder_inst *self)
+{
+	struct ad_mpg123 *ad = to_ad_mpg123(self);
+	struct audio_stream *stream = &ad->stream;
+
+	audio_stream_lock(stream);
+	ad->loader_exit = 1;
+	pthread_cond_signal(&ad->loader_cond);
+	audio_stream_unlock(stream);
+
+	pthread_join(ad->loader_thread, NULL);
+	pthread_cond_destroy(&ad->loader_cond);
+
+	audio_stream_exit(stream);
+	audio_output_destroy(ad->out);
+
+	track_free(ad, &ad->cur);
+	track_free(ad, &ad->next);
+	free(ad->load_req);
+	free(ad->preload_req);
+	index_free(ad->index_req);
+	free(ad);
+
+	lib_put();
+}
+
+struct audio_decoder_inst *audio_decoder_mpg123(const struct audio_decoder_callbacks *cbs, void *priv)
+{
+	struct ad_mpg123 *ad;
+
+	if (lib_get())
+		return NULL;
+
+	ad = calloc(1, sizeof(*ad));
+	if (!ad) {
+		GP_WARN("Malloc failed :(");
+		goto err0;
+	}
+
+	audio_decoder_inst_init(&ad->inst, &audio_decoder_ops_mpg123, cbs, priv);
+	ad->mem_limit = MEM_LIMIT_DEFAULT;
+
+	synth_select(ad);
+
+	ad->out = audio_output_create(AUDIO_DEVICE_DEFAULT, 2, AUDIO_FORMAT_S16, 48000,
+	                              audio_decoder_output_latency_get(&ad->inst, AUDIO_DEVICE_DEFAULT));
+	if (!ad->out) {
 		GP_WARN("Failed to initialize audio output");
 		goto err1;
 	}
 
-	audio_decoder_cbs = cbs;
+	ad->cur.handle = new_handle(ad);
+	ad->next.handle = new_handle(ad);
+
+	if (!ad->cur.handle || !ad->next.handle)
+		goto err2;
+
+	if (audio_stream_init(&ad->stream, ad->out, decode_mpg123, ad)) {
+		GP_WARN("Failed to initialize audio stream");
+		goto err2;
+	}
+
+	pthread_cond_init(&ad->loader_cond, NULL);
+
+	if (pthread_create(&ad->loader_thread, NULL, loader_thread, ad)) {
+		GP_WARN("Failed to create loader thread");
+		goto err3;
+	}
 
-	return &audio_decoder_ops_mpg123;
+	return &ad->inst;
+err3:
+	pthread_cond_destroy(&ad->loader_cond);
+	audio_stream_exit(&ad->stream);
+err2:
+	track_free(ad, &ad->cur);
+	track_free(ad, &ad->next);
+	audio_output_destroy(ad->out);
 err1:
-	mpg123_exit();
+	free(ad);
 err0:
+	lib_put();
 	return NULL;
 }
@@ -5,27 +5,227 @@
 
  */
 
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <mpv/client.h>
 #include <core/gp_debug.h>
 
-static const struct audio_decoder_callbacks *audio_decoder_cbs;
-
 #include "audio_decoder_priv.h"
 
-static mpv_handle *ctx;
+struct ad_mpv {
+	struct audio_decoder_inst inst;
+
+	mpv_handle *ctx;
+
+	/* Signalled by mpv when there are new events in the queue */
+	int wakeup_fd;
+
+	/*
+	 * At most one seek is in flight, seeks requested meanwhile only update
+	 * the next position, so that dragging the seek bar does not queue up
+	 * seeks.
+	 */
+	struct {
+		int in_flight;
+		int pending;
+		long pending_ms;
+	} seek;
+
+	/* Volume is cached locally, mpv is never asked for it */
+	double volume;
+
+	/*
+	 * The mpv playlist mirrors a window of our playlist, the current track
+	 * and the track that is played next, so that mpv can prefetch the next
+	 * track and continue without tearing down the audio output.
+	 *
+	 * When mpv moves to the next entry on its own we report that the track
+	 * has finished, the application then moves to the next track in its
+	 * playlist and calls track_load() with the track mpv is already
+	 * playing.
+	 */
+	struct {
+		/* Path appended to the mpv playlist after the current track */
+		char *path;
+		/* Set if the path is in mpv playlist after the current track */
+		int queued;
+		/* Set if mpv has moved to the path on its own */
+		int advanced;
+	} next;
+};
+
+static struct ad_mpv *to_ad_mpv(struct audio_decoder_inst *self)
+{
+	return (struct ad_mpv *)self;
+}
+
+/*
+ * Called from an mpv thread, we must not call any mpv functions here, so we
+ * just wake up the main loop which calls tick() in turn.
+ */
+static void wakeup_callback(void *priv)
+{
+	struct ad_mpv *ad = priv;
+	uint64_t val = 1;
+
+	if (write(ad->wakeup_fd, &val, sizeof(val)) != sizeof(val) && errno != EAGAIN)
+		GP_WARN("Failed to write eventfd: %s", strerror(errno));
+}
+
+static void wakeup_drain(struct ad_mpv *ad)
+{
+	uint64_t val;
+
+	if (read(ad->wakeup_fd, &val, sizeof(val)) != sizeof(val) && errno != EAGAIN)
+		GP_WARN("Failed to read eventfd: %s", strerror(errno));
+}
+
+/* Identifies replies to asynchronous requests */
+enum reply {
+	REPLY_NONE,
+	REPLY_LOAD,
+	REPLY_APPEND,
+	REPLY_CLEAR,
+	REPLY_PAUSE,
+	REPLY_SEEK,
+	REPLY_VOLUME,
+};
+
+static const char *reply_name(uint64_t reply)
+{
+	switch (reply) {
+	case REPLY_LOAD:
+		return "loadfile";
+	case REPLY_APPEND:
+		return "loadfile append";
+	case REPLY_CLEAR:
+		return "playlist-clear";
+	case REPLY_PAUSE:
+		return "pause";
+	case REPLY_SEEK:
+		return "seek";
+	case REPLY_VOLUME:
+		return "volume";
+	}
+
+	return "???";
+}
+
+/*
+ * Removes all but the current entry from the mpv playlist, i.e. the queued
+ * track as well as the tracks that have been played already.
+ */
+static void next_clear(struct ad_mpv *ad)
+{
+	const char *cmd[] = {"playlist-clear", NULL};
+
+	mpv_command_async(ad->ctx, REPLY_CLEAR, cmd);
 
-static int audio_decoder_track_load_mpv(const char *path)
+	free(ad->next.path);
+	ad->next.path = NULL;
+	ad->next.queued = 0;
+	ad->next.advanced = 0;
+}
+
+static int audio_decoder_track_load_mpv(struct audio_decoder_inst *self, const char *path)
 {
-	const char *cmd[] = {"loadfile", path, NULL};
+	struct ad_mpv *ad = to_ad_mpv(self);
+	const char *cmd[] = {"loadfile", path, "replace", NULL};
+	int ret;
+
+	/* Seeks requested for the previous track are meaningless now */
+	ad->seek.pending = 0;
+
+	if (ad->next.advanced && !strcmp(path, ad->next.path)) {
+		GP_DEBUG(1, "Continuing with prefetched '%s'", path);
+		free(ad->next.path);
+		ad->next.path = NULL;
+		ad->next.advanced = 0;
+		return 0;
+	}
 
-        mpv_command(ctx, cmd);
+	/* Skipping to the prefetched track, let mpv switch to it */
+	if (ad->next.queued && !strcmp(path, ad->next.path)) {
+		const char *next_cmd[] = {"playlist-next", NULL};
+
+		GP_DEBUG(1, "Skipping to prefetched '%s'", path);
+		mpv_command_async(ad->ctx, REPLY_LOAD, next_cmd);
+		next_clear(ad);
+		return 0;
+	}
+
+	ret = mpv_command_async(ad->ctx, REPLY_LOAD, cmd);
+	if (ret < 0) {
+		GP_WARN("Failed to load '%s': %s", path, mpv_error_string(ret));
+		return 1;
+	}
+
+	/* Replace keeps the rest of the mpv playlist */
+	next_clear(ad);
 
 	return 0;
 }
 
-static int audio_decoder_track_ctrl_mpv(enum audio_decoder_ctrl ctrl)
+static int audio_decoder_track_preload_mpv(struct audio_decoder_inst *self, const char *path)
 {
+	struct ad_mpv *ad = to_ad_mpv(self);
+	const char *cmd[] = {"loadfile", path, "append", NULL};
+	int ret;
+
+	if (!path) {
+		next_clear(ad);
+		return 0;
+	}
+
+	if (ad->next.path && !strcmp(path, ad->next.path))
+		return 0;
+
+	next_clear(ad);
+
+	ad->next.path = strdup(path);
+	if (!ad->next.path) {
+		GP_WARN("Malloc failed :(");
+		return 1;
+	}
+
+	ret = mpv_command_async(ad->ctx, REPLY_APPEND, cmd);
+	if (ret < 0) {
+		GP_WARN("Failed to append '%s': %s", path, mpv_error_string(ret));
+		return 1;
+	}
+
+	ad->next.queued = 1;
+
+	return 0;
+}
+
+/*
+ * A track has ended, mpv continues with the next playlist entry if there is
+ * one, either way the application moves on in its playlist.
+ */
+static void decode_end_file(struct ad_mpv *ad, mpv_event_end_file *end)
+{
+	GP_DEBUG(2, "MPV file ended, reason %i", end->reason);
+
+	if (end->reason != MPV_END_FILE_REASON_EOF &&
+	    end->reason != MPV_END_FILE_REASON_ERROR)
+		return;
+
+	if (ad->next.queued) {
+		ad->next.queued = 0;
+		ad->next.advanced = 1;
+	}
+
+	audio_decoder_track_finished(&ad->inst);
+}
+
+static int audio_decoder_track_ctrl_mpv(struct audio_decoder_inst *self, enum audio_decoder_ctrl ctrl)
+{
+	struct ad_mpv *ad = to_ad_mpv(self);
 	int val = 0;
 
 	switch (ctrl) {
@@ -37,12 +237,50 @@ static int audio_decoder_track_ctrl_mpv(enum audio_decoder_ctrl ctrl)
 	break;
 	}
 
-	mpv_set_property(ctx, "pause", MPV_FORMAT_FLAG, &val);
+	mpv_set_property_async(ad->ctx, REPLY_PAUSE, "pause", MPV_FORMAT_FLAG, &val);
 
 	return 0;
 }
 
-static void decode_metadata(mpv_event_property *prop)
+static void seek_send(struct ad_mpv *ad, long seek_ms)
+{
+	double time_pos = (double)seek_ms/1000;
+	int ret;
+
+	ret = mpv_set_property_async(ad->ctx, REPLY_SEEK, "time-pos", MPV_FORMAT_DOUBLE, &time_pos);
+	if (ret < 0) {
+		GP_WARN("Failed to seek: %s", mpv_error_string(ret));
+		return;
+	}
+
+	ad->seek.in_flight = 1;
+}
+
+static void seek_done(struct ad_mpv *ad)
+{
+	ad->seek.in_flight = 0;
+
+	if (!ad->seek.pending)
+		return;
+
+	ad->seek.pending = 0;
+	seek_send(ad, ad->seek.pending_ms);
+}
+
+static void decode_reply(struct ad_mpv *ad, mpv_event *event)
+{
+	if (event->error < 0) {
+		GP_WARN("MPV %s failed: %s", reply_name(event->reply_userdata),
+		        mpv_error_string(event->error));
+	} else {
+		GP_DEBUG(4, "MPV %s done", reply_name(event->reply_userdata));
+	}
+
+	if (event->reply_userdata == REPLY_SEEK)
+		seek_done(ad);
+}
+
+static void decode_metadata(struct ad_mpv *ad, mpv_event_property *prop)
 {
 	mpv_node *node = prop->data;
 	const char *artist = NULL;
@@ -71,23 +309,35 @@ static void decode_metadata(mpv_event_property *prop)
 		GP_DEBUG(3, "Medatada %s %s", key, val->u.string);
 	}
 
-	audio_decoder_track_info(artist, album, title);
+	audio_decoder_track_info(&ad->inst, artist, album, title);
 }
 
-static unsigned long audio_decoder_tick_mpv(void)
+static unsigned long audio_decoder_tick_mpv(struct audio_decoder_inst *self)
 {
+	struct ad_mpv *ad = to_ad_mpv(self);
+	/*
+	 * Drain the eventfd before the queue, events that arrive while we
+	 * process the queue signal the fd again.
+	 */
+	wakeup_drain(ad);
+
 	for (;;) {
-		mpv_event *event = mpv_wait_event(ctx, 0);
+		mpv_event *event = mpv_wait_event(ad->ctx, 0);
 
 		if (event->event_id == MPV_EVENT_NONE)
 			break;
 
 		if (event->event_id == MPV_EVENT_SHUTDOWN) {
-			audio_decoder_track_finished();
+			audio_decoder_track_finished(self);
 			break;
 		}
 
-		if (event->event_id == MPV_EVENT_PROPERTY_CHANGE) {
+		if (event->event_id == MPV_EVENT_COMMAND_REPLY ||
+		    event->event_id == MPV_EVENT_SET_PROPERTY_REPLY) {
+			decode_reply(ad, event);
+		} else if (event->event_id == MPV_EVENT_END_FILE) {
+			decode_end_file(ad, event->data);
+		} else if (event->event_id == MPV_EVENT_PROPERTY_CHANGE) {
 			mpv_event_property *prop = (mpv_event_property *)event->data;
 
 			GP_DEBUG(4, "MPV Event: %s %s",
@@ -95,79 +345,130 @@ static unsigned long audio_decoder_tick_mpv(void)
 
 			if (!strcmp(prop->name, "time-pos")) {
 				if (prop->format == MPV_FORMAT_DOUBLE)
-					audio_decoder_track_pos(*(double *)prop->data * 1000 + 0.5);
+					audio_decoder_track_pos(self, *(double *)prop->data * 1000 + 0.5);
 			} else if (!strcmp(prop->name, "duration")) {
+				/* Duration is unset between tracks, end of track is reported on MPV_EVENT_END_FILE */
 				if (prop->format == MPV_FORMAT_DOUBLE)
-					audio_decoder_track_duration(*(double *)prop->data * 1000 + 0.5);
-				else
-					audio_decoder_track_duration(0);
+					audio_decoder_track_duration(self, *(double *)prop->data * 1000 + 0.5);
 			} else if (!strcmp(prop->name, "metadata")) {
 				if (prop->format == MPV_FORMAT_NODE)
-					decode_metadata(prop);
+					decode_metadata(ad, prop);
 			}
 		} else {
 			GP_DEBUG(4, "MPV Event: %s", mpv_event_name(event->event_id));
 		}
 	}
 
-	return 100;
+	return 0;
 }
 
-static int audio_decoder_track_seek_mpv(long seek_ms)
+static int audio_decoder_poll_fd_mpv(struct audio_decoder_inst *self)
 {
-	double time_pos = (double)seek_ms/1000;
+	struct ad_mpv *ad = to_ad_mpv(self);
+	return ad->wakeup_fd;
+}
+
+static int audio_decoder_track_seek_mpv(struct audio_decoder_inst *self, long seek_ms)
+{
+	struct ad_mpv *ad = to_ad_mpv(self);
+	if (ad->seek.in_flight) {
+		GP_DEBUG(4, "Seek in flight, postponing seek to %li ms", seek_ms);
+		ad->seek.pending = 1;
+		ad->seek.pending_ms = seek_ms;
+		return 0;
+	}
 
-	mpv_set_property(ctx, "time-pos", MPV_FORMAT_DOUBLE, &time_pos);
+	seek_send(ad, seek_ms);
 
 	return 0;
 }
 
-unsigned long audio_decoder_softvol_mpv(enum audio_decoder_softvol_op op, unsigned long vol)
+static unsigned long audio_decoder_softvol_mpv(struct audio_decoder_inst *self,
+                                               enum audio_decoder_softvol_op op, unsigned long vol)
 {
-	double dvol;
-
+	struct ad_mpv *ad = to_ad_mpv(self);
 	switch (op) {
 	case AUDIO_DECODER_SOFTVOL_SET:
-		dvol = vol;
-		mpv_set_property(ctx, "volume", MPV_FORMAT_DOUBLE, &dvol);
+		ad->volume = vol;
+		mpv_set_property_async(ad->ctx, REPLY_VOLUME, "volume", MPV_FORMAT_DOUBLE, &ad->volume);
 	break;
 	case AUDIO_DECODER_SOFTVOL_GET:
-		mpv_get_property(ctx, "volume", MPV_FORMAT_DOUBLE, &dvol);
-		return dvol;
+		return ad->volume + 0.5;
 	break;
 	}
 
 	return 0;
 }
 
+static void audio_decoder_destroy_mpv(struct audio_decoder_inst *self)
+{
+	struct ad_mpv *ad = to_ad_mpv(self);
+
+	mpv_terminate_destroy(ad->ctx);
+	close(ad->wakeup_fd);
+	free(ad->next.path);
+	free(ad);
+}
+
 static const struct audio_decoder_ops audio_decoder_ops_mpv = {
 	.track_load = audio_decoder_track_load_mpv,
+	.track_preload = audio_decoder_track_preload_mpv,
 	.track_ctrl = audio_decoder_track_ctrl_mpv,
 	.track_seek = audio_decoder_track_seek_mpv,
 	.softvol = audio_decoder_softvol_mpv,
 	.tick = audio_decoder_tick_mpv,
+	.poll_fd = audio_decoder_poll_fd_mpv,
+	.destroy = audio_decoder_destroy_mpv,
 };
 
-const struct audio_decoder_ops *audio_decoder_mpv(const struct audio_decoder_callbacks *cbs)
+struct audio_decoder_inst *audio_decoder_mpv(const struct audio_decoder_callbacks *cbs, void *priv)
 {
-	ctx = mpv_create();
+	struct ad_mpv *ad;
+	double dvol = AUDIO_DECODER_SOFTVOL_MAX;
 
-	if (!ctx)
+	ad = calloc(1, sizeof(*ad));
+	if (!ad) {
+		GP_WARN("Malloc failed :(");
 		return NULL;
+	}
+
+	audio_decoder_inst_init(&ad->inst, &audio_decoder_ops_mpv, cbs, priv);
+
+	ad->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ad->wakeup_fd < 0) {
+		GP_WARN("Failed to create eventfd: %s", strerror(errno));
+		goto err0;
+	}
+
+	ad->ctx = mpv_create();
+	if (!ad->ctx)
+		goto err1;
 
 	/* Disable video since we do not show it anywhere */
-	mpv_set_option_string(ctx, "vid", "no");
+	mpv_set_option_string(ad->ctx, "vid", "no");
+	/* Open the next playlist entry before the current one ends */
+	mpv_set_option_string(ad->ctx, "prefetch-playlist", "yes");
+	/* Keep the audio output open between tracks unless the format changes */
+	mpv_set_option_string(ad->ctx, "gapless-audio", "weak");
 	/* Enable metadata, duration and time position events */
-	mpv_observe_property(ctx, 0, "metadata", MPV_FORMAT_NODE);
-	mpv_observe_property(ctx, 0, "duration", MPV_FORMAT_DOUBLE);
-	mpv_observe_property(ctx, 0, "time-pos", MPV_FORMAT_DOUBLE);
+	mpv_observe_property(ad->ctx, 0, "metadata", MPV_FORMAT_NODE);
+	mpv_observe_property(ad->ctx, 0, "duration", MPV_FORMAT_DOUBLE);
+	mpv_observe_property(ad->ctx, 0, "time-pos", MPV_FORMAT_DOUBLE);
 	/* Make sure mpv softvolume max matches our softvolume max */
-	double dvol = AUDIO_DECODER_SOFTVOL_MAX;
-	mpv_set_property(ctx, "volume-max", MPV_FORMAT_DOUBLE, &dvol);
+	mpv_set_property(ad->ctx, "volume-max", MPV_FORMAT_DOUBLE, &dvol);
+
+	mpv_set_wakeup_callback(ad->ctx, wakeup_callback, ad);
 
-	mpv_initialize(ctx);
+	mpv_initialize(ad->ctx);
 
-	audio_decoder_cbs = cbs;
+	/* The only synchronous query, the volume is cached from now on */
+	if (mpv_get_property(ad->ctx, "volume", MPV_FORMAT_DOUBLE, &ad->volume) < 0)
+		ad->volume = 100;
 
-	return &audio_decoder_ops_mpv;
+	return &ad->inst;
+err1:
+	close(ad->wakeup_fd);
+err0:
+	free(ad);
+	return NULL;
 }
@@ -10,44 +10,102 @@
 
 #include "audio_decoder.h"
 
-static inline void audio_decoder_track_info(const char *artist, const char *album, const char *title)
+static inline void audio_decoder_track_info(struct audio_decoder_inst *self, const char *artist,
+                                            const char *album, const char *title)
 {
-	if (!audio_decoder_cbs || !audio_decoder_cbs->track_info)
+	if (!self->cbs || !self->cbs->track_info)
 		return;
 
-	audio_decoder_cbs->track_info(artist, album, title);
+	self->cbs->track_info(self, artist, album, title);
 }
 
-static inline void audio_decoder_track_duration(long duration_ms)
+static inline void audio_decoder_track_duration(struct audio_decoder_inst *self, long duration_ms)
 {
-	if (!audio_decoder_cbs || !audio_decoder_cbs->track_duration)
+	if (!self->cbs || !self->cbs->track_duration)
 		return;
 
-	audio_decoder_cbs->track_duration(duration_ms);
+	self->cbs->track_duration(self, duration_ms);
 }
 
-static inline void audio_decoder_track_art(const void *buf, size_t buf_len)
+static inline void audio_decoder_track_art(struct audio_decoder_inst *self, const void *buf, size_t buf_len)
 {
-	if (!audio_decoder_cbs || !audio_decoder_cbs->track_art)
+	if (!self->cbs || !self->cbs->track_art)
 		return;
 
-	audio_decoder_cbs->track_art(buf, buf_len);
+	self->cbs->track_art(self, (void *)buf, buf_len);
 }
 
-static inline void audio_decoder_track_pos(long offset_ms)
+static inline void audio_decoder_track_pos(struct audio_decoder_inst *self, long offset_ms)
 {
-	if (!audio_decoder_cbs || !audio_decoder_cbs->track_pos)
+	if (!self->cbs || !self->cbs->track_pos)
 		return;
 
-	audio_decoder_cbs->track_pos(offset_ms);
+	self->cbs->track_pos(self, offset_ms);
 }
 
-static inline void audio_decoder_track_finished(void)
+static inline void audio_decoder_track_finished(struct audio_decoder_inst *self)
 {
-	if (!audio_decoder_cbs || !audio_decoder_cbs->track_duration)
+	if (!self->cbs || !self->cbs->track_duration)
 		return;
 
-	audio_decoder_cbs->track_duration(0);
+	self->cbs->track_duration(self, 0);
+}
+
+static inline unsigned int audio_decoder_output_latency_get(struct audio_decoder_inst *self,
+                                                            const char *device)
+{
+	if (!self->cbs || !self->cbs->output_latency_get)
+		return 0;
+
+	return self->cbs->output_latency_get(self, device);
+}
+
+static inline void audio_decoder_output_latency_set(struct audio_decoder_inst *self,
+                                                    const char *device, unsigned int latency_us)
+{
+	if (!self->cbs || !self->cbs->output_latency_set)
+		return;
+
+	self->cbs->output_latency_set(self, device, latency_us);
+}
+
+static inline int audio_decoder_synth_get(struct audio_decoder_inst *self, const char *cpu,
+                                          char *synth, size_t size)
+{
+	if (!self->cbs || !self->cbs->synth_get)
+		return 1;
+
+	return self->cbs->synth_get(self, cpu, synth, size);
+}
+
+static inline void audio_decoder_synth_set(struct audio_decoder_inst *self,
+                                           const char *cpu, const char *synth)
+{
+	if (!self->cbs || !self->cbs->synth_set)
+		return;
+
+	self->cbs->synth_set(self, cpu, synth);
+}
+
+static inline char *audio_decoder_cache_path(struct audio_decoder_inst *self, const char *fname)
+{
+	if (!self->cbs || !self->cbs->cache_path)
+		return NULL;
+
+	return self->cbs->cache_path(self, fname);
+}
+
+/**
+ * @brief Initializes the instance part of the decoder state.
+ */
+static inline void audio_decoder_inst_init(struct audio_decoder_inst *self,
+                                           const struct audio_decoder_ops *ops,
+                                           const struct audio_decoder_callbacks *cbs,
+                                           void *priv)
+{
+	self->ops = ops;
+	self->cbs = cbs;
+	self->priv = priv;
 }
 
 #endif /* AUDIO_DECODER_H */
@@ -0,0 +1,764 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Native PCM decoder for RIFF/WAVE, RF64/BW64 and Sony Wave64 files.
+ *
+ * The file is mapped into memory and the sample data are copied from the
+ * mapping straight into the stream ring buffer, there is no decoding step at
+ * all. Seeking is just a change of the offset into the mapping.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <core/gp_common.h>
+#include <core/gp_debug.h>
+
+#include "audio_output.h"
+#include "audio_stream.h"
+#include "audio_decoder_priv.h"
+
+/* Pages ahead of the playback position are requested in this large chunks */
+#define READAHEAD_SIZE (1<<20)
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+struct ad_track {
+	char *path;
+	unsigned char *map;
+	size_t map_size;
+	/* Sample data offset and size in the mapping */
+	size_t data_off;
+	uint64_t data_size;
+	/* Current offset into the sample data */
+	uint64_t pos;
+	/* Data up to this offset were advised to be read ahead */
+	uint64_t advised;
+	unsigned int rate;
+	uint8_t channels;
+	enum audio_format fmt;
+	unsigned int frame_size;
+	long duration;
+	char *artist;
+	char *album;
+	char *title;
+};
+
+struct ad_wav {
+	struct audio_decoder_inst inst;
+	/* Currently decoded track */
+	struct ad_track cur;
+	/* Preloaded next track, owned by the decoder thread if next_ready is set */
+	struct ad_track next;
+	int next_ready;
+	/* Decoder thread switched to the next track */
+	int switched;
+	/* Output has reached the end of the previous track after a switch */
+	int switch_eof;
+	struct audio_output *out;
+	struct audio_stream stream;
+};
+
+static struct ad_wav *to_ad_wav(struct audio_decoder_inst *self)
+{
+	return (struct ad_wav *)self;
+}
+
+/* A track failed to load */
+#define EV_FAILED AUDIO_STREAM_EV_USER
+
+static uint16_t get16(const unsigned char *p)
+{
+	return p[0] | (p[1]<<8);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return get16(p) | ((uint32_t)get16(p + 2)<<16);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return get32(p) | ((uint64_t)get32(p + 4)<<32);
+}
+
+/*
+ * Wave64 chunk ids are GUIDs that start with the RIFF four character code
+ * followed by one of the two suffixes below.
+ */
+static const unsigned char w64_riff_sfx[12] = {
+	0x2e, 0x91, 0xcf, 0x11, 0xa5, 0xd6, 0x28, 0xdb, 0x04, 0xc1, 0x00, 0x00
+};
+
+static const unsigned char w64_wave_sfx[12] = {
+	0xf3, 0xac, 0xd3, 0x11, 0x8c, 0xd1, 0x00, 0xc0, 0x4f, 0x8e, 0xdb, 0x8a
+};
+
+enum container {
+	CONTAINER_RIFF,
+	CONTAINER_RF64,
+	CONTAINER_W64,
+};
+
+struct chunk {
+	char id[4];
+	const unsigned char *data;
+	uint64_t size;
+};
+
+struct parser {
+	enum container container;
+	const unsigned char *pos;
+	const unsigned char *end;
+	/* Data chunk size from the RF64 ds64 chunk */
+	uint64_t ds64_data_size;
+};
+
+static int w64_id(const unsigned char *guid, const char *id, const unsigned char *sfx)
+{
+	return !memcmp(guid, id, 4) && !memcmp(guid + 4, sfx, 12);
+}
+
+/*
+ * Returns next chunk, chunks from Wave64 files are returned with RIFF ids.
+ */
+static int next_chunk(struct parser *p, struct chunk *chunk)
+{
+	size_t avail = p->end - p->pos;
+	size_t hdr = p->container == CONTAINER_W64 ? 24 : 8;
+	uint64_t size, skip;
+
+	if (avail < hdr)
+		return 0;
+
+	if (p->container == CONTAINER_W64) {
+		memcpy(chunk->id, p->pos, 4);
+
+		if (!w64_id(p->pos, "list", w64_riff_sfx) &&
+		    memcmp(p->pos + 4, w64_wave_sfx, 12))
+			memcpy(chunk->id, "????", 4);
+
+		/* Wave64 sizes include the header and are 8 bytes aligned */
+		size = get64(p->pos + 16);
+		if (size < hdr)
+			return 0;
+		size -= hdr;
+		skip = (size + 7) & ~7llu;
+	} else {
+		memcpy(chunk->id, p->pos, 4);
+		size = get32(p->pos + 4);
+
+		if (p->container == CONTAINER_RF64 && size == 0xffffffff &&
+		    !memcmp(chunk->id, "data", 4))
+			size = p->ds64_data_size;
+
+		skip = size + (size & 1);
+	}
+
+	chunk->data = p->pos + hdr;
+	chunk->size = GP_MIN(size, (uint64_t)(avail - hdr));
+
+	p->pos += hdr + GP_MIN(skip, (uint64_t)(avail - hdr));
+
+	return 1;
+}
+
+static int is_id(struct chunk *chunk, const char *id)
+{
+	return !memcmp(chunk->id, id, 4);
+}
+
+static int parse_fmt(struct ad_track *track, struct chunk *chunk)
+{
+	const unsigned char *d = chunk->data;
+	unsigned int tag, channels, block_align, bits;
+
+	if (chunk->size < 16) {
+		GP_WARN("Format chunk too short");
+		return 1;
+	}
+
+	tag = get16(d);
+	channels = get16(d + 2);
+	track->rate = get32(d + 4);
+	block_align = get16(d + 12);
+	bits = get16(d + 14);
+
+	if (tag == WAVE_FORMAT_EXTENSIBLE && chunk->size >= 40)
+		tag = get16(d + 24);
+
+	switch (tag) {
+	case WAVE_FORMAT_PCM:
+		switch (bits) {
+		case 16:
+			track->fmt = AUDIO_FORMAT_S16LE;
+		break;
+		case 24:
+			/* 24 bit samples are either packed or left aligned in 32 bits */
+			if (block_align == 3 * channels)
+				track->fmt = AUDIO_FORMAT_S24LE;
+			else
+				track->fmt = AUDIO_FORMAT_S32LE;
+		break;
+		case 32:
+			track->fmt = AUDIO_FORMAT_S32LE;
+		break;
+		default:
+			GP_WARN("Unsupported PCM bits per sample %u", bits);
+			return 1;
+		}
+	break;
+	case WAVE_FORMAT_IEEE_FLOAT:
+		if (bits != 32) {
+			GP_WARN("Unsupported float bits per sample %u", bits);
+			return 1;
+		}
+		track->fmt = AUDIO_FORMAT_FLOATLE;
+	break;
+	default:
+		GP_WARN("Unsupported format tag 0x%04x", tag);
+		return 1;
+	}
+
+	if (!channels || channels > AUDIO_RESAMPLE_CHANNELS || !track->rate) {
+		GP_WARN("Invalid channels %u or rate %u", channels, track->rate);
+		return 1;
+	}
+
+	track->channels = channels;
+	track->frame_size = channels * audio_format_size(track->fmt);
+
+	if (block_align != track->frame_size) {
+		GP_WARN("Unexpected block align %u", block_align);
+		return 1;
+	}
+
+	return 0;
+}
+
+static char *info_str(struct chunk *chunk)
+{
+	return strndup((const char *)chunk->data, chunk->size);
+}
+
+/*
+ * Reads track info from the LIST INFO chunk.
+ */
+static void parse_info(struct ad_track *track, struct chunk *list)
+{
+	struct parser p = {
+		.container = CONTAINER_RIFF,
+		.pos = list->data + 4,
+		.end = list->data + list->size,
+	};
+	struct chunk chunk;
+
+	if (list->size < 4 || memcmp(list->data, "INFO", 4))
+		return;
+
+	while (next_chunk(&p, &chunk)) {
+		if (is_id(&chunk, "IART") && !track->artist)
+			track->artist = info_str(&chunk);
+		else if (is_id(&chunk, "IPRD") && !track->album)
+			track->album = info_str(&chunk);
+		else if (is_id(&chunk, "INAM") && !track->title)
+			track->title = info_str(&chunk);
+	}
+}
+
+static int parse(struct ad_track *track)
+{
+	const unsigned char *map = track->map;
+	struct parser p = {.end = map + track->map_size};
+	struct chunk chunk;
+	int have_fmt = 0;
+
+	if (track->map_size >= 40 && w64_id(map, "riff", w64_riff_sfx) &&
+	    w64_id(map + 24, "wave", w64_wave_sfx)) {
+		p.container = CONTAINER_W64;
+		p.pos = map + 40;
+	} else if (track->map_size >= 12 && !memcmp(map + 8, "WAVE", 4)) {
+		if (!memcmp(map, "RIFF", 4))
+			p.container = CONTAINER_RIFF;
+		else if (!memcmp(map, "RF64", 4) || !memcmp(map, "BW64", 4))
+			p.container = CONTAINER_RF64;
+		else
+			goto err;
+		p.pos = map + 12;
+	} else {
+		goto err;
+	}
+
+	while (next_chunk(&p, &chunk)) {
+		if (is_id(&chunk, "ds64") && chunk.size >= 16) {
+			p.ds64_data_size = get64(chunk.data + 8);
+		} else if (is_id(&chunk, "fmt ")) {
+			if (parse_fmt(track, &chunk))
+				return 1;
+			have_fmt = 1;
+		} else if (is_id(&chunk, "LIST") || is_id(&chunk, "list")) {
+			parse_info(track, &chunk);
+		} else if (is_id(&chunk, "data")) {
+			if (!have_fmt) {
+				GP_WARN("Data chunk before format chunk");
+				return 1;
+			}
+
+			track->data_off = chunk.data - map;
+			track->data_size = chunk.size;
+
+			/*
+			 * Files written by streaming recorders may have zero
+			 * or bogus data size, we play whatever is in the file.
+			 */
+			if (!track->data_size && p.container == CONTAINER_RIFF)
+				track->data_size = track->map_size - track->data_off;
+
+			track->data_size -= track->data_size % track->frame_size;
+
+			return 0;
+		}
+	}
+
+err:
+	GP_DEBUG(1, "Not a WAVE file");
+	return 1;
+}
+
+static void track_close(struct ad_track *track)
+{
+	if (track->map)
+		munmap(track->map, track->map_size);
+
+	free(track->path);
+	free(track->artist);
+	free(track->album);
+	free(track->title);
+
+	memset(track, 0, sizeof(*track));
+}
+
+/*
+ * Asks the kernel to read the pages ahead of the playback position, the next
+ * window is requested when we are half way through the previous one.
+ */
+static void track_readahead(struct ad_track *track)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t start, len;
+
+	if (track->pos < track->advised)
+		return;
+
+	start = track->data_off + track->pos;
+	len = GP_MIN((size_t)READAHEAD_SIZE, track->map_size - start);
+
+	len += start % page_size;
+	start -= start % page_size;
+
+	if (madvise(track->map + start, len, MADV_WILLNEED))
+		GP_DEBUG(1, "madvise(MADV_WILLNEED) failed: %s", strerror(errno));
+
+	track->advised = track->pos + READAHEAD_SIZE / 2;
+}
+
+/*
+ * Maps and parses a file, called without the stream lock, the track must not
+ * be used by the decoder thread.
+ */
+static int track_open(struct ad_track *track, const char *name)
+{
+	struct stat st;
+	int fd;
+
+	track_close(track);
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		GP_WARN("Failed to open '%s': %s", name, strerror(errno));
+		return 1;
+	}
+
+	if (fstat(fd, &st)) {
+		GP_WARN("Failed to stat '%s': %s", name, strerror(errno));
+		goto err;
+	}
+
+	if ((uint64_t)st.st_size > SIZE_MAX || !st.st_size) {
+		GP_WARN("Cannot map '%s' of size %lli", name, (long long)st.st_size);
+		goto err;
+	}
+
+	track->map_size = st.st_size;
+	track->map = mmap(NULL, track->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (track->map == MAP_FAILED) {
+		GP_WARN("Failed to mmap '%s': %s", name, strerror(errno));
+		track->map = NULL;
+		goto err;
+	}
+
+	close(fd);
+
+	madvise(track->map, track->map_size, MADV_SEQUENTIAL);
+
+	if (parse(track)) {
+		GP_WARN("Failed to parse '%s'", name);
+		track_close(track);
+		return 1;
+	}
+
+	track->path = strdup(name);
+	track->duration = 1000.0 * (track->data_size / track->frame_size) / track->rate + 0.5;
+
+	GP_DEBUG(1, "Opened '%s' %u Hz %u channels format %i, %llu bytes of data",
+	         name, track->rate, track->channels, track->fmt,
+	         (unsigned long long)track->data_size);
+
+	track_readahead(track);
+
+	return 0;
+err:
+	close(fd);
+	return 1;
+}
+
+static void track_send_info(struct ad_wav *ad, struct ad_track *track)
+{
+	audio_decoder_track_duration(&ad->inst, track->duration);
+	audio_decoder_track_info(&ad->inst, track->artist, track->album, track->title);
+}
+
+static int track_is(struct ad_track *track, const char *name)
+{
+	return track->path && !strcmp(track->path, name);
+}
+
+static void track_start(struct ad_wav *ad, struct ad_track *track, uint64_t frame)
+{
+	track->pos = frame * track->frame_size;
+	track->advised = 0;
+
+	audio_stream_start(&ad->stream, track->channels, track->fmt,
+	                   track->rate, frame);
+}
+
+static int audio_decoder_track_load_wav(struct audio_decoder_inst *self, const char *name)
+{
+	struct ad_wav *ad = to_ad_wav(self);
+	struct audio_stream *stream = &ad->stream;
+	struct ad_track track = {};
+
+	audio_stream_lock(stream);
+
+	/* Decoder has already switched to the track seamlessly */
+	if (ad->switched && track_is(&ad->cur, name)) {
+		ad->switched = 0;
+
+		/*
+		 * Loaded before the previous track has finished, e.g. skipped
+		 * by the user, the end of the previous track is still in the
+		 * ring, start from the beginning instead.
+		 */
+		if (!ad->switch_eof) {
+			GP_DEBUG(1, "Restarting '%s'", name);
+			track_start(ad, &ad->cur, 0);
+		} else {
+			GP_DEBUG(1, "Gapless switch to '%s'", name);
+		}
+
+		track_send_info(ad, &ad->cur);
+		audio_stream_unlock(stream);
+		return 0;
+	}
+
+	ad->switched = 0;
+
+	if (ad->next_ready && track_is(&ad->next, name)) {
+		ad->next_ready = 0;
+		GP_SWAP(ad->cur, ad->next);
+		track_start(ad, &ad->cur, 0);
+		track_send_info(ad, &ad->cur);
+		audio_stream_unlock(stream);
+		return 0;
+	}
+
+	audio_stream_stop(stream);
+	audio_stream_unlock(stream);
+
+	/* Only the headers are parsed, this is fast enough to do here */
+	if (track_open(&track, name)) {
+		/* Reported from tick() as the mpg123 loader does */
+		audio_stream_event_post(stream, EV_FAILED);
+		return 0;
+	}
+
+	audio_stream_lock(stream);
+	GP_SWAP(ad->cur, track);
+	track_start(ad, &ad->cur, 0);
+	audio_stream_unlock(stream);
+
+	track_close(&track);
+	track_send_info(ad, &ad->cur);
+
+	return 0;
+}
+
+static int audio_decoder_track_preload_wav(struct audio_decoder_inst *self, const char *name)
+{
+	struct ad_wav *ad = to_ad_wav(self);
+	struct audio_stream *stream = &ad->stream;
+	struct ad_track track = {};
+	int ret = 0;
+
+	audio_stream_lock(stream);
+
+	if (!name) {
+		if (!ad->switched)
+			ad->next_ready = 0;
+		audio_stream_unlock(stream);
+		return 0;
+	}
+
+	/*
+	 * The next track holds the tail of the previous track until the
+	 * application loads the track the decoder has switched to.
+	 */
+	if (ad->switched || (ad->next_ready && track_is(&ad->next, name))) {
+		audio_stream_unlock(stream);
+		return 0;
+	}
+
+	/* Take the next track away from the decoder thread */
+	ad->next_ready = 0;
+	audio_stream_unlock(stream);
+
+	GP_DEBUG(1, "Preloading '%s'", name);
+
+	if (track_open(&track, name)) {
+		ret = 1;
+		goto out;
+	}
+
+	audio_stream_lock(stream);
+	GP_SWAP(ad->next, track);
+	ad->next_ready = 1;
+	audio_stream_unlock(stream);
+
+out:
+	track_close(&track);
+	return ret;
+}
+
+static int audio_decoder_track_ctrl_wav(struct audio_decoder_inst *self, enum audio_decoder_ctrl ctrl)
+{
+	struct ad_wav *ad = to_ad_wav(self);
+	switch (ctrl) {
+	case AUDIO_DECODER_PLAY:
+		audio_stream_pause(&ad->stream, 0);
+	break;
+	case AUDIO_DECODER_PAUSE:
+		audio_stream_pause(&ad->stream, 1);
+	break;
+	}
+
+	return 0;
+}
+
+/*
+ * Runs in the stream decoder thread with the stream lock held.
+ */
+static int decode_wav(struct audio_stream *self, void *buf, size_t buf_size, size_t *size)
+{
+	struct ad_wav *ad = self->priv;
+	struct ad_track *cur = &ad->cur;
+	uint64_t len = GP_MIN((uint64_t)buf_size, cur->data_size - cur->pos);
+
+	*size = 0;
+
+	if (len) {
+		track_readahead(cur);
+		memcpy(buf, cur->map + cur->data_off + cur->pos, len);
+		cur->pos += len;
+		*size = len;
+		return 0;
+	}
+
+	if (!ad->next_ready)
+		return 1;
+
+	/* Continue with the preloaded track without a gap */
+	GP_DEBUG(1, "Switching to '%s'", ad->next.path);
+
+	GP_SWAP(ad->cur, ad->next);
+	ad->next_ready = 0;
+	ad->switched = 1;
+	ad->switch_eof = 0;
+
+	ad->cur.pos = 0;
+	ad->cur.advised = 0;
+
+	audio_stream_queue(self, ad->cur.channels, ad->cur.fmt,
+	                   ad->cur.rate);
+
+	return 0;
+}
+
+static unsigned long audio_decoder_tick_wav(struct audio_decoder_inst *self)
+{
+	struct ad_wav *ad = to_ad_wav(self);
+	struct audio_stream *stream = &ad->stream;
+	unsigned int events = audio_stream_events(stream);
+
+	if (events & AUDIO_STREAM_EV_POS)
+		audio_decoder_track_pos(self, audio_stream_pos_ms(stream));
+
+	/* Skip files we cannot play, from here to avoid recursion in the application */
+	if (events & EV_FAILED) {
+		audio_decoder_track_info(self, NULL, NULL, NULL);
+		audio_decoder_track_finished(self);
+	}
+
+	if (events & AUDIO_STREAM_EV_FINISHED) {
+		/* The application loads the track we have switched to */
+		audio_stream_lock(stream);
+		ad->switch_eof = ad->switched;
+		audio_stream_unlock(stream);
+
+		audio_decoder_track_finished(self);
+	}
+
+	if (events & AUDIO_STREAM_EV_LATENCY) {
+		audio_decoder_output_latency_set(self, ad->out->device,
+		                                 audio_stream_latency_us(stream));
+	}
+
+	return 0;
+}
+
+static int audio_decoder_poll_fd_wav(struct audio_decoder_inst *self)
+{
+	struct ad_wav *ad = to_ad_wav(self);
+	return ad->stream.event_fd;
+}
+
+static int audio_decoder_track_seek_wav(struct audio_decoder_inst *self, long seek_ms)
+{
+	struct ad_wav *ad = to_ad_wav(self);
+	struct audio_stream *stream = &ad->stream;
+	struct ad_track *cur = &ad->cur;
+	uint64_t frame;
+
+	audio_stream_lock(stream);
+
+	/* The previous track is still being played, switch back */
+	if (ad->switched) {
+		GP_SWAP(ad->cur, ad->next);
+		ad->next_ready = 1;
+		ad->switched = 0;
+	}
+
+	if (cur->map) {
+		frame = (uint64_t)GP_MAX(seek_ms, 0l) * cur->rate / 1000;
+		frame = GP_MIN(frame, cur->data_size / cur->frame_size);
+		track_start(ad, cur, frame);
+	}
+
+	audio_stream_unlock(stream);
+
+	return 0;
+}
+
+static unsigned long audio_decoder_softvol_wav(struct audio_decoder_inst *self, enum audio_decoder_softvol_op op, unsigned long vol)
+{
+	struct ad_wav *ad = to_ad_wav(self);
+	struct audio_stream *stream = &ad->stream;
+
+	switch (op) {
+	case AUDIO_DECODER_SOFTVOL_SET:
+		audio_stream_volume_set(stream, vol);
+	break;
+	case AUDIO_DECODER_SOFTVOL_GET:
+		return audio_stream_volume(stream);
+	}
+
+	return 0;
+}
+
+static void audio_decoder_resample_wav(struct audio_decoder_inst *self, enum audio_decoder_resample quality)
+{
+	struct ad_wav *ad = to_ad_wav(self);
+	struct audio_stream *stream = &ad->stream;
+
+	audio_stream_lock(stream);
+	audio_stream_resample_set(stream, (enum audio_resample_quality)quality,
+	                          audio_output_rate_preferred(ad->out));
+	audio_stream_unlock(stream);
+}
+
+static void audio_decoder_destroy_wav(struct audio_decoder_inst *self)
+{
+	struct ad_wav *ad = to_ad_wav(self);
+
+	audio_stream_exit(&ad->stream);
+	audio_output_destroy(ad->out);
+
+	track_close(&ad->cur);
+	track_close(&ad->next);
+
+	free(ad);
+}
+
+static const struct audio_decoder_ops audio_decoder_ops_wav = {
+	.track_load = audio_decoder_track_load_wav,
+	.track_preload = audio_decoder_track_preload_wav,
+	.track_ctrl = audio_decoder_track_ctrl_wav,
+	.track_seek = audio_decoder_track_seek_wav,
+	.softvol = audio_decoder_softvol_wav,
+	.tick = audio_decoder_tick_wav,
+	.poll_fd = audio_decoder_poll_fd_wav,
+	.resample = audio_decoder_resample_wav,
+	.destroy = audio_decoder_destroy_wav,
+};
+
+struct audio_decoder_inst *audio_decoder_wav(const struct audio_decoder_callbacks *cbs, void *priv)
+{
+	struct ad_wav *ad = calloc(1, sizeof(*ad));
+
+	if (!ad) {
+		GP_WARN("Malloc failed :(");
+		return NULL;
+	}
+
+	audio_decoder_inst_init(&ad->inst, &audio_decoder_ops_wav, cbs, priv);
+
+	ad->out = audio_output_create(AUDIO_DEVICE_DEFAULT, 2, AUDIO_FORMAT_S16, 48000,
+	                              audio_decoder_output_latency_get(&ad->inst, AUDIO_DEVICE_DEFAULT));
+	if (!ad->out) {
+		GP_WARN("Failed to initialize audio output");
+		goto err0;
+	}
+
+	if (audio_stream_init(&ad->stream, ad->out, decode_wav, ad)) {
+		GP_WARN("Failed to initialize audio stream");
+		goto err1;
+	}
+
+	return &ad->inst;
+err1:
+	audio_output_destroy(ad->out);
+err0:
+	free(ad);
+	return NULL;
+}
@@ -0,0 +1,173 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+#include <string.h>
+#include <time.h>
+#include <core/gp_common.h>
+#include <core/gp_debug.h>
+
+#include "audio_convert.h"
+#include "audio_gain.h"
+
+/* Samples converted at once, sized for a buffer on the stack */
+#define BLOCK_SAMPLES 1024
+
+/* Statistics are printed once per this many samples */
+#define STAT_SAMPLES (10 * 48000 * 2)
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+void audio_gain_init(struct audio_gain *self, float gain)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->gain = gain;
+	self->target = gain;
+
+	/* Any non-zero values will do */
+	self->seed[0] = 0x9e3779b9;
+	self->seed[1] = 0x7f4a7c15;
+	self->seed[2] = 0xbf58476d;
+	self->seed[3] = 0x94d049bb;
+}
+
+void audio_gain_set(struct audio_gain *self, float gain, unsigned int sample_rate)
+{
+	unsigned int ramp = sample_rate * AUDIO_GAIN_RAMP_MS / 1000;
+
+	self->target = gain;
+
+	if (!ramp || gain == self->gain) {
+		self->gain = gain;
+		self->ramp = 0;
+		return;
+	}
+
+	self->ramp = ramp;
+	self->step = (gain - self->gain) / ramp;
+}
+
+static void scale(struct audio_gain *self, float *buf, unsigned int channels, size_t frames)
+{
+	unsigned int ch;
+	size_t i, n;
+	v4f g;
+
+	/* Ramp the gain per frame */
+	for (i = 0; i < frames && self->ramp; i++) {
+		if (--self->ramp)
+			self->gain += self->step;
+		else
+			self->gain = self->target;
+
+		for (ch = 0; ch < channels; ch++)
+			buf[i * channels + ch] *= self->gain;
+	}
+
+	buf += i * channels;
+	n = (frames - i) * channels;
+
+	g = (v4f){self->gain, self->gain, self->gain, self->gain};
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v4f x;
+
+		memcpy(&x, buf + i, sizeof(x));
+		x *= g;
+		memcpy(buf + i, &x, sizeof(x));
+	}
+
+	for (; i < n; i++)
+		buf[i] *= self->gain;
+}
+
+/*
+ * Adds triangular noise of +-1 LSB at 16 bits, i.e. a difference of two
+ * uniform random numbers, generated by four xorshift generators in parallel.
+ */
+static void dither(struct audio_gain *self, float *buf, size_t n)
+{
+	const float lsb = 1.0f / (65536.0f * 32768.0f);
+	size_t i, j;
+	v4f noise;
+	v4u s;
+
+	memcpy(&s, self->seed, sizeof(s));
+
+	for (i = 0; i < n; i += 4) {
+		v4f x;
+
+		s ^= s << 13;
+		s ^= s >> 17;
+		s ^= s << 5;
+
+		noise = __builtin_convertvector((v4i)(s >> 16) - (v4i)(s & 0xffff), v4f) * lsb;
+
+		if (i + 4 > n)
+			break;
+
+		memcpy(&x, buf + i, sizeof(x));
+		x += noise;
+		memcpy(buf + i, &x, sizeof(x));
+	}
+
+	for (j = 0; i + j < n; j++)
+		buf[i + j] += noise[j];
+
+	memcpy(self->seed, &s, sizeof(s));
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void audio_gain_apply(struct audio_gain *self, enum audio_format fmt,
+                      unsigned int channels, void *dst, const void *src,
+                      size_t frames)
+{
+	size_t size = channels * audio_format_size(fmt);
+	size_t block = BLOCK_SAMPLES / channels;
+	int dither16 = fmt == AUDIO_FORMAT_S16LE || fmt == AUDIO_FORMAT_S16BE;
+	const unsigned char *in = src;
+	unsigned char *out = dst;
+	float buf[BLOCK_SAMPLES];
+	uint64_t start = now_ns();
+
+	self->stat_samples += frames * channels;
+
+	while (frames) {
+		size_t cnt = GP_MIN(frames, block);
+
+		audio_to_float(fmt, buf, in, cnt * channels);
+		scale(self, buf, channels, cnt);
+
+		if (dither16)
+			dither(self, buf, cnt * channels);
+
+		audio_from_float(fmt, out, buf, cnt * channels);
+
+		in += cnt * size;
+		out += cnt * size;
+		frames -= cnt;
+	}
+
+	self->stat_ns += now_ns() - start;
+
+	if (self->stat_samples >= STAT_SAMPLES) {
+		GP_DEBUG(2, "Software volume %.2f ns/sample",
+		         (double)self->stat_ns / self->stat_samples);
+		self->stat_ns = 0;
+		self->stat_samples = 0;
+	}
+}
@@ -0,0 +1,82 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * A software volume gain stage.
+ *
+ * Samples are converted to float, multiplied by the gain and converted back.
+ * Gain changes are ramped per frame so that dragging the volume slider does
+ * not produce zipper noise and 16 bit output is dithered with a triangular
+ * noise to decorrelate the quantization error from the signal.
+ */
+
+#ifndef AUDIO_GAIN_H__
+#define AUDIO_GAIN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "audio_output.h"
+
+/**
+ * @brief Length of a gain ramp in miliseconds.
+ */
+#define AUDIO_GAIN_RAMP_MS 20
+
+struct audio_gain {
+	float gain;
+	float target;
+	float step;
+	/* Frames left until gain reaches target */
+	unsigned int ramp;
+
+	/* Dither noise generator state */
+	uint32_t seed[4];
+
+	/* Processing time statistics */
+	uint64_t stat_ns;
+	uint64_t stat_samples;
+};
+
+/**
+ * @brief Initializes the gain stage.
+ *
+ * @param gain An initial gain, no ramp is applied.
+ */
+void audio_gain_init(struct audio_gain *self, float gain);
+
+/**
+ * @brief Changes the gain.
+ *
+ * @param gain A new gain.
+ * @param sample_rate A sample rate used to compute the ramp length, zero
+ *                    changes the gain immediately.
+ */
+void audio_gain_set(struct audio_gain *self, float gain, unsigned int sample_rate);
+
+/**
+ * @brief Returns non-zero if the samples pass unchanged.
+ */
+static inline int audio_gain_unity(struct audio_gain *self)
+{
+	return self->gain == 1.0f && !self->ramp;
+}
+
+/**
+ * @brief Applies the gain while copying frames.
+ *
+ * @param fmt A sample format.
+ * @param channels Number of channels.
+ * @param dst A destination buffer, may be the same as src.
+ * @param src A source buffer.
+ * @param frames Number of frames.
+ */
+void audio_gain_apply(struct audio_gain *self, enum audio_format fmt,
+                      unsigned int channels, void *dst, const void *src,
+                      size_t frames);
+
+#endif /* AUDIO_GAIN_H__ */
@@ -5,11 +5,12 @@
 
  */
 
+#include <errno.h>
+#include <string.h>
+#include <core/gp_common.h>
 #include <core/gp_debug.h>
 #include "audio_output.h"
 
-#define BUFSIZE 512
-
 static uint32_t convert_fmt(enum audio_format fmt)
 {
 	switch (fmt) {
@@ -25,6 +26,18 @@ static uint32_t convert_fmt(enum audio_format fmt)
 	case AUDIO_FORMAT_S32BE:
 		return SND_PCM_FORMAT_S32_BE;
 	break;
+	case AUDIO_FORMAT_S24LE:
+		return SND_PCM_FORMAT_S24_3LE;
+	break;
+	case AUDIO_FORMAT_S24BE:
+		return SND_PCM_FORMAT_S24_3BE;
+	break;
+	case AUDIO_FORMAT_FLOATLE:
+		return SND_PCM_FORMAT_FLOAT_LE;
+	break;
+	case AUDIO_FORMAT_FLOATBE:
+		return SND_PCM_FORMAT_FLOAT_BE;
+	break;
 	default:
 		return SND_PCM_FORMAT_UNKNOWN;
 	}
@@ -41,6 +54,14 @@ static const char *str_fmt(enum audio_format fmt)
 		return "s32le";
 	case AUDIO_FORMAT_S32BE:
 		return "s32be";
+	case AUDIO_FORMAT_S24LE:
+		return "s24le";
+	case AUDIO_FORMAT_S24BE:
+		return "s24be";
+	case AUDIO_FORMAT_FLOATLE:
+		return "floatle";
+	case AUDIO_FORMAT_FLOATBE:
+		return "floatbe";
 	default:
 		return "unknown";
 	}
@@ -52,24 +73,340 @@ unsigned int audio_format_size(enum audio_format fmt)
 	case AUDIO_FORMAT_S16LE:
 	case AUDIO_FORMAT_S16BE:
 		return 2;
+	case AUDIO_FORMAT_S24LE:
+	case AUDIO_FORMAT_S24BE:
+		return 3;
 	case AUDIO_FORMAT_S32LE:
 	case AUDIO_FORMAT_S32BE:
+	case AUDIO_FORMAT_FLOATLE:
+	case AUDIO_FORMAT_FLOATBE:
 		return 4;
 	default:
 		return 0;
 	}
 }
 
+static const unsigned int probe_rates[] = {
+	8000, 11025, 12000, 16000, 22050, 24000, 32000,
+	44100, 48000, 88200, 96000, 176400, 192000,
+};
+
+/*
+ * Finds out what the hardware takes without conversions, the plug layer is
+ * disabled for the probe so that it does not claim to support everything.
+ */
+static void probe_caps(struct audio_output_caps *caps, const char *alsa_device)
+{
+	snd_pcm_hw_params_t *hw_params;
+	unsigned int i, min, max;
+	snd_pcm_t *handle;
+	int ret;
+
+	/* Fallback if we fail to probe the device */
+	caps->formats = ~0;
+	caps->rates = ~0;
+	caps->channels_min = 1;
+	caps->channels_max = 2;
+
+	ret = snd_pcm_open(&handle, alsa_device, SND_PCM_STREAM_PLAYBACK,
+	                   SND_PCM_NO_AUTO_RESAMPLE |
+	                   SND_PCM_NO_AUTO_CHANNELS |
+	                   SND_PCM_NO_AUTO_FORMAT);
+	if (ret < 0) {
+		GP_WARN("Failed to probe alsa output '%s': %s",
+		        alsa_device, snd_strerror(ret));
+		return;
+	}
+
+	snd_pcm_hw_params_alloca(&hw_params);
+	snd_pcm_hw_params_any(handle, hw_params);
+
+	caps->formats = 0;
+	for (i = 0; i < AUDIO_FORMAT_CNT; i++) {
+		if (!snd_pcm_hw_params_test_format(handle, hw_params, convert_fmt(i)))
+			caps->formats |= 1<<i;
+	}
+
+	caps->rates = 0;
+	for (i = 0; i < GP_ARRAY_SIZE(probe_rates); i++) {
+		if (!snd_pcm_hw_params_test_rate(handle, hw_params, probe_rates[i], 0))
+			caps->rates |= 1<<i;
+	}
+
+	if (!snd_pcm_hw_params_get_channels_min(hw_params, &min) &&
+	    !snd_pcm_hw_params_get_channels_max(hw_params, &max)) {
+		caps->channels_min = GP_MIN(min, 255u);
+		caps->channels_max = GP_MIN(max, 255u);
+	}
+
+	snd_pcm_close(handle);
+
+	GP_DEBUG(1, "Alsa native formats:");
+	for (i = 0; i < AUDIO_FORMAT_CNT; i++) {
+		if (caps->formats & (1<<i))
+			GP_DEBUG(1, " %s", str_fmt(i));
+	}
+
+	GP_DEBUG(1, "Alsa native rates:");
+	for (i = 0; i < GP_ARRAY_SIZE(probe_rates); i++) {
+		if (caps->rates & (1<<i))
+			GP_DEBUG(1, " %u", probe_rates[i]);
+	}
+
+	GP_DEBUG(1, "Alsa native channels %u-%u",
+	         caps->channels_min, caps->channels_max);
+}
+
+int audio_output_rate_native(struct audio_output *self, unsigned int rate)
+{
+	unsigned int i;
+
+	for (i = 0; i < GP_ARRAY_SIZE(probe_rates); i++) {
+		if (probe_rates[i] == rate)
+			return !!(self->caps.rates & (1<<i));
+	}
+
+	return 0;
+}
+
+unsigned int audio_output_rate_preferred(struct audio_output *self)
+{
+	unsigned int i;
+
+	if (audio_output_rate_native(self, 48000))
+		return 48000;
+
+	if (audio_output_rate_native(self, 44100))
+		return 44100;
+
+	for (i = 0; i < GP_ARRAY_SIZE(probe_rates); i++) {
+		if (probe_rates[i] > 44100 && (self->caps.rates & (1<<i)))
+			return probe_rates[i];
+	}
+
+	return 48000;
+}
+
+static int update_poll_fds(struct audio_output *self)
+{
+	int cnt = snd_pcm_poll_descriptors_count(self->playback_handle);
+	struct pollfd *fds;
+
+	if (cnt <= 0) {
+		GP_WARN("snd_pcm_poll_descriptors_count(): %s", snd_strerror(cnt));
+		return -1;
+	}
+
+	fds = realloc(self->poll_fds, sizeof(struct pollfd) * (cnt + 1));
+	if (!fds) {
+		GP_WARN("Failed to allocate poll fds");
+		return -1;
+	}
+
+	self->poll_fds = fds;
+	self->poll_fds_cnt = cnt + 1;
+
+	cnt = snd_pcm_poll_descriptors(self->playback_handle, fds + 1, cnt);
+	if (cnt < 0) {
+		GP_WARN("snd_pcm_poll_descriptors(): %s", snd_strerror(cnt));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Makes sure that we are woken up exactly when a period is free.
+ */
+static int setup_sw_params(struct audio_output *self)
+{
+	snd_pcm_t *handle = self->playback_handle;
+	snd_pcm_sw_params_t *sw_params;
+	int ret;
+
+	ret = snd_pcm_get_params(handle, &self->buffer_size, &self->period_size);
+	if (ret < 0) {
+		GP_WARN("snd_pcm_get_params(): %s", snd_strerror(ret));
+		return ret;
+	}
+
+	snd_pcm_sw_params_alloca(&sw_params);
+	snd_pcm_sw_params_current(handle, sw_params);
+	snd_pcm_sw_params_set_avail_min(handle, sw_params, self->period_size);
+	self->start_threshold = self->buffer_size - self->period_size;
+	snd_pcm_sw_params_set_start_threshold(handle, sw_params, self->start_threshold);
+
+	ret = snd_pcm_sw_params(handle, sw_params);
+	if (ret < 0) {
+		GP_WARN("snd_pcm_sw_params(): %s", snd_strerror(ret));
+		return ret;
+	}
+
+	GP_DEBUG(1, "Alsa buffer %lu frames, period %lu frames",
+	         (unsigned long)self->buffer_size,
+	         (unsigned long)self->period_size);
+
+	return update_poll_fds(self);
+}
+
+static int setup_hw_params(struct audio_output *self,
+                           uint8_t channels,
+                           enum audio_format fmt,
+                           unsigned int sample_rate)
+{
+	snd_pcm_t *handle = self->playback_handle;
+	snd_pcm_hw_params_t *hw_params = self->hw_params;
+	unsigned int rate = sample_rate;
+	unsigned int buffer_time = self->latency_us;
+	unsigned int period_time = self->latency_us / AUDIO_OUTPUT_PERIODS;
+	int ret;
+
+	snd_pcm_hw_params_any(handle, hw_params);
+	snd_pcm_hw_params_set_access(handle, hw_params, self->access);
+	snd_pcm_hw_params_set_format(handle, hw_params, convert_fmt(fmt));
+	snd_pcm_hw_params_set_channels(handle, hw_params, channels);
+	snd_pcm_hw_params_set_rate_near(handle, hw_params, &rate, 0);
+	snd_pcm_hw_params_set_buffer_time_near(handle, hw_params, &buffer_time, 0);
+	snd_pcm_hw_params_set_period_time_near(handle, hw_params, &period_time, 0);
+
+	ret = snd_pcm_hw_params(handle, hw_params);
+	if (ret < 0) {
+		GP_WARN("snd_pcm_hw_params(): %s", snd_strerror(ret));
+		return ret;
+	}
+
+	self->fmt = fmt;
+	self->channels = channels;
+	self->sample_rate = sample_rate;
+	self->can_pause = snd_pcm_hw_params_can_pause(hw_params);
+	self->hw_paused = 0;
+
+	GP_DEBUG(1, "Alsa can pause %i", self->can_pause);
+	GP_DEBUG(1, "Alsa latency %uus requested %uus",
+	         buffer_time, self->latency_us);
+
+	return setup_sw_params(self);
+}
+
+static unsigned int clamp_latency(unsigned int latency_us)
+{
+	if (!latency_us)
+		return AUDIO_OUTPUT_LATENCY_DEFAULT;
+
+	return GP_MAX(GP_MIN(latency_us, (unsigned int)AUDIO_OUTPUT_LATENCY_MAX),
+	              (unsigned int)AUDIO_OUTPUT_LATENCY_MIN);
+}
+
+static time_t now_sec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec;
+}
+
+static void latency_update(struct audio_output *self, unsigned int latency_us)
+{
+	GP_DEBUG(1, "Changing alsa latency %uus -> %uus",
+	         self->latency_us, latency_us);
+
+	self->latency_us = latency_us;
+	self->latency_changed = 1;
+}
+
+/*
+ * Shrinks the buffer after a quiet period.
+ *
+ * Returns non-zero if hardware parameters have to be set again.
+ */
+static int latency_shrink(struct audio_output *self)
+{
+	time_t now = now_sec();
+	unsigned int latency_us;
+
+	if (now - self->quiet_since < AUDIO_OUTPUT_QUIET_SEC)
+		return 0;
+
+	self->quiet_since = now;
+
+	latency_us = clamp_latency(self->latency_us * 3 / 4);
+	if (latency_us == self->latency_us)
+		return 0;
+
+	latency_update(self, latency_us);
+
+	return 1;
+}
+
+/*
+ * Recovers from an xrun or a suspend.
+ *
+ * Underruns caused by the application running out of data, e.g. at the end of
+ * the stream, are not counted. Clustered xruns grow the buffer, which can be
+ * done right away since the buffer is empty after the recovery.
+ */
+static int xrun_recover(struct audio_output *self, int err)
+{
+	time_t now = now_sec();
+	int ret;
+
+	ret = snd_pcm_recover(self->playback_handle, err, 1);
+	if (ret < 0) {
+		GP_WARN("snd_pcm_recover(): %s", snd_strerror(ret));
+		return ret;
+	}
+
+	if (self->starved)
+		return 0;
+
+	GP_WARN("Buffer underrun");
+
+	if (now - self->xrun_sec > AUDIO_OUTPUT_XRUN_WINDOW_SEC) {
+		self->xrun_sec = now;
+		self->xruns = 0;
+	}
+
+	self->quiet_since = now;
+
+	if (++self->xruns >= AUDIO_OUTPUT_XRUN_CLUSTER &&
+	    self->latency_us < AUDIO_OUTPUT_LATENCY_MAX) {
+		self->xruns = 0;
+		latency_update(self, clamp_latency(self->latency_us * 2));
+		return setup_hw_params(self, self->channels, self->fmt, self->sample_rate);
+	}
+
+	return 0;
+}
+
 struct audio_output *audio_output_create(const char *alsa_device,
                                          uint8_t channels,
 				         enum audio_format fmt,
-                                         uint32_t sample_rate)
+                                         uint32_t sample_rate,
+                                         unsigned int latency_us)
 {
+	struct audio_output_caps caps;
 	snd_pcm_t *handle;
 	snd_pcm_hw_params_t *hw_params;
 
 	GP_DEBUG(1, "Initializing alsa device '%s'", alsa_device);
 
+	/* Has to be done before we open the device, hw devices are exclusive */
+	probe_caps(&caps, alsa_device);
+
+	if (!(caps.formats & (1<<fmt))) {
+		enum audio_format i;
+
+		for (i = 0; i < AUDIO_FORMAT_CNT; i++) {
+			if (caps.formats & (1<<i)) {
+				fmt = i;
+				break;
+			}
+		}
+	}
+
+	channels = GP_MAX(GP_MIN(channels, caps.channels_max), caps.channels_min);
+
 	if (snd_pcm_open(&handle, alsa_device, SND_PCM_STREAM_PLAYBACK, 0) < 0) {
 		GP_WARN("Failed to open alsa output '%s'", alsa_device);
 		return NULL;
@@ -77,14 +414,13 @@ struct audio_output *audio_output_create(const char *alsa_device,
 
 	snd_pcm_hw_params_malloc(&hw_params);
 	snd_pcm_hw_params_any(handle, hw_params);
-	snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
-	snd_pcm_hw_params_set_format(handle, hw_params, convert_fmt(fmt));
-	unsigned int rate = sample_rate;
-	snd_pcm_hw_params_set_rate_near(handle, hw_params, &rate, 0);
-	snd_pcm_hw_params_set_channels(handle, hw_params, channels);
-	snd_pcm_hw_params_set_periods(handle, hw_params, 32, 0);
-	snd_pcm_hw_params_set_period_size(handle, hw_params, BUFSIZE, 0);
-	snd_pcm_hw_params(handle, hw_params);
+
+	snd_pcm_access_t access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+	if (snd_pcm_hw_params_test_access(handle, hw_params, access)) {
+		GP_DEBUG(1, "Device does not support mmap, falling back to RW access");
+		access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	}
 
 	struct audio_output *new = malloc(sizeof(struct audio_output));
 
@@ -92,51 +428,118 @@ struct audio_output *audio_output_create(const char *alsa_device,
 		GP_WARN("Malloc failed :(");
 		snd_pcm_close(handle);
 		snd_pcm_hw_params_free(hw_params);
+		return NULL;
 	}
 
-	new->fmt         = fmt;
-	new->channels    = channels;
-	new->sample_rate = sample_rate;
+	memset(new, 0, sizeof(*new));
 
+	new->caps = caps;
 	new->playback_handle = handle;
 	new->hw_params = hw_params;
+	new->access = access;
+	new->device = strdup(alsa_device);
+	new->latency_us = clamp_latency(latency_us);
+	new->quiet_since = now_sec();
+
+	if (!new->device || setup_hw_params(new, channels, fmt, sample_rate)) {
+		audio_output_destroy(new);
+		return NULL;
+	}
 
 	return new;
 }
 
-int audio_output_start(struct audio_output *self)
+int audio_output_pause(struct audio_output *self, int pause)
 {
+	snd_pcm_t *handle = self->playback_handle;
 	int ret;
 
-	GP_DEBUG(1, "Starting alsa output");
+	GP_DEBUG(1, "%s alsa output", pause ? "Pausing" : "Resuming");
+
+	if (!pause) {
+		if (!self->hw_paused)
+			return 0;
+
+		self->hw_paused = 0;
+
+		ret = snd_pcm_pause(handle, 0);
+		if (ret < 0) {
+			GP_WARN("snd_pcm_pause(): %s", snd_strerror(ret));
+			return xrun_recover(self, ret);
+		}
+
+		return 0;
+	}
+
+	if (!self->can_pause || snd_pcm_state(handle) != SND_PCM_STATE_RUNNING)
+		return 1;
 
-	ret = snd_pcm_set_params(self->playback_handle, convert_fmt(self->fmt),
-	                         SND_PCM_ACCESS_RW_INTERLEAVED,
-				 self->channels, self->sample_rate, 1, 500000);
+	ret = snd_pcm_pause(handle, 1);
 	if (ret < 0) {
-		GP_WARN("snd_pcm_hw_params(): %s", snd_strerror(ret));
-		return ret;
+		GP_WARN("snd_pcm_pause(): %s", snd_strerror(ret));
+		return 1;
 	}
 
-	ret = snd_pcm_start(self->playback_handle);
+	self->hw_paused = 1;
 
-	if (ret < 0)
-		GP_WARN("snd_pcm_start(): %s", snd_strerror(ret));
+	return 0;
+}
 
-	return ret;
+snd_pcm_sframes_t audio_output_queued(struct audio_output *self)
+{
+	snd_pcm_sframes_t avail = snd_pcm_avail_update(self->playback_handle);
+
+	if (avail < 0)
+		return 0;
+
+	return self->buffer_size - GP_MIN((snd_pcm_uframes_t)avail, self->buffer_size);
 }
 
 int audio_output_stop(struct audio_output *self)
 {
+	snd_pcm_t *handle = self->playback_handle;
 	int ret;
 
 	GP_DEBUG(1, "Stopping alsa output");
 
-	ret = snd_pcm_drop(self->playback_handle);
-
+	ret = snd_pcm_drop(handle);
 	if (ret < 0)
 		GP_WARN("snd_pcm_drop(): %s", snd_strerror(ret));
 
+	self->starved = 0;
+	self->hw_paused = 0;
+
+	/* The buffer is empty now, good time to apply a smaller size */
+	if (latency_shrink(self))
+		return setup_hw_params(self, self->channels, self->fmt, self->sample_rate);
+
+	/*
+	 * The PCM is started by the start threshold once enough data are
+	 * queued, starting an empty buffer would underrun right away.
+	 */
+	ret = snd_pcm_prepare(handle);
+	if (ret < 0)
+		GP_WARN("snd_pcm_prepare(): %s", snd_strerror(ret));
+
+	return ret;
+}
+
+int audio_output_drain(struct audio_output *self)
+{
+	int ret;
+
+	GP_DEBUG(1, "Draining alsa output");
+
+	/* Data below the start threshold would not be played otherwise */
+	audio_output_kick(self);
+
+	ret = snd_pcm_drain(self->playback_handle);
+
+	if (ret < 0)
+		GP_WARN("snd_pcm_drain(): %s", snd_strerror(ret));
+
+	self->starved = 0;
+
 	return ret;
 }
 
@@ -145,46 +548,21 @@ int audio_output_setup(struct audio_output *self,
                        enum audio_format fmt,
                        unsigned int sample_rate)
 {
-	snd_pcm_t *handle = self->playback_handle;
-	int ret;
-
 	GP_DEBUG(1, "Setting alsa output format "
 	            "(%u channels, %u sample rate, %s format)",
 	            channels, sample_rate, str_fmt(fmt));
 
 	/* Nothing to be done */
-	if (self->fmt == fmt &&
-	    self->sample_rate == sample_rate &&
-	    self->channels == channels) {
+	if (audio_output_fmt_eq(self, channels, fmt, sample_rate))
 		return 0;
-	}
 
-	unsigned int rate = sample_rate;
-
-	snd_pcm_hw_params_set_format(handle, self->hw_params, convert_fmt(fmt));
-	snd_pcm_hw_params_set_rate_near(handle, self->hw_params, &rate, 0);
-	snd_pcm_hw_params_set_channels(handle, self->hw_params, channels);
-
-	ret = snd_pcm_hw_params(handle, self->hw_params);
-	if (ret) {
-		GP_WARN("snd_pcm_hw_params(handle, hw_params): %s",
-			snd_strerror(ret));
-	}
+	latency_shrink(self);
 
-	ret = snd_pcm_set_params(handle, convert_fmt(fmt),
-	                         SND_PCM_ACCESS_RW_INTERLEAVED,
-				 channels, sample_rate, 1, 500000);
-
-	if (ret) {
-		GP_WARN("Failed to set audio format: %s",
-		        snd_strerror(ret));
+	if (setup_hw_params(self, channels, fmt, sample_rate)) {
+		GP_WARN("Failed to set audio format");
 		return -1;
 	}
 
-	self->fmt = fmt;
-	self->channels = channels;
-	self->sample_rate = sample_rate;
-
 	return 0;
 }
 
@@ -194,7 +572,7 @@ unsigned int audio_buf_avail(struct audio_output *self)
 
 	if (avail < 0) {
 		GP_WARN("snd_pcm_avail(): %s", snd_strerror(avail));
-		snd_pcm_prepare(self->playback_handle);
+		xrun_recover(self, avail);
 		return 256;
 	}
 
@@ -206,18 +584,175 @@ void audio_output_destroy(struct audio_output *self)
 	GP_DEBUG(1, "Destroing ALSA output");
 	snd_pcm_close(self->playback_handle);
 	snd_pcm_hw_params_free(self->hw_params);
+	free(self->poll_fds);
+	free(self->device);
 	free(self);
 }
 
 int audio_output_write(struct audio_output *self, void *buf,
                        unsigned int samples)
 {
+	snd_pcm_sframes_t ret;
+	int retries = 0;
+
+	/* The chunk is written again after the recovery so nothing is lost */
+	for (;;) {
+		if (self->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+			ret = snd_pcm_mmap_writei(self->playback_handle, buf, samples);
+		else
+			ret = snd_pcm_writei(self->playback_handle, buf, samples);
+
+		if (ret >= 0)
+			break;
+
+		if (retries++ >= AUDIO_OUTPUT_WRITE_RETRIES || xrun_recover(self, ret)) {
+			GP_WARN("Failed to write %u frames: %s",
+			        samples, snd_strerror(ret));
+			return ret;
+		}
+	}
+
+	self->starved = 0;
+
+	return ret;
+}
+
+snd_pcm_sframes_t audio_output_avail(struct audio_output *self)
+{
+	snd_pcm_sframes_t avail = snd_pcm_avail_update(self->playback_handle);
+
+	if (avail < 0) {
+		if (xrun_recover(self, avail))
+			return avail;
+
+		return snd_pcm_avail_update(self->playback_handle);
+	}
+
+	return avail;
+}
+
+snd_pcm_sframes_t audio_output_mmap_begin(struct audio_output *self, void **buf,
+                                          snd_pcm_uframes_t frames)
+{
+	const snd_pcm_channel_area_t *areas;
 	int ret;
 
-	if ((ret = snd_pcm_writei(self->playback_handle, buf, samples)) < 0) {
-		snd_pcm_prepare(self->playback_handle);
-		GP_WARN("Buffer underun");
+	ret = snd_pcm_mmap_begin(self->playback_handle, &areas,
+	                         &self->mmap_offset, &frames);
+	if (ret < 0) {
+		xrun_recover(self, ret);
+		return 0;
 	}
 
-	return ret;
+	/* Interleaved access, all channels share the first area */
+	*buf = (char *)areas[0].addr + areas[0].first / 8 +
+	       self->mmap_offset * (areas[0].step / 8);
+
+	return frames;
+}
+
+int audio_output_mmap_commit(struct audio_output *self, snd_pcm_uframes_t frames)
+{
+	snd_pcm_t *handle = self->playback_handle;
+	snd_pcm_sframes_t ret, avail;
+
+	/*
+	 * On failure the frames are not consumed from the ring buffer and are
+	 * written again after the recovery.
+	 */
+	ret = snd_pcm_mmap_commit(handle, self->mmap_offset, frames);
+	if (ret < 0 || (snd_pcm_uframes_t)ret != frames) {
+		xrun_recover(self, ret < 0 ? ret : -EPIPE);
+		return -1;
+	}
+
+	self->starved = 0;
+
+	/* Unlike writei() mmap commit does not start the PCM */
+	if (snd_pcm_state(handle) != SND_PCM_STATE_PREPARED)
+		return 0;
+
+	avail = snd_pcm_avail_update(handle);
+	if (avail >= 0 && self->buffer_size - avail >= self->start_threshold) {
+		ret = snd_pcm_start(handle);
+		if (ret < 0)
+			GP_WARN("snd_pcm_start(): %s", snd_strerror(ret));
+	}
+
+	return 0;
+}
+
+void audio_output_kick(struct audio_output *self)
+{
+	snd_pcm_t *handle = self->playback_handle;
+	snd_pcm_sframes_t avail;
+	int ret;
+
+	/* We ran out of data, an underrun is expected */
+	self->starved = 1;
+
+	if (snd_pcm_state(handle) != SND_PCM_STATE_PREPARED)
+		return;
+
+	avail = snd_pcm_avail_update(handle);
+	if (avail < 0 || (snd_pcm_uframes_t)avail >= self->buffer_size)
+		return;
+
+	ret = snd_pcm_start(handle);
+	if (ret < 0)
+		GP_WARN("snd_pcm_start(): %s", snd_strerror(ret));
+}
+
+static void count_wakeup(struct audio_output *self)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (now.tv_sec != self->wakeups_sec) {
+		self->wakeups_per_sec = self->wakeups;
+		self->wakeups = 0;
+		self->wakeups_sec = now.tv_sec;
+		GP_DEBUG(2, "Output wakeups %u/s", self->wakeups_per_sec);
+	}
+
+	self->wakeups++;
+}
+
+int audio_output_poll(struct audio_output *self, int fd)
+{
+	unsigned short revents;
+	int ret;
+
+	self->poll_fds[0] = (struct pollfd) {
+		.fd = fd,
+		.events = POLLIN,
+	};
+
+	ret = poll(self->poll_fds, self->poll_fds_cnt, -1);
+
+	count_wakeup(self);
+
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+
+		GP_WARN("poll(): %s", strerror(errno));
+		return -1;
+	}
+
+	if (self->poll_fds[0].revents & POLLIN)
+		return 0;
+
+	ret = snd_pcm_poll_descriptors_revents(self->playback_handle,
+	                                       self->poll_fds + 1,
+	                                       self->poll_fds_cnt - 1,
+	                                       &revents);
+	if (ret < 0) {
+		GP_WARN("snd_pcm_poll_descriptors_revents(): %s", snd_strerror(ret));
+		return -1;
+	}
+
+	/* Errors, e.g. underrun are handled in audio_output_avail() */
+	return !!(revents & (POLLOUT | POLLERR));
 }
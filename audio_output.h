@@ -11,34 +11,109 @@
 #include <alsa/asoundlib.h>
 #include <stdint.h>
 #include <endian.h>
+#include <time.h>
 
 #define AUDIO_DEVICE_DEFAULT "default"
 
+/* Buffer latency limits in microseconds */
+#define AUDIO_OUTPUT_LATENCY_MIN 20000
+#define AUDIO_OUTPUT_LATENCY_DEFAULT 100000
+#define AUDIO_OUTPUT_LATENCY_MAX 1000000
+
+/* Number of periods in the buffer */
+#define AUDIO_OUTPUT_PERIODS 4
+
+/* Number of xruns within the window that doubles the buffer size */
+#define AUDIO_OUTPUT_XRUN_CLUSTER 2
+#define AUDIO_OUTPUT_XRUN_WINDOW_SEC 60
+
+/* Buffer is shrinked by a quarter after a period without xruns */
+#define AUDIO_OUTPUT_QUIET_SEC 900
+
+/* How many times is a write retried after an xrun recovery */
+#define AUDIO_OUTPUT_WRITE_RETRIES 3
+
 enum audio_format {
 	AUDIO_FORMAT_S16LE,
 	AUDIO_FORMAT_S16BE,
 	AUDIO_FORMAT_S32LE,
 	AUDIO_FORMAT_S32BE,
+	/* Packed into three bytes */
+	AUDIO_FORMAT_S24LE,
+	AUDIO_FORMAT_S24BE,
+	AUDIO_FORMAT_FLOATLE,
+	AUDIO_FORMAT_FLOATBE,
+	AUDIO_FORMAT_CNT,
 };
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 # define AUDIO_FORMAT_S16 AUDIO_FORMAT_S16LE
+# define AUDIO_FORMAT_S24 AUDIO_FORMAT_S24LE
 # define AUDIO_FORMAT_S32 AUDIO_FORMAT_S32LE
+# define AUDIO_FORMAT_FLOAT AUDIO_FORMAT_FLOATLE
 #elif __BYTE_ORDER == __BIG_ENDIAN
 # define AUDIO_FORMAT_S16 AUDIO_FORMAT_S16BE
+# define AUDIO_FORMAT_S24 AUDIO_FORMAT_S24BE
 # define AUDIO_FORMAT_S32 AUDIO_FORMAT_S32BE
+# define AUDIO_FORMAT_FLOAT AUDIO_FORMAT_FLOATBE
 #else
 # error Unknown indianity!
 #endif
 
+/*
+ * Formats the device takes without a conversion, probed once on create.
+ */
+struct audio_output_caps {
+	/* Bitmask of enum audio_format */
+	uint32_t formats;
+	/* Bitmask of standard sample rates, see audio_output_rate_native() */
+	uint32_t rates;
+	uint8_t channels_min;
+	uint8_t channels_max;
+};
+
 struct audio_output {
+	char *device;
+	struct audio_output_caps caps;
 	snd_pcm_t *playback_handle;
 	snd_pcm_hw_params_t *hw_params;
 
+	/* Mmap interleaved if supported by the device, RW interleaved otherwise */
+	snd_pcm_access_t access;
+	snd_pcm_uframes_t mmap_offset;
+
 	/* Current output settings */
 	enum audio_format fmt;
 	uint8_t channels;
 	unsigned int sample_rate;
+
+	/* Buffer geometry, avail_min is set to a period */
+	snd_pcm_uframes_t period_size;
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t start_threshold;
+
+	/* Buffer latency in microseconds adapted to the xrun history */
+	unsigned int latency_us;
+	/* Set when latency_us has changed, cleared by the user */
+	int latency_changed;
+	/* Set when we ran out of data, underruns are expected then */
+	int starved;
+	unsigned int xruns;
+	time_t xrun_sec;
+	time_t quiet_since;
+
+	/* Device supports hardware pause */
+	int can_pause;
+	int hw_paused;
+
+	/* Poll descriptors, the first one is reserved for audio_output_poll() fd */
+	unsigned int poll_fds_cnt;
+	struct pollfd *poll_fds;
+
+	/* Poll wakeups statistics */
+	unsigned int wakeups;
+	unsigned int wakeups_per_sec;
+	time_t wakeups_sec;
 };
 
 #define AUDIO_BUFSIZE_TO_SAMPLES(alsa_out, buf_size) \
@@ -47,13 +122,36 @@ struct audio_output {
 #define AUDIO_SAMPLES_TO_BUFSIZE(alsa_out, samples) \
 	((alsa_out)->channels * audio_format_size((alsa_out)->fmt) * (samples))
 
+/*
+ * Opens an alsa device.
+ *
+ * The latency_us is the initial buffer latency, e.g. stored from a previous
+ * run, zero selects the default.
+ */
 struct audio_output *audio_output_create(const char *alsa_device,
                                          uint8_t channels,
 				         enum audio_format fmt,
-					 unsigned int sample_rate);
+					 unsigned int sample_rate,
+					 unsigned int latency_us);
 
-int audio_output_start(struct audio_output *self);
+/*
+ * Pauses or resumes the playback with the hardware pause.
+ *
+ * Hardware parameters are not touched, resume continues where pause stopped.
+ *
+ * Returns zero on success, non-zero if the device cannot pause or is not
+ * running, the caller has to stop the output then.
+ */
+int audio_output_pause(struct audio_output *self, int pause);
 
+/*
+ * Returns number of frames written to the buffer but not played yet.
+ */
+snd_pcm_sframes_t audio_output_queued(struct audio_output *self);
+
+/*
+ * Drops all queued frames, the output is ready for new data afterwards.
+ */
 int audio_output_stop(struct audio_output *self);
 
 int audio_output_setup(struct audio_output *self,
@@ -61,13 +159,95 @@ int audio_output_setup(struct audio_output *self,
                        enum audio_format fmt,
                        unsigned int sample_rate);
 
+/*
+ * Returns non-zero if the output is already set to the format.
+ */
+static inline int audio_output_fmt_eq(struct audio_output *self,
+                                      uint8_t channels,
+                                      enum audio_format fmt,
+                                      unsigned int sample_rate)
+{
+	return self->fmt == fmt &&
+	       self->sample_rate == sample_rate &&
+	       self->channels == channels;
+}
+
+/*
+ * Blocks until all queued frames have been played.
+ */
+int audio_output_drain(struct audio_output *self);
+
 unsigned int audio_format_size(enum audio_format fmt);
 
+static inline int audio_output_fmt_native(struct audio_output *self, enum audio_format fmt)
+{
+	return !!(self->caps.formats & (1<<fmt));
+}
+
+static inline int audio_output_channels_native(struct audio_output *self, uint8_t channels)
+{
+	return channels >= self->caps.channels_min && channels <= self->caps.channels_max;
+}
+
+/*
+ * Returns non-zero if the device takes the sample rate without resampling.
+ */
+int audio_output_rate_native(struct audio_output *self, unsigned int rate);
+
+/*
+ * Returns a native sample rate to resample to, 48kHz or 44.1kHz if possible.
+ */
+unsigned int audio_output_rate_preferred(struct audio_output *self);
+
 unsigned int audio_buf_avail(struct audio_output *self);
 
 void audio_output_destroy(struct audio_output *self);
 
+/*
+ * Writes frames, recovers from xruns and retries the write.
+ *
+ * Returns number of frames written or a negative error.
+ */
 int audio_output_write(struct audio_output *self, void *buf,
                        unsigned int samples);
 
+/*
+ * Returns a pointer to continuous space in the mmaped ALSA buffer.
+ *
+ * Can be used only if output access is SND_PCM_ACCESS_MMAP_INTERLEAVED.
+ * Returns number of frames that can be written to the buffer, at most frames.
+ */
+snd_pcm_sframes_t audio_output_mmap_begin(struct audio_output *self, void **buf,
+                                          snd_pcm_uframes_t frames);
+
+/*
+ * Commits frames written into the buffer returned by audio_output_mmap_begin().
+ */
+int audio_output_mmap_commit(struct audio_output *self, snd_pcm_uframes_t frames);
+
+static inline int audio_output_is_mmap(struct audio_output *self)
+{
+	return self->access == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+}
+
+/*
+ * Returns number of frames that can be written without blocking.
+ */
+snd_pcm_sframes_t audio_output_avail(struct audio_output *self);
+
+/*
+ * Called when we ran out of data.
+ *
+ * Starts the playback if there is less data queued than the start threshold,
+ * the underrun that follows is not counted as an xrun.
+ */
+void audio_output_kick(struct audio_output *self);
+
+/*
+ * Waits until at least a period can be written or fd is readable.
+ *
+ * Returns 1 if output is writable, 0 if woken up by the fd, -1 on error.
+ */
+int audio_output_poll(struct audio_output *self, int fd);
+
 #endif /* AUDIO_OUTPUT_H__ */
@@ -0,0 +1,432 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <core/gp_common.h>
+#include <core/gp_debug.h>
+
+#include "audio_convert.h"
+#include "audio_resample.h"
+
+/* Upper limit for the number of phases, i.e. filter table size */
+#define MAX_PHASES 4096
+
+/* Frames converted at once, sized for buffers on the stack */
+#define BLOCK_FRAMES 256
+
+static const struct quality_tier {
+	const char *name;
+	unsigned int taps;
+	/* Kaiser window beta */
+	double beta;
+	/* Cutoff relative to the lower Nyquist frequency */
+	double rolloff;
+} tiers[AUDIO_RESAMPLE_CNT] = {
+	[AUDIO_RESAMPLE_OFF] = {"off", 0, 0, 0},
+	[AUDIO_RESAMPLE_FAST] = {"fast", 8, 5.0, 0.85},
+	[AUDIO_RESAMPLE_MEDIUM] = {"medium", 16, 7.0, 0.90},
+	[AUDIO_RESAMPLE_BEST] = {"best", 32, 9.0, 0.94},
+};
+
+typedef float v4f __attribute__((vector_size(16)));
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	while (b) {
+		unsigned int t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/* Modified Bessel function of the first kind */
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	unsigned int k;
+
+	for (k = 1; k < 50; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+
+	return sum;
+}
+
+/*
+ * Designs a windowed sinc lowpass of up * taps coefficients and splits it into
+ * up phases. Coefficients in each phase are reversed so that they are
+ * multiplied with input frames in the order they are stored in.
+ */
+static float *design_filter(unsigned int up, unsigned int down, const struct quality_tier *tier)
+{
+	unsigned int taps = tier->taps;
+	unsigned int len = up * taps;
+	double fc = 0.5 * tier->rolloff / GP_MAX(up, down);
+	double center = (len - 1) / 2.0;
+	double i0_beta = bessel_i0(tier->beta);
+	double sum = 0;
+	unsigned int i, p, k;
+	double *proto;
+	float *coefs;
+
+	proto = malloc(sizeof(double) * len);
+	coefs = aligned_alloc(16, sizeof(float) * len);
+
+	if (!proto || !coefs) {
+		free(proto);
+		free(coefs);
+		return NULL;
+	}
+
+	for (i = 0; i < len; i++) {
+		double t = i - center;
+		double r = 2.0 * i / (len - 1) - 1;
+		double sinc = t == 0 ? 1 : sin(2 * M_PI * fc * t) / (2 * M_PI * fc * t);
+		double win = bessel_i0(tier->beta * sqrt(GP_MAX(0.0, 1 - r * r))) / i0_beta;
+
+		proto[i] = sinc * win;
+		sum += proto[i];
+	}
+
+	/* Unity gain for each phase */
+	for (p = 0; p < up; p++) {
+		for (k = 0; k < taps; k++)
+			coefs[p * taps + (taps - 1 - k)] = proto[p + k * up] * up / sum;
+	}
+
+	free(proto);
+
+	return coefs;
+}
+
+static void reset(struct audio_resample *self)
+{
+	unsigned int ch;
+
+	/* Filter history starts with silence */
+	for (ch = 0; ch < self->channels; ch++)
+		memset(self->in[ch], 0, sizeof(float) * (self->taps - 1));
+
+	self->in_frames = self->taps - 1;
+	self->pos = 0;
+	self->phase = 0;
+	self->partial_len = 0;
+}
+
+static int in_reserve(struct audio_resample *self, size_t frames)
+{
+	unsigned int ch;
+	size_t size;
+
+	if (self->in_frames + frames <= self->in_size)
+		return 0;
+
+	size = GP_MAX(self->in_size * 2, self->in_frames + frames);
+
+	for (ch = 0; ch < self->channels; ch++) {
+		float *in = realloc(self->in[ch], sizeof(float) * size);
+
+		if (!in) {
+			GP_WARN("Failed to allocate resampler buffer");
+			return 1;
+		}
+
+		self->in[ch] = in;
+	}
+
+	self->in_size = size;
+
+	return 0;
+}
+
+int audio_resample_setup(struct audio_resample *self, unsigned int channels,
+                         enum audio_format fmt, unsigned int in_rate,
+                         unsigned int out_rate, enum audio_resample_quality quality)
+{
+	unsigned int div = gcd(in_rate, out_rate);
+	unsigned int up = out_rate / div, down = in_rate / div;
+	unsigned int taps = tiers[quality].taps;
+	float *coefs;
+
+	if (quality == AUDIO_RESAMPLE_OFF || !channels ||
+	    channels > AUDIO_RESAMPLE_CHANNELS || fmt >= AUDIO_FORMAT_CNT ||
+	    up > MAX_PHASES) {
+		GP_DEBUG(1, "Resampling %u -> %u not supported", in_rate, out_rate);
+		audio_resample_exit(self);
+		return 1;
+	}
+
+	if (self->coefs && self->up == up && self->down == down &&
+	    self->quality == quality && self->channels == channels) {
+		self->fmt = fmt;
+		self->in_rate = in_rate;
+		self->out_rate = out_rate;
+		reset(self);
+		return 0;
+	}
+
+	audio_resample_exit(self);
+
+	coefs = design_filter(up, down, &tiers[quality]);
+	if (!coefs) {
+		GP_WARN("Failed to allocate resampler filter");
+		return 1;
+	}
+
+	self->coefs = coefs;
+	self->quality = quality;
+	self->fmt = fmt;
+	self->channels = channels;
+	self->in_rate = in_rate;
+	self->out_rate = out_rate;
+	self->up = up;
+	self->down = down;
+	self->taps = taps;
+
+	if (in_reserve(self, taps - 1)) {
+		audio_resample_exit(self);
+		return 1;
+	}
+
+	reset(self);
+
+	GP_DEBUG(1, "Resampling %u -> %u (%u/%u) %s quality, %u phases of %u taps",
+	         in_rate, out_rate, up, down, tiers[quality].name, up, taps);
+
+	return 0;
+}
+
+void audio_resample_exit(struct audio_resample *self)
+{
+	unsigned int ch;
+
+	for (ch = 0; ch < AUDIO_RESAMPLE_CHANNELS; ch++)
+		free(self->in[ch]);
+
+	free(self->coefs);
+
+	memset(self, 0, sizeof(*self));
+}
+
+/*
+ * Converts interleaved frames into the planar float input buffer.
+ */
+static void deinterleave(struct audio_resample *self, const unsigned char *buf, size_t frames)
+{
+	unsigned int ch, channels = self->channels;
+	unsigned int frame_size = channels * audio_format_size(self->fmt);
+	float tmp[BLOCK_FRAMES * AUDIO_RESAMPLE_CHANNELS];
+	float *dst[AUDIO_RESAMPLE_CHANNELS];
+
+	while (frames) {
+		size_t cnt = GP_MIN(frames, (size_t)BLOCK_FRAMES);
+
+		for (ch = 0; ch < channels; ch++)
+			dst[ch] = self->in[ch] + self->in_frames;
+
+		audio_to_float(self->fmt, tmp, buf, cnt * channels);
+		audio_deinterleave(dst, tmp, channels, cnt);
+
+		self->in_frames += cnt;
+		buf += cnt * frame_size;
+		frames -= cnt;
+	}
+}
+
+int audio_resample_write(struct audio_resample *self, const void *buf, size_t size)
+{
+	unsigned int frame_size = self->channels * audio_format_size(self->fmt);
+	const unsigned char *src = buf;
+	size_t frames;
+	unsigned int ch;
+
+	/* Drop frames that are no longer needed */
+	if (self->pos) {
+		for (ch = 0; ch < self->channels; ch++) {
+			memmove(self->in[ch], self->in[ch] + self->pos,
+			        sizeof(float) * (self->in_frames - self->pos));
+		}
+
+		self->in_frames -= self->pos;
+		self->pos = 0;
+	}
+
+	if (in_reserve(self, size / frame_size + 1))
+		return 1;
+
+	if (self->partial_len) {
+		size_t len = GP_MIN(size, frame_size - self->partial_len);
+
+		memcpy(self->partial + self->partial_len, src, len);
+		self->partial_len += len;
+		src += len;
+		size -= len;
+
+		if (self->partial_len < frame_size)
+			return 0;
+
+		deinterleave(self, self->partial, 1);
+		self->partial_len = 0;
+	}
+
+	frames = size / frame_size;
+
+	deinterleave(self, src, frames);
+
+	self->partial_len = size - frames * frame_size;
+	memcpy(self->partial, src + frames * frame_size, self->partial_len);
+
+	return 0;
+}
+
+int audio_resample_flush(struct audio_resample *self)
+{
+	unsigned int ch;
+
+	if (in_reserve(self, self->taps))
+		return 1;
+
+	for (ch = 0; ch < self->channels; ch++)
+		memset(self->in[ch] + self->in_frames, 0, sizeof(float) * self->taps);
+
+	self->in_frames += self->taps;
+	self->partial_len = 0;
+
+	return 0;
+}
+
+static inline float dot(const float *coefs, const float *in, unsigned int taps)
+{
+	v4f acc0 = {0}, acc1 = {0};
+	unsigned int i;
+
+	/* Taps are multiple of 8, input is not aligned */
+	for (i = 0; i < taps; i += 8) {
+		v4f c0, c1, x0, x1;
+
+		memcpy(&c0, coefs + i, sizeof(c0));
+		memcpy(&c1, coefs + i + 4, sizeof(c1));
+		memcpy(&x0, in + i, sizeof(x0));
+		memcpy(&x1, in + i + 4, sizeof(x1));
+
+		acc0 += c0 * x0;
+		acc1 += c1 * x1;
+	}
+
+	acc0 += acc1;
+
+	return acc0[0] + acc0[1] + acc0[2] + acc0[3];
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+size_t audio_resample_read(struct audio_resample *self, void *buf, size_t frames)
+{
+	unsigned int ch, channels = self->channels, taps = self->taps;
+	unsigned int frame_size = channels * audio_format_size(self->fmt);
+	float planar[AUDIO_RESAMPLE_CHANNELS][BLOCK_FRAMES];
+	float tmp[BLOCK_FRAMES * AUDIO_RESAMPLE_CHANNELS];
+	float *out[AUDIO_RESAMPLE_CHANNELS];
+	uint64_t start = now_ns();
+	size_t cnt = 0, n;
+
+	for (ch = 0; ch < channels; ch++)
+		out[ch] = planar[ch];
+
+	while (cnt < frames && audio_resample_avail(self)) {
+		size_t max = GP_MIN(frames - cnt, (size_t)BLOCK_FRAMES);
+
+		for (n = 0; n < max && audio_resample_avail(self); n++) {
+			const float *coefs = self->coefs + self->phase * taps;
+
+			for (ch = 0; ch < channels; ch++)
+				planar[ch][n] = dot(coefs, self->in[ch] + self->pos, taps);
+
+			self->phase += self->down;
+			self->pos += self->phase / self->up;
+			self->phase %= self->up;
+		}
+
+		audio_interleave(tmp, out, channels, n);
+		audio_from_float(self->fmt, (unsigned char *)buf + cnt * frame_size,
+		                 tmp, n * channels);
+		cnt += n;
+	}
+
+	self->stat_ns += now_ns() - start;
+	self->stat_frames += cnt;
+
+	if (self->stat_frames >= 10 * self->out_rate) {
+		GP_DEBUG(2, "Resampler %s %.1f ns/frame",
+		         tiers[self->quality].name,
+		         (double)self->stat_ns / self->stat_frames);
+		self->stat_ns = 0;
+		self->stat_frames = 0;
+	}
+
+	return cnt;
+}
+
+static void bench(void)
+{
+	const unsigned int in_rate = 44100, out_rate = 48000, channels = 2;
+	float in[256 * 2], out[512 * 2];
+	enum audio_resample_quality q;
+	unsigned int i;
+
+	for (i = 0; i < GP_ARRAY_SIZE(in) / channels; i++) {
+		in[2*i] = sinf(2 * M_PI * 1000 * i / in_rate);
+		in[2*i+1] = in[2*i];
+	}
+
+	for (q = AUDIO_RESAMPLE_FAST; q < AUDIO_RESAMPLE_CNT; q++) {
+		struct audio_resample rs = {};
+		uint64_t start, frames = 0;
+
+		if (audio_resample_setup(&rs, channels, AUDIO_FORMAT_FLOAT,
+		                         in_rate, out_rate, q))
+			continue;
+
+		start = now_ns();
+
+		/* About ten seconds of stereo audio */
+		for (i = 0; i < 10 * in_rate / 256; i++) {
+			audio_resample_write(&rs, in, sizeof(in));
+			frames += audio_resample_read(&rs, out, GP_ARRAY_SIZE(out) / channels);
+		}
+
+		GP_DEBUG(1, "Resampler %s %u -> %u: %.1f ns per output frame",
+		         tiers[q].name, in_rate, out_rate,
+		         (double)(now_ns() - start) / frames);
+
+		audio_resample_exit(&rs);
+	}
+}
+
+void audio_resample_bench(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	if (gp_get_debug_level() >= 1)
+		pthread_once(&once, bench);
+}
@@ -0,0 +1,162 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * A polyphase sample rate converter.
+ *
+ * The conversion ratio is reduced to up/down integers and a windowed sinc
+ * lowpass is split into up phases, each output frame is then a dot product
+ * of one phase with the last taps input frames. The input frames are kept in
+ * a planar float buffer so that the dot products run on continuous memory.
+ */
+
+#ifndef AUDIO_RESAMPLE_H__
+#define AUDIO_RESAMPLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "audio_output.h"
+
+/**
+ * @brief Resampler quality tiers.
+ */
+enum audio_resample_quality {
+	/** @brief Resampling is disabled. */
+	AUDIO_RESAMPLE_OFF,
+	/** @brief 8 taps per phase. */
+	AUDIO_RESAMPLE_FAST,
+	/** @brief 16 taps per phase. */
+	AUDIO_RESAMPLE_MEDIUM,
+	/** @brief 32 taps per phase. */
+	AUDIO_RESAMPLE_BEST,
+	AUDIO_RESAMPLE_CNT,
+};
+
+/**
+ * @brief Maximal number of channels the resampler can handle.
+ */
+#define AUDIO_RESAMPLE_CHANNELS 8
+
+struct audio_resample {
+	enum audio_resample_quality quality;
+	enum audio_format fmt;
+	unsigned int channels;
+	unsigned int in_rate;
+	unsigned int out_rate;
+
+	/* Reduced conversion ratio */
+	unsigned int up;
+	unsigned int down;
+
+	/* Filter phases, up phases of taps coefficients */
+	unsigned int taps;
+	float *coefs;
+
+	/* Planar input frames, starting with taps - 1 frames of history */
+	float *in[AUDIO_RESAMPLE_CHANNELS];
+	size_t in_frames;
+	size_t in_size;
+
+	/* Position of the next output frame */
+	size_t pos;
+	unsigned int phase;
+
+	/* Incomplete input frame */
+	unsigned char partial[AUDIO_RESAMPLE_CHANNELS * 4];
+	unsigned int partial_len;
+
+	/* Processing time statistics */
+	uint64_t stat_ns;
+	uint64_t stat_frames;
+};
+
+/**
+ * @brief Sets up the resampler for a conversion.
+ *
+ * Can be called repeatedly, the filter is recomputed only if the ratio or the
+ * quality changes and the state is reset.
+ *
+ * @param channels Number of channels.
+ * @param fmt A sample format.
+ * @param in_rate An input sample rate.
+ * @param out_rate An output sample rate.
+ * @param quality A quality tier.
+ *
+ * @return Zero on success, non-zero if the conversion is not supported.
+ */
+int audio_resample_setup(struct audio_resample *self, unsigned int channels,
+                         enum audio_format fmt, unsigned int in_rate,
+                         unsigned int out_rate, enum audio_resample_quality quality);
+
+/**
+ * @brief Frees the resampler memory.
+ */
+void audio_resample_exit(struct audio_resample *self);
+
+/**
+ * @brief Returns non-zero if the resampler does any work.
+ */
+static inline int audio_resample_active(struct audio_resample *self)
+{
+	return self->coefs && self->in_rate != self->out_rate;
+}
+
+/**
+ * @brief Adds input samples.
+ *
+ * @param buf A buffer in the resampler sample format.
+ * @param size A buffer size in bytes, does not have to be frame aligned.
+ *
+ * @return Zero on success, non-zero on allocation failure.
+ */
+int audio_resample_write(struct audio_resample *self, const void *buf, size_t size);
+
+/**
+ * @brief Adds silence that pushes the last input frames out of the filter.
+ *
+ * Should be called at the end of the stream.
+ */
+int audio_resample_flush(struct audio_resample *self);
+
+/**
+ * @brief Returns non-zero if at least one output frame can be produced.
+ */
+static inline int audio_resample_avail(struct audio_resample *self)
+{
+	return self->coefs && self->pos + self->taps <= self->in_frames;
+}
+
+/**
+ * @brief Produces output frames in the resampler sample format.
+ *
+ * @param buf An output buffer.
+ * @param frames Maximal number of frames to produce.
+ *
+ * @return Number of frames produced.
+ */
+size_t audio_resample_read(struct audio_resample *self, void *buf, size_t frames);
+
+/**
+ * @brief Converts a position in input frames to output frames.
+ */
+static inline uint64_t audio_resample_pos(struct audio_resample *self, uint64_t pos)
+{
+	if (!audio_resample_active(self))
+		return pos;
+
+	return pos * self->out_rate / self->in_rate;
+}
+
+/**
+ * @brief Measures all quality tiers and prints ns per output frame.
+ *
+ * Runs only with debug level 1 or higher and only on the first call.
+ */
+void audio_resample_bench(void);
+
+#endif /* AUDIO_RESAMPLE_H__ */
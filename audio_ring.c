@@ -0,0 +1,39 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+#include <stdlib.h>
+#include <core/gp_debug.h>
+
+#include "audio_ring.h"
+
+int audio_ring_init(struct audio_ring *self, size_t size)
+{
+	size_t pow2 = 1;
+
+	while (pow2 < size)
+		pow2 <<= 1;
+
+	self->buf = malloc(pow2);
+	if (!self->buf) {
+		GP_WARN("Failed to allocate ring buffer");
+		return 1;
+	}
+
+	self->size = pow2;
+	atomic_init(&self->head, 0);
+	atomic_init(&self->tail, 0);
+
+	GP_DEBUG(1, "Allocated PCM ring of %zu bytes", pow2);
+
+	return 0;
+}
+
+void audio_ring_exit(struct audio_ring *self)
+{
+	free(self->buf);
+	self->buf = NULL;
+}
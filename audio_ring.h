@@ -0,0 +1,170 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * A lock-free single producer single consumer ring buffer for PCM data.
+ *
+ * The head is only ever written by the producer and the tail only by the
+ * consumer, both are free running counters that are masked on access, hence
+ * the size has to be a power of two.
+ */
+
+#ifndef AUDIO_RING_H__
+#define AUDIO_RING_H__
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+struct audio_ring {
+	unsigned char *buf;
+	size_t size;
+
+	_Atomic size_t head;
+	_Atomic size_t tail;
+};
+
+/**
+ * @brief Allocates the ring buffer memory.
+ *
+ * @param size A ring size in bytes, rounded up to a power of two.
+ * @return Zero on success.
+ */
+int audio_ring_init(struct audio_ring *self, size_t size);
+
+/**
+ * @brief Frees the ring buffer memory.
+ */
+void audio_ring_exit(struct audio_ring *self);
+
+/**
+ * @brief Returns number of bytes ready to be consumed.
+ */
+static inline size_t audio_ring_used(struct audio_ring *self)
+{
+	return atomic_load_explicit(&self->head, memory_order_acquire) -
+	       atomic_load_explicit(&self->tail, memory_order_acquire);
+}
+
+/**
+ * @brief Returns number of bytes that can be produced.
+ */
+static inline size_t audio_ring_free(struct audio_ring *self)
+{
+	return self->size - audio_ring_used(self);
+}
+
+/**
+ * @brief Returns a pointer to a continuous free space in the ring.
+ *
+ * Producer only.
+ *
+ * @param len Set to the size of the continuous free space.
+ */
+static inline void *audio_ring_write_ptr(struct audio_ring *self, size_t *len)
+{
+	size_t head = atomic_load_explicit(&self->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&self->tail, memory_order_acquire);
+	size_t off = head & (self->size - 1);
+	size_t free = self->size - (head - tail);
+
+	*len = free < self->size - off ? free : self->size - off;
+
+	return self->buf + off;
+}
+
+/**
+ * @brief Makes len bytes written to the ring visible to the consumer.
+ *
+ * Producer only.
+ */
+static inline void audio_ring_write_commit(struct audio_ring *self, size_t len)
+{
+	size_t head = atomic_load_explicit(&self->head, memory_order_relaxed);
+
+	atomic_store_explicit(&self->head, head + len, memory_order_release);
+}
+
+/**
+ * @brief Returns a pointer to continuous data in the ring.
+ *
+ * Consumer only.
+ *
+ * @param len Set to the size of the continuous data.
+ */
+static inline void *audio_ring_read_ptr(struct audio_ring *self, size_t *len)
+{
+	size_t tail = atomic_load_explicit(&self->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&self->head, memory_order_acquire);
+	size_t off = tail & (self->size - 1);
+	size_t used = head - tail;
+
+	*len = used < self->size - off ? used : self->size - off;
+
+	return self->buf + off;
+}
+
+/**
+ * @brief Returns a pointer to continuous data at a position in the ring.
+ *
+ * Consumer only, allows the consumer to read ahead of the tail and release
+ * the data later with audio_ring_skip().
+ *
+ * @param pos A position between the tail and the head.
+ * @param len Set to the size of the continuous data.
+ */
+static inline void *audio_ring_peek(struct audio_ring *self, size_t pos, size_t *len)
+{
+	size_t head = atomic_load_explicit(&self->head, memory_order_acquire);
+	size_t off = pos & (self->size - 1);
+	size_t used = head - pos;
+
+	*len = used < self->size - off ? used : self->size - off;
+
+	return self->buf + off;
+}
+
+/**
+ * @brief Releases len bytes back to the producer.
+ *
+ * Consumer only.
+ */
+static inline void audio_ring_read_commit(struct audio_ring *self, size_t len)
+{
+	size_t tail = atomic_load_explicit(&self->tail, memory_order_relaxed);
+
+	atomic_store_explicit(&self->tail, tail + len, memory_order_release);
+}
+
+/**
+ * @brief Returns the producer position.
+ */
+static inline size_t audio_ring_head(struct audio_ring *self)
+{
+	return atomic_load_explicit(&self->head, memory_order_acquire);
+}
+
+/**
+ * @brief Returns the consumer position.
+ */
+static inline size_t audio_ring_tail(struct audio_ring *self)
+{
+	return atomic_load_explicit(&self->tail, memory_order_acquire);
+}
+
+/**
+ * @brief Drops all data up to a position.
+ *
+ * Consumer only.
+ *
+ * @param pos A position between the tail and the head.
+ */
+static inline void audio_ring_skip(struct audio_ring *self, size_t pos)
+{
+	atomic_store_explicit(&self->tail, pos, memory_order_release);
+}
+
+#endif /* AUDIO_RING_H__ */
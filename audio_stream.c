@@ -0,0 +1,886 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <core/gp_common.h>
+#include <core/gp_debug.h>
+
+#include "audio_convert.h"
+#include "audio_stream.h"
+
+/* Maximal number of frames written to the output at once */
+#define OUTPUT_CHUNK 4096
+
+static void fd_signal(int fd)
+{
+	uint64_t val = 1;
+
+	if (write(fd, &val, sizeof(val)) != sizeof(val))
+		GP_WARN("Failed to write eventfd: %s", strerror(errno));
+}
+
+static void fd_drain(int fd)
+{
+	uint64_t val;
+
+	if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		GP_WARN("Failed to read eventfd: %s", strerror(errno));
+}
+
+static void output_wake(struct audio_stream *self)
+{
+	fd_signal(self->wake_fd);
+}
+
+static void event_set(struct audio_stream *self, unsigned int event)
+{
+	if (!atomic_fetch_or(&self->events, event))
+		fd_signal(self->event_fd);
+}
+
+void audio_stream_event_post(struct audio_stream *self, unsigned int event)
+{
+	event_set(self, event);
+}
+
+unsigned int audio_stream_events(struct audio_stream *self)
+{
+	fd_drain(self->event_fd);
+
+	return atomic_exchange(&self->events, 0);
+}
+
+/*
+ * Queues a marker at the current ring head, has to be called with the lock held.
+ *
+ * The lock is released while waiting for a free slot, hence a marker pushed
+ * by the decoder thread is dropped if the stream has been restarted meanwhile.
+ *
+ * Returns non-zero if the marker was dropped.
+ */
+static int marker_push(struct audio_stream *self, struct audio_stream_marker *marker)
+{
+	unsigned int gen = self->gen;
+	unsigned int head;
+
+	while (atomic_load(&self->markers_head) - atomic_load(&self->markers_tail) >= AUDIO_STREAM_MARKERS)
+		pthread_cond_wait(&self->cond, &self->lock);
+
+	if (!marker->flush && gen != self->gen)
+		return 1;
+
+	if (marker->flush)
+		self->gen++;
+
+	head = atomic_load(&self->markers_head);
+
+	marker->ring_pos = audio_ring_head(&self->ring);
+	self->markers[head % AUDIO_STREAM_MARKERS] = *marker;
+
+	atomic_store(&self->markers_head, head + 1);
+
+	pthread_cond_broadcast(&self->cond);
+	output_wake(self);
+
+	return 0;
+}
+
+/*
+ * Sets up the resampler for a new stream and converts the marker to the output
+ * rate, has to be called before the marker is pushed.
+ */
+static void resample_setup(struct audio_stream *self, struct audio_stream_marker *marker)
+{
+	self->resampling = 0;
+
+	if (!marker->channels || !self->resample_quality ||
+	    marker->sample_rate == self->resample_rate)
+		return;
+
+	if (audio_resample_setup(&self->resample, marker->channels, marker->fmt,
+	                         marker->sample_rate, self->resample_rate,
+	                         self->resample_quality))
+		return;
+
+	self->resampling = 1;
+	marker->pos = audio_resample_pos(&self->resample, marker->pos);
+	marker->sample_rate = self->resample_rate;
+}
+
+/*
+ * Returns non-zero if the queued track can be fed into the running resampler,
+ * i.e. it has the same format as the current one and the settings did not
+ * change, the output then stays sample contiguous across the tracks.
+ */
+static int resample_continues(struct audio_stream *self)
+{
+	struct audio_resample *rs = &self->resample;
+	struct audio_stream_marker *next = &self->queued;
+
+	return self->resampling &&
+	       next->channels == rs->channels && next->fmt == rs->fmt &&
+	       next->sample_rate == rs->in_rate &&
+	       self->resample_quality == rs->quality &&
+	       self->resample_rate == rs->out_rate;
+}
+
+/*
+ * Ends the current track and continues with the queued one without a gap.
+ *
+ * If the resampler keeps running the filter delay worth of frames of the
+ * current track ends up after the end of track marker, which shifts the
+ * position of the next track by a few frames.
+ */
+static void switch_track(struct audio_stream *self)
+{
+	struct audio_stream_marker eof = {.eof = 1};
+	struct audio_stream_marker next = self->queued;
+
+	self->queued.channels = 0;
+
+	GP_DEBUG(1, "Decoder switched to next track");
+
+	if (self->resample_keep) {
+		self->resample_keep = 0;
+		next.sample_rate = self->resample_rate;
+	} else {
+		resample_setup(self, &next);
+	}
+
+	if (marker_push(self, &eof))
+		return;
+
+	marker_push(self, &next);
+}
+
+/*
+ * Called once all data of the track are in the ring buffer.
+ */
+static void end_track(struct audio_stream *self)
+{
+	struct audio_stream_marker eof = {.eof = 1};
+
+	self->track_end = 0;
+
+	if (self->queued.channels) {
+		switch_track(self);
+		return;
+	}
+
+	GP_DEBUG(1, "Decoder reached end of track");
+
+	self->decoding = 0;
+	marker_push(self, &eof);
+}
+
+static void ring_write(struct audio_stream *self, const unsigned char *buf, size_t size)
+{
+	while (size) {
+		size_t len;
+		void *dst = audio_ring_write_ptr(&self->ring, &len);
+
+		len = GP_MIN(len, size);
+		memcpy(dst, buf, len);
+		audio_ring_write_commit(&self->ring, len);
+
+		buf += len;
+		size -= len;
+	}
+}
+
+static void resample_output(struct audio_stream *self)
+{
+	struct audio_resample *rs = &self->resample;
+	unsigned int frame_size = rs->channels * audio_format_size(rs->fmt);
+	size_t frames;
+
+	frames = audio_resample_read(rs, self->resample_buf,
+	                             sizeof(self->resample_buf) / frame_size);
+
+	ring_write(self, self->resample_buf, frames * frame_size);
+}
+
+static void decode(struct audio_stream *self)
+{
+	size_t len, size = 0;
+	void *buf;
+	int ret;
+
+	if (self->resampling) {
+		buf = self->decode_buf;
+		len = sizeof(self->decode_buf);
+	} else {
+		buf = audio_ring_write_ptr(&self->ring, &len);
+		len = GP_MIN(len, (size_t)AUDIO_STREAM_CHUNK);
+	}
+
+	ret = self->decode(self, buf, len, &size);
+
+	if (!self->resampling) {
+		audio_ring_write_commit(&self->ring, size);
+	} else if (audio_resample_write(&self->resample, buf, size)) {
+		ret = 1;
+	}
+
+	if (!ret && !self->queued.channels)
+		return;
+
+	/* Let the last frames out of the filter unless the next track follows */
+	self->resample_keep = resample_continues(self);
+
+	if (self->resampling && !self->resample_keep)
+		audio_resample_flush(&self->resample);
+
+	self->track_end = 1;
+}
+
+static void *decoder_thread(void *priv)
+{
+	struct audio_stream *self = priv;
+
+	pthread_mutex_lock(&self->lock);
+
+	while (!atomic_load(&self->exit)) {
+		if (!self->decoding) {
+			pthread_cond_wait(&self->cond, &self->lock);
+			continue;
+		}
+
+		if (audio_ring_free(&self->ring) < AUDIO_STREAM_CHUNK) {
+			atomic_store(&self->decoder_waiting, 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			if (audio_ring_free(&self->ring) < AUDIO_STREAM_CHUNK)
+				pthread_cond_wait(&self->cond, &self->lock);
+			atomic_store(&self->decoder_waiting, 0);
+			continue;
+		}
+
+		/* Data buffered in the resampler go first */
+		if (self->resampling && audio_resample_avail(&self->resample))
+			resample_output(self);
+		else if (self->track_end)
+			end_track(self);
+		else
+			decode(self);
+
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (atomic_load(&self->output_waiting))
+			output_wake(self);
+	}
+
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+/*
+ * The application displays seconds, hence we send an event only when a second
+ * has changed or if forced, e.g. after a seek.
+ */
+static void publish_pos(struct audio_stream *self, int force)
+{
+	long pos_ms = 0;
+
+	if (self->sample_rate)
+		pos_ms = 1000.0 * self->pos / self->sample_rate + 0.5;
+
+	atomic_store(&self->pos_ms, pos_ms);
+
+	if (!force && pos_ms / 1000 == self->pos_sec)
+		return;
+
+	self->pos_sec = pos_ms / 1000;
+	event_set(self, AUDIO_STREAM_EV_POS);
+}
+
+static void apply_marker(struct audio_stream *self, struct audio_stream_marker *marker)
+{
+	if (marker->eof) {
+		GP_DEBUG(1, "Output reached end of track");
+		event_set(self, AUDIO_STREAM_EV_FINISHED);
+		return;
+	}
+
+	self->frame_size = 0;
+	self->sample_rate = 0;
+	self->prefill = 0;
+	self->starting = 0;
+	self->pos = marker->pos;
+
+	/* Queued frames belong to the previous position */
+	if (marker->flush)
+		audio_output_stop(self->out);
+
+	/* Hardware parameters cannot be changed on a running PCM */
+	if (!marker->flush && marker->channels &&
+	    !audio_output_fmt_eq(self->out, marker->channels,
+	                         marker->fmt, marker->sample_rate))
+		audio_output_drain(self->out);
+
+	if (marker->channels) {
+		if (marker->channels * audio_format_size(marker->fmt) > AUDIO_STREAM_FRAME_MAX) {
+			GP_WARN("Frame size over %u bytes, dropping stream",
+			        AUDIO_STREAM_FRAME_MAX);
+			return;
+		}
+
+		if (audio_output_setup(self->out, marker->channels,
+		                       marker->fmt, marker->sample_rate)) {
+			GP_WARN("Failed to set output format, dropping stream");
+			return;
+		}
+
+		self->frame_size = marker->channels * audio_format_size(marker->fmt);
+		self->sample_rate = marker->sample_rate;
+
+		/* A new stream starts with a full buffer */
+		if (marker->flush) {
+			self->prefill = GP_MIN(self->out->buffer_size * self->frame_size,
+			                       self->ring.size / 2);
+			self->starting = 1;
+		}
+	}
+
+	publish_pos(self, 1);
+}
+
+/*
+ * Applies markers we have reached in the ring buffer.
+ *
+ * Returns the marker queue head we have seen.
+ */
+static unsigned int process_markers(struct audio_stream *self)
+{
+	unsigned int head = atomic_load(&self->markers_head);
+	unsigned int tail = atomic_load(&self->markers_tail);
+	unsigned int i, start = tail;
+
+	/* Anything queued before the last flush is stale */
+	for (i = tail; i != head; i++) {
+		if (self->markers[i % AUDIO_STREAM_MARKERS].flush)
+			tail = i;
+	}
+
+	while (tail != head) {
+		struct audio_stream_marker *marker = &self->markers[tail % AUDIO_STREAM_MARKERS];
+
+		if (marker->flush) {
+			self->rd = marker->ring_pos;
+			audio_ring_skip(&self->ring, self->rd);
+		} else if (self->rd != marker->ring_pos) {
+			break;
+		}
+
+		/* Never requeue data across a marker, see output_pause() */
+		self->marker_rd = self->rd;
+
+		apply_marker(self, marker);
+		tail++;
+	}
+
+	if (tail != start) {
+		atomic_store(&self->markers_tail, tail);
+		pthread_mutex_lock(&self->lock);
+		pthread_cond_broadcast(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+	}
+
+	return head;
+}
+
+/*
+ * Returns number of bytes that can be written to the output, i.e. data up to
+ * the next marker.
+ */
+static size_t output_readable(struct audio_stream *self)
+{
+	/* Ring head has to be read before markers, see marker_push() */
+	size_t head = audio_ring_head(&self->ring);
+	size_t rd = self->rd;
+	unsigned int mtail = atomic_load(&self->markers_tail);
+
+	if (mtail != atomic_load(&self->markers_head)) {
+		size_t pos = self->markers[mtail % AUDIO_STREAM_MARKERS].ring_pos;
+
+		if (pos - rd < head - rd)
+			head = pos;
+	}
+
+	if (!self->frame_size)
+		return 0;
+
+	return head - rd;
+}
+
+/*
+ * Returns number of bytes the output waits for before it writes.
+ *
+ * After a start we wait for a whole buffer, unless the data end before that,
+ * e.g. a short track, which we know once the next marker has been queued.
+ */
+static size_t output_need(struct audio_stream *self)
+{
+	if (!self->prefill ||
+	    atomic_load(&self->markers_tail) != atomic_load(&self->markers_head))
+		return self->frame_size;
+
+	return self->prefill;
+}
+
+/*
+ * Waits for data or control events, i.e. markers, pause and exit.
+ */
+static void output_wait(struct audio_stream *self, unsigned int markers_head, int paused)
+{
+	struct pollfd pfd = {.fd = self->wake_fd, .events = POLLIN};
+
+	atomic_store(&self->output_waiting, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!atomic_load(&self->exit) &&
+	    atomic_load(&self->markers_head) == markers_head &&
+	    atomic_load(&self->paused) == paused &&
+	    (paused || !self->frame_size || output_readable(self) < output_need(self))) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			GP_WARN("poll(): %s", strerror(errno));
+	}
+
+	atomic_store(&self->output_waiting, 0);
+
+	fd_drain(self->wake_fd);
+}
+
+/*
+ * Copies frames from the ring and applies the software volume, a frame that
+ * wraps around the end of the ring goes through a bounce buffer.
+ */
+static void output_copy(struct audio_stream *self, void *dst, size_t frames)
+{
+	struct audio_output *out = self->out;
+	unsigned char *ptr = dst;
+	size_t rd = self->rd;
+
+	while (frames) {
+		unsigned char bounce[AUDIO_STREAM_FRAME_MAX];
+		size_t len, cnt;
+		void *src;
+
+		src = audio_ring_peek(&self->ring, rd, &len);
+		cnt = GP_MIN(len / self->frame_size, frames);
+
+		if (!cnt) {
+			memcpy(bounce, src, len);
+			memcpy(bounce + len, self->ring.buf, self->frame_size - len);
+			src = bounce;
+			cnt = 1;
+		}
+
+		if (audio_gain_unity(&self->gain))
+			memcpy(ptr, src, cnt * self->frame_size);
+		else
+			audio_gain_apply(&self->gain, out->fmt, out->channels, ptr, src, cnt);
+
+		ptr += cnt * self->frame_size;
+		rd += cnt * self->frame_size;
+		frames -= cnt;
+	}
+}
+
+/*
+ * Copies frames from the ring directly into the mmaped ALSA buffer.
+ */
+static size_t output_write_mmap(struct audio_stream *self, size_t frames)
+{
+	snd_pcm_sframes_t ret;
+	void *dst;
+
+	ret = audio_output_mmap_begin(self->out, &dst, frames);
+	if (ret <= 0)
+		return 0;
+
+	output_copy(self, dst, ret);
+
+	if (audio_output_mmap_commit(self->out, ret))
+		return 0;
+
+	return ret;
+}
+
+static size_t output_write_rw(struct audio_stream *self, size_t frames)
+{
+	unsigned char bounce[AUDIO_STREAM_FRAME_MAX];
+	size_t len;
+	void *buf;
+	int ret;
+
+	/* Volume has to be applied on a copy, the ring data may be requeued */
+	if (!audio_gain_unity(&self->gain)) {
+		struct audio_gain gain = self->gain;
+
+		frames = GP_MIN(frames, sizeof(self->gain_buf) / self->frame_size);
+		output_copy(self, self->gain_buf, frames);
+
+		ret = audio_output_write(self->out, self->gain_buf, frames);
+		if (ret < 0)
+			ret = 0;
+
+		/*
+		 * The unwritten frames are processed again on the next write,
+		 * rewind the gain ramp to the end of the written frames.
+		 */
+		if ((size_t)ret < frames) {
+			self->gain = gain;
+			output_copy(self, self->gain_buf, ret);
+		}
+
+		return ret;
+	}
+
+	buf = audio_ring_peek(&self->ring, self->rd, &len);
+	frames = GP_MIN(len / self->frame_size, frames);
+
+	/* Frame wraps around the end of the ring */
+	if (!frames) {
+		memcpy(bounce, buf, len);
+		memcpy(bounce + len, self->ring.buf, self->frame_size - len);
+		buf = bounce;
+		frames = 1;
+	}
+
+	/* Frames that were not written stay in the ring */
+	ret = audio_output_write(self->out, buf, frames);
+	if (ret < 0)
+		return 0;
+
+	return ret;
+}
+
+/*
+ * Frames queued in the output are kept in the ring until they are played, so
+ * that they can be queued again after a pause without hardware support.
+ *
+ * At most half of the ring is kept so that the decoder can always run ahead.
+ */
+static void output_release(struct audio_stream *self, size_t queued)
+{
+	size_t keep = GP_MIN(queued * self->frame_size, self->ring.size / 2);
+	size_t tail = audio_ring_tail(&self->ring);
+
+	keep = GP_MIN(keep, self->rd - self->marker_rd);
+
+	/* Queued frames may drop under an xrun, never move tail backwards */
+	if (self->rd - keep - tail <= self->rd - tail)
+		audio_ring_skip(&self->ring, self->rd - keep);
+}
+
+/*
+ * Picks up a volume change, the gain is ramped from the current value.
+ */
+static void update_volume(struct audio_stream *self)
+{
+	unsigned int volume = atomic_load(&self->volume);
+
+	if (volume == self->gain_volume)
+		return;
+
+	self->gain_volume = volume;
+	audio_gain_set(&self->gain, volume / 100.0f, self->sample_rate);
+}
+
+static void output_write(struct audio_stream *self, size_t readable, size_t avail)
+{
+	size_t frames = GP_MIN(readable / self->frame_size, avail);
+	size_t queued = self->out->buffer_size - GP_MIN(avail, self->out->buffer_size);
+
+	frames = GP_MIN(frames, (size_t)OUTPUT_CHUNK);
+
+	update_volume(self);
+
+	if (audio_output_is_mmap(self->out))
+		frames = output_write_mmap(self, frames);
+	else
+		frames = output_write_rw(self, frames);
+
+	if (!frames)
+		return;
+
+	self->rd += frames * self->frame_size;
+	output_release(self, queued + frames);
+
+	self->pos += frames;
+	publish_pos(self, 0);
+
+	if (self->starting) {
+		struct timespec ts;
+
+		self->starting = 0;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		atomic_store(&self->started_ns, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+		event_set(self, AUDIO_STREAM_EV_STARTED);
+	}
+
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load(&self->decoder_waiting)) {
+		pthread_mutex_lock(&self->lock);
+		pthread_cond_broadcast(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+	}
+}
+
+/*
+ * Lets the application store the buffer latency adapted by the output.
+ */
+static void check_latency(struct audio_stream *self)
+{
+	if (!self->out->latency_changed)
+		return;
+
+	self->out->latency_changed = 0;
+	atomic_store(&self->latency_us, self->out->latency_us);
+	event_set(self, AUDIO_STREAM_EV_LATENCY);
+}
+
+/*
+ * Pauses the output, with hardware pause if possible.
+ *
+ * Otherwise the queued frames are dropped and the read position is moved back
+ * so that they are written again on resume.
+ */
+static void output_pause(struct audio_stream *self)
+{
+	snd_pcm_sframes_t queued;
+	size_t requeue;
+
+	if (!audio_output_pause(self->out, 1))
+		return;
+
+	queued = audio_output_queued(self->out);
+
+	audio_output_stop(self->out);
+
+	if (queued <= 0 || !self->frame_size)
+		return;
+
+	requeue = GP_MIN((size_t)queued * self->frame_size,
+	                 self->rd - audio_ring_tail(&self->ring));
+	requeue = GP_MIN(requeue, self->rd - self->marker_rd);
+	requeue -= requeue % self->frame_size;
+
+	GP_DEBUG(1, "Requeuing %zu of %li frames",
+	         requeue / self->frame_size, (long)queued);
+
+	self->rd -= requeue;
+	self->pos -= requeue / self->frame_size;
+	publish_pos(self, 1);
+}
+
+static void *output_thread(void *priv)
+{
+	struct audio_stream *self = priv;
+	int running = 1;
+
+	while (!atomic_load(&self->exit)) {
+		unsigned int markers_head = process_markers(self);
+		snd_pcm_sframes_t avail;
+		size_t readable, want;
+
+		check_latency(self);
+
+		if (atomic_load(&self->paused)) {
+			if (running) {
+				output_pause(self);
+				running = 0;
+			}
+
+			output_wait(self, markers_head, 1);
+			continue;
+		}
+
+		if (!running) {
+			audio_output_pause(self->out, 0);
+			running = 1;
+		}
+
+		readable = output_readable(self);
+
+		if (!self->frame_size || readable < output_need(self)) {
+			/* Play the rest of the data, e.g. at the end of track */
+			if (!self->prefill)
+				audio_output_kick(self->out);
+			output_wait(self, markers_head, 0);
+			continue;
+		}
+
+		self->prefill = 0;
+
+		avail = audio_output_avail(self->out);
+		want = GP_MIN(readable / self->frame_size, self->out->period_size);
+
+		if (avail <= 0 || (size_t)avail < GP_MAX(want, (size_t)1)) {
+			if (audio_output_poll(self->out, self->wake_fd) == 0)
+				fd_drain(self->wake_fd);
+			continue;
+		}
+
+		output_write(self, readable, avail);
+	}
+
+	return NULL;
+}
+
+int audio_stream_init(struct audio_stream *self, struct audio_output *out,
+                      int (*decode)(struct audio_stream *self, void *buf,
+                                    size_t buf_size, size_t *size),
+                      void *priv)
+{
+	memset(self, 0, sizeof(*self));
+
+	audio_convert_init();
+	audio_resample_bench();
+
+	if (audio_ring_init(&self->ring, AUDIO_STREAM_RING_SIZE))
+		return 1;
+
+	self->out = out;
+	atomic_init(&self->latency_us, out->latency_us);
+	atomic_init(&self->volume, 100);
+	self->gain_volume = 100;
+	audio_gain_init(&self->gain, 1.0f);
+	self->decode = decode;
+	self->priv = priv;
+
+	self->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	self->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (self->wake_fd < 0 || self->event_fd < 0) {
+		GP_WARN("Failed to create eventfd: %s", strerror(errno));
+		goto err0;
+	}
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+
+	if (pthread_create(&self->decoder_thread, NULL, decoder_thread, self)) {
+		GP_WARN("Failed to create decoder thread");
+		goto err0;
+	}
+
+	if (pthread_create(&self->output_thread, NULL, output_thread, self)) {
+		GP_WARN("Failed to create output thread");
+		goto err1;
+	}
+
+	return 0;
+err1:
+	pthread_mutex_lock(&self->lock);
+	atomic_store(&self->exit, 1);
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+	pthread_join(self->decoder_thread, NULL);
+err0:
+	if (self->wake_fd >= 0)
+		close(self->wake_fd);
+	if (self->event_fd >= 0)
+		close(self->event_fd);
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	audio_ring_exit(&self->ring);
+	return 1;
+}
+
+void audio_stream_exit(struct audio_stream *self)
+{
+	pthread_mutex_lock(&self->lock);
+	atomic_store(&self->exit, 1);
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+	output_wake(self);
+
+	pthread_join(self->decoder_thread, NULL);
+	pthread_join(self->output_thread, NULL);
+
+	close(self->wake_fd);
+	close(self->event_fd);
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	audio_resample_exit(&self->resample);
+	audio_ring_exit(&self->ring);
+}
+
+void audio_stream_start(struct audio_stream *self, uint8_t channels,
+                        enum audio_format fmt, unsigned int sample_rate,
+                        uint64_t pos)
+{
+	struct audio_stream_marker start = {
+		.flush = 1,
+		.channels = channels,
+		.fmt = fmt,
+		.sample_rate = sample_rate,
+		.pos = pos,
+	};
+
+	self->track_end = 0;
+	self->resample_keep = 0;
+	resample_setup(self, &start);
+
+	marker_push(self, &start);
+
+	/* End of the previous track may not have been consumed yet */
+	atomic_fetch_and(&self->events, ~AUDIO_STREAM_EV_FINISHED);
+
+	self->queued.channels = 0;
+	self->decoding = 1;
+}
+
+void audio_stream_queue(struct audio_stream *self, uint8_t channels,
+                        enum audio_format fmt, unsigned int sample_rate)
+{
+	self->queued.channels = channels;
+	self->queued.fmt = fmt;
+	self->queued.sample_rate = sample_rate;
+	self->queued.pos = 0;
+}
+
+void audio_stream_stop(struct audio_stream *self)
+{
+	struct audio_stream_marker stop = {.flush = 1};
+
+	marker_push(self, &stop);
+
+	atomic_fetch_and(&self->events, ~AUDIO_STREAM_EV_FINISHED);
+
+	self->queued.channels = 0;
+	self->track_end = 0;
+	self->resample_keep = 0;
+	self->decoding = 0;
+}
+
+void audio_stream_resample_set(struct audio_stream *self,
+                               enum audio_resample_quality quality,
+                               unsigned int rate)
+{
+	self->resample_quality = rate ? quality : AUDIO_RESAMPLE_OFF;
+	self->resample_rate = rate;
+}
+
+void audio_stream_pause(struct audio_stream *self, int pause)
+{
+	atomic_store(&self->paused, !!pause);
+	output_wake(self);
+}
+
+void audio_stream_volume_set(struct audio_stream *self, unsigned int volume)
+{
+	atomic_store(&self->volume, volume);
+}
@@ -0,0 +1,334 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * A threaded PCM stream.
+ *
+ * The decoder thread calls the decode callback to fill a ring buffer with PCM
+ * data and the output thread drains the ring buffer into the audio output, so
+ * that the playback does not depend on the application main loop at all.
+ *
+ * Format changes, seeks and end of track are passed from the decoder to the
+ * output thread as markers that are applied once the output thread reaches
+ * their position in the ring buffer. Since the decoder runs ahead of the
+ * output, the next track can be queued by the decode callback and its data
+ * follow the end of the current track in the ring without a gap. The
+ * application main loop only consumes events, i.e. position changes and end
+ * of track notifications, which are signalled on the event_fd.
+ *
+ * The output thread sleeps in poll() on the audio output descriptors and is
+ * woken up once per period.
+ *
+ * Optionally the decoder thread converts all tracks to a single sample rate,
+ * so that the output does not have to be reconfigured between tracks.
+ *
+ * After a start the output thread waits until the ring holds a whole output
+ * buffer, so that the device starts with a full buffer.
+ *
+ * The output thread reads the ring ahead of its tail, frames are released to
+ * the decoder only after they have been played, which allows us to pause
+ * without losing data even if the device cannot pause.
+ *
+ * The software volume is applied by the output thread while the data are
+ * copied into the device buffer, so that a change is heard right away and not
+ * after the whole ring has been played.
+ */
+
+#ifndef AUDIO_STREAM_H__
+#define AUDIO_STREAM_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "audio_gain.h"
+#include "audio_output.h"
+#include "audio_resample.h"
+#include "audio_ring.h"
+
+/**
+ * @brief Size of the PCM ring buffer in bytes.
+ */
+#define AUDIO_STREAM_RING_SIZE (1<<18)
+
+/**
+ * @brief Maximal number of bytes decoded at once.
+ */
+#define AUDIO_STREAM_CHUNK 4096
+
+/**
+ * @brief Maximal frame size in bytes.
+ *
+ * Streams with more channels are rejected, a frame that wraps around the end
+ * of the ring is copied into a buffer of this size.
+ */
+#define AUDIO_STREAM_FRAME_MAX (AUDIO_RESAMPLE_CHANNELS * 4)
+
+/**
+ * @brief Size of the marker queue.
+ */
+#define AUDIO_STREAM_MARKERS 8
+
+/**
+ * @brief Events reported back to the application.
+ */
+enum audio_stream_event {
+	/** @brief Playback position has changed. */
+	AUDIO_STREAM_EV_POS = 0x01,
+	/** @brief All data of the current track were played. */
+	AUDIO_STREAM_EV_FINISHED = 0x02,
+	/** @brief Output buffer latency has been adapted. */
+	AUDIO_STREAM_EV_LATENCY = 0x04,
+	/** @brief First frames of a started stream were written to the output. */
+	AUDIO_STREAM_EV_STARTED = 0x08,
+	/** @brief Posted by the stream user with audio_stream_event_post(). */
+	AUDIO_STREAM_EV_USER = 0x80,
+};
+
+struct audio_stream_marker {
+	/** @brief A ring position the marker applies at. */
+	size_t ring_pos;
+	/** @brief Playback position in frames at the marker. */
+	uint64_t pos;
+	/** @brief Drop all data queued before the marker. */
+	uint8_t flush:1;
+	/** @brief End of track. */
+	uint8_t eof:1;
+	/** @brief Format of the data following the marker, zero channels if none. */
+	uint8_t channels;
+	enum audio_format fmt;
+	unsigned int sample_rate;
+};
+
+struct audio_stream {
+	struct audio_output *out;
+	struct audio_ring ring;
+
+	/**
+	 * @brief Decodes PCM data.
+	 *
+	 * Called from the decoder thread with the stream lock held.
+	 *
+	 * @param buf A buffer to decode the data into.
+	 * @param buf_size A buffer size in bytes.
+	 * @param size Set to the number of bytes decoded.
+	 *
+	 * @return Zero on success, non-zero on end of track or an error.
+	 */
+	int (*decode)(struct audio_stream *self, void *buf, size_t buf_size, size_t *size);
+	void *priv;
+
+	/* Written with the lock held, consumed by the output thread */
+	struct audio_stream_marker markers[AUDIO_STREAM_MARKERS];
+	_Atomic unsigned int markers_head;
+	_Atomic unsigned int markers_tail;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t decoder_thread;
+	pthread_t output_thread;
+
+	/* Set when decoder has data to produce, protected by the lock */
+	int decoding;
+	/* Incremented on each flush, protected by the lock */
+	unsigned int gen;
+	/* Next track format set by audio_stream_queue(), protected by the lock */
+	struct audio_stream_marker queued;
+	/* All data of the track were decoded, protected by the lock */
+	int track_end;
+
+	/* Resampler state, owned by the decoder thread */
+	enum audio_resample_quality resample_quality;
+	unsigned int resample_rate;
+	int resampling;
+	/* Queued track continues through the running resampler */
+	int resample_keep;
+	struct audio_resample resample;
+	unsigned char decode_buf[AUDIO_STREAM_CHUNK];
+	unsigned char resample_buf[AUDIO_STREAM_CHUNK];
+
+	/* Wakes up the output thread */
+	int wake_fd;
+	/* Readable when there are events pending */
+	int event_fd;
+
+	_Atomic int decoder_waiting;
+	_Atomic int output_waiting;
+	_Atomic int paused;
+	_Atomic int exit;
+
+	/* Output thread state */
+	size_t rd;
+	size_t marker_rd;
+	unsigned int frame_size;
+	unsigned int sample_rate;
+	uint64_t pos;
+	long pos_sec;
+	/* Bytes to buffer before the first write after a start */
+	size_t prefill;
+	int starting;
+	unsigned int gain_volume;
+	struct audio_gain gain;
+	unsigned char gain_buf[AUDIO_STREAM_CHUNK];
+
+	_Atomic unsigned int volume;
+	_Atomic uint64_t started_ns;
+	_Atomic long pos_ms;
+	_Atomic unsigned int latency_us;
+	_Atomic unsigned int events;
+};
+
+/**
+ * @brief Initializes the stream and starts the decoder and output threads.
+ *
+ * @param out An audio output to play the data on.
+ * @param decode A decode callback.
+ * @param priv A decode callback private pointer.
+ *
+ * @return Zero on success.
+ */
+int audio_stream_init(struct audio_stream *self, struct audio_output *out,
+                      int (*decode)(struct audio_stream *self, void *buf,
+                                    size_t buf_size, size_t *size),
+                      void *priv);
+
+/**
+ * @brief Stops the threads and frees the stream buffers.
+ */
+void audio_stream_exit(struct audio_stream *self);
+
+/**
+ * @brief Locks the stream.
+ *
+ * Has to be held while decoder state is changed, since the decode callback
+ * runs with the lock held.
+ */
+static inline void audio_stream_lock(struct audio_stream *self)
+{
+	pthread_mutex_lock(&self->lock);
+}
+
+static inline void audio_stream_unlock(struct audio_stream *self)
+{
+	pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * @brief Drops all queued data and starts decoding a new stream.
+ *
+ * Has to be called with the stream lock held.
+ *
+ * @param channels Number of channels.
+ * @param fmt A sample format.
+ * @param sample_rate A sample rate.
+ * @param pos Initial position in frames.
+ */
+void audio_stream_start(struct audio_stream *self, uint8_t channels,
+                        enum audio_format fmt, unsigned int sample_rate,
+                        uint64_t pos);
+
+/**
+ * @brief Drops all queued data and stops decoding.
+ *
+ * Has to be called with the stream lock held.
+ */
+void audio_stream_stop(struct audio_stream *self);
+
+/**
+ * @brief Queues a next track after the current one.
+ *
+ * Has to be called from the decode callback once the current track has
+ * ended, the data decoded afterwards are played as the next track. The output
+ * reports AUDIO_STREAM_EV_FINISHED at the track boundary and continues
+ * playing.
+ *
+ * @param channels Number of channels.
+ * @param fmt A sample format.
+ * @param sample_rate A sample rate.
+ */
+void audio_stream_queue(struct audio_stream *self, uint8_t channels,
+                        enum audio_format fmt, unsigned int sample_rate);
+
+/**
+ * @brief Enables resampling of all streams to a single sample rate.
+ *
+ * Has to be called with the stream lock held, applies to streams started
+ * afterwards.
+ *
+ * @param quality A resampler quality, AUDIO_RESAMPLE_OFF disables resampling.
+ * @param rate An output sample rate.
+ */
+void audio_stream_resample_set(struct audio_stream *self,
+                               enum audio_resample_quality quality,
+                               unsigned int rate);
+
+/**
+ * @brief Pauses or resumes the playback.
+ *
+ * @param pause Non-zero to pause, zero to resume.
+ */
+void audio_stream_pause(struct audio_stream *self, int pause);
+
+/**
+ * @brief Sets the software volume.
+ *
+ * @param volume A volume in percents, 100 leaves the samples unchanged.
+ */
+void audio_stream_volume_set(struct audio_stream *self, unsigned int volume);
+
+/**
+ * @brief Returns the software volume in percents.
+ */
+static inline unsigned int audio_stream_volume(struct audio_stream *self)
+{
+	return atomic_load(&self->volume);
+}
+
+/**
+ * @brief Posts an event to the event_fd.
+ *
+ * Allows the stream user to wake up the application main loop, e.g. from its
+ * own threads.
+ *
+ * @param event An event, AUDIO_STREAM_EV_USER or a higher bit.
+ */
+void audio_stream_event_post(struct audio_stream *self, unsigned int event);
+
+/**
+ * @brief Returns and clears pending events.
+ *
+ * Should be called when the event_fd is readable.
+ *
+ * @return A bitmask of enum audio_stream_event.
+ */
+unsigned int audio_stream_events(struct audio_stream *self);
+
+/**
+ * @brief Returns current playback position in miliseconds.
+ */
+static inline long audio_stream_pos_ms(struct audio_stream *self)
+{
+	return atomic_load(&self->pos_ms);
+}
+
+/**
+ * @brief Returns CLOCK_MONOTONIC time of the last AUDIO_STREAM_EV_STARTED in ns.
+ */
+static inline uint64_t audio_stream_started_ns(struct audio_stream *self)
+{
+	return atomic_load(&self->started_ns);
+}
+
+/**
+ * @brief Returns current output buffer latency in microseconds.
+ */
+static inline unsigned int audio_stream_latency_us(struct audio_stream *self)
+{
+	return atomic_load(&self->latency_us);
+}
+
+#endif /* AUDIO_STREAM_H__ */
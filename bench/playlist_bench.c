@@ -0,0 +1,145 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2024 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Playlist benchmark.
+ *
+ * Generates a text playlist of a million files in a temporary home
+ * directory, loads it and measures playlist_set() and removal of ranges in
+ * the shuffled order. Build with 'make bench' and run bench/playlist_bench.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <core/gp_debug.h>
+#include <widgets/gp_app_info.h>
+
+#include "playlist.h"
+
+#define BENCH_DIRS 1024
+#define BENCH_DIR_FILES 1024
+#define BENCH_SETS (1024 * 1024)
+#define BENCH_REMS 16
+#define BENCH_REM_LEN 1024
+
+#define BENCH_PLAYLIST "playlist_bench.txt"
+
+gp_app_info app_info = {
+	.name = "gpplayer_bench",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int write_playlist(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	size_t i;
+
+	if (!f) {
+		GP_WARN("Failed to open '%s'", path);
+		return 1;
+	}
+
+	for (i = 0; i < BENCH_DIRS * BENCH_DIR_FILES; i++) {
+		fprintf(f, "/bench/dir%04zu/track%04zu.mp3\n",
+		        i / BENCH_DIR_FILES, i % BENCH_DIR_FILES);
+	}
+
+	if (fclose(f)) {
+		GP_WARN("Failed to write '%s'", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void bench(void)
+{
+	size_t i, cnt = BENCH_DIRS * BENCH_DIR_FILES;
+	uint64_t start;
+
+	start = now_ns();
+	playlist_load(BENCH_PLAYLIST);
+	GP_DEBUG(1, "Playlist %zu files loaded in %.1f ms",
+	         cnt, (double)(now_ns() - start) / 1000000);
+
+	playlist_shuffle_set(true);
+
+	start = now_ns();
+
+	for (i = 0; i < BENCH_SETS; i++)
+		playlist_set(random() % cnt);
+
+	GP_DEBUG(1, "Playlist %zu files playlist_set() %.1f ns",
+	         cnt, (double)(now_ns() - start) / BENCH_SETS);
+
+	start = now_ns();
+
+	for (i = 0; i < BENCH_REMS; i++)
+		playlist_rem(random() % (cnt - (i + 1) * BENCH_REM_LEN), BENCH_REM_LEN);
+
+	GP_DEBUG(1, "Playlist %zu files playlist_rem() of %u files %.2f ms",
+	         cnt, BENCH_REM_LEN, (double)(now_ns() - start) / BENCH_REMS / 1000000);
+}
+
+int main(void)
+{
+	char home[] = "/tmp/gpplayer_bench.XXXXXX";
+	char *cfg_dir = NULL, *path = NULL;
+	int ret = 1;
+
+	gp_set_debug_level(1);
+
+	/* The playlist is loaded relative to $HOME/.config/ */
+	if (!mkdtemp(home)) {
+		GP_WARN("Failed to create temporary directory");
+		return 1;
+	}
+
+	if (asprintf(&cfg_dir, "%s/.config", home) < 0) {
+		cfg_dir = NULL;
+		goto out;
+	}
+
+	if (asprintf(&path, "%s/" BENCH_PLAYLIST, cfg_dir) < 0) {
+		path = NULL;
+		goto out;
+	}
+
+	if (mkdir(cfg_dir, 0700) || write_playlist(path))
+		goto out;
+
+	setenv("HOME", home, 1);
+
+	playlist_init(NULL);
+	bench();
+	playlist_exit();
+
+	ret = 0;
+out:
+	if (path)
+		unlink(path);
+	if (cfg_dir)
+		rmdir(cfg_dir);
+	rmdir(home);
+	free(path);
+	free(cfg_dir);
+	return ret;
+}
@@ -17,7 +17,7 @@
 
 static gp_htable *uids;
 
-static const struct audio_decoder_ops *ad_ops;
+static struct audio_decoder_inst *ad;
 
 struct player_tracks {
 	int playing;
@@ -25,7 +25,7 @@ struct player_tracks {
 
 static uint32_t playback_callback(gp_timer GP_UNUSED(*self))
 {
-	return audio_decoder_tick(ad_ops);
+	return audio_decoder_tick(ad);
 }
 
 static gp_timer playback_timer = {
@@ -34,6 +34,36 @@ static gp_timer playback_timer = {
 	.id = "Playback",
 };
 
+static enum gp_poll_event_ret decoder_poll_callback(gp_fd GP_UNUSED(*self))
+{
+	audio_decoder_tick(ad);
+	return 0;
+}
+
+/* Used instead of the playback timer if decoder implements poll_fd() */
+static gp_fd decoder_fd = {
+	.fd = -1,
+	.event = decoder_poll_callback,
+	.events = GP_POLLIN,
+};
+
+static void playback_timer_start(void)
+{
+	if (decoder_fd.fd >= 0)
+		return;
+
+	playback_timer.expires = 0;
+	gp_widgets_timer_ins(&playback_timer);
+}
+
+static void playback_timer_stop(void)
+{
+	if (decoder_fd.fd >= 0)
+		return;
+
+	gp_widgets_timer_rem(&playback_timer);
+}
+
 static struct player_tracks tracks;
 
 struct info_widgets {
@@ -48,7 +78,8 @@ struct info_widgets {
 	gp_widget *decoder_gain;
 } info_widgets;
 
-static void track_info(const char *artist, const char *album, const char *track)
+static void track_info(struct audio_decoder_inst GP_UNUSED(*self),
+                       const char *artist, const char *album, const char *track)
 {
 	GP_DEBUG(1, "Track name '%s' Album name '%s' Artist name '%s'",
 	            track, album, artist);
@@ -63,20 +94,34 @@ static void track_info(const char *artist, const char *album, const char *track)
 		gp_widget_label_set(info_widgets.track, track);
 }
 
-static void track_duration(long duration_ms)
+/*
+ * Lets the decoder prepare the next song so that it can continue without a gap.
+ */
+static void track_preload_next(void)
+{
+	audio_decoder_track_preload(ad, playlist_peek_next());
+}
+
+static void track_load_cur(void)
+{
+	audio_decoder_track_load(ad, playlist_cur());
+	track_preload_next();
+}
+
+static void track_duration(struct audio_decoder_inst GP_UNUSED(*self), long duration_ms)
 {
 	if (!duration_ms) {
 		if (!playlist_next()) {
 			tracks.playing = 0;
-			gp_widgets_timer_rem(&playback_timer);
-			audio_decoder_track_pause(ad_ops);
+			playback_timer_stop();
+			audio_decoder_track_pause(ad);
 			return;
 		}
 
 		//TODO: playlist should call this
 		gp_widget_redraw(info_widgets.playlist);
 
-		audio_decoder_track_load(ad_ops, playlist_cur());
+		track_load_cur();
 
 		return;
 	}
@@ -85,12 +130,12 @@ static void track_duration(long duration_ms)
 	gp_widget_pbar_max_set(info_widgets.playback, duration_ms/1000);
 }
 
-static void track_pos(long offset_ms)
+static void track_pos(struct audio_decoder_inst GP_UNUSED(*self), long offset_ms)
 {
 	gp_widget_pbar_val_set(info_widgets.playback, offset_ms/1000);
 }
 
-static void track_art(void *data, size_t size)
+static void track_art(struct audio_decoder_inst GP_UNUSED(*self), void *data, size_t size)
 {
 	gp_widget *cover_art = info_widgets.cover_art;
 	gp_io *io;
@@ -131,9 +176,8 @@ static void track_art(void *data, size_t size)
 static void start_playback_timer(void)
 {
 	tracks.playing = 1;
-	audio_decoder_track_play(ad_ops);
-	playback_timer.expires = 0;
-	gp_widgets_timer_ins(&playback_timer);
+	audio_decoder_track_play(ad);
+	playback_timer_start();
 }
 
 int button_next_event(gp_widget_event *ev)
@@ -147,7 +191,7 @@ int button_next_event(gp_widget_event *ev)
 	//TODO: playlist should call this
 	gp_widget_redraw(info_widgets.playlist);
 
-	audio_decoder_track_load(ad_ops, playlist_cur());
+	track_load_cur();
 
 	return 0;
 }
@@ -192,7 +236,7 @@ int button_prev_event(gp_widget_event *ev)
 	//TODO: playlist shoudl call this
 	gp_widget_redraw(info_widgets.playlist);
 
-	audio_decoder_track_load(ad_ops, playlist_cur());
+	track_load_cur();
 
 	return 1;
 }
@@ -206,7 +250,7 @@ int button_play_event(gp_widget_event *ev)
 		return 1;
 
 	start_playback_timer();
-	audio_decoder_track_play(ad_ops);
+	audio_decoder_track_play(ad);
 
 	return 1;
 }
@@ -220,8 +264,8 @@ int button_pause_event(gp_widget_event *ev)
 		return 1;
 
 	tracks.playing = 0;
-	gp_widgets_timer_rem(&playback_timer);
-	audio_decoder_track_pause(ad_ops);
+	playback_timer_stop();
+	audio_decoder_track_pause(ad);
 
 	return 1;
 }
@@ -237,7 +281,7 @@ int playlist_event(gp_widget_event *ev)
 	if (!playlist_set(gp_widget_table_sel_get(ev->self)))
 		return 0;
 
-	audio_decoder_track_load(ad_ops, playlist_cur());
+	track_load_cur();
 	//TODO: playlist shoudl call this
 	gp_widget_redraw(info_widgets.playlist);
 	if (!tracks.playing)
@@ -255,6 +299,7 @@ int button_playlist_rem(gp_widget_event *ev)
 		return 0;
 
 	playlist_rem(gp_widget_table_sel_get(info_widgets.playlist), 1);
+	track_preload_next();
 	gp_widget_table_refresh(info_widgets.playlist);
 	return 0;
 }
@@ -283,6 +328,7 @@ int button_playlist_add(gp_widget_event *ev)
 
 	if (gp_dialog_run(dialog) == GP_WIDGET_DIALOG_PATH) {
 		playlist_add(gp_dialog_file_path(dialog));
+		track_preload_next();
 		gpplayer_conf_last_dialog_path_set(gp_dialog_file_path(dialog));
 	}
 
@@ -304,6 +350,8 @@ int button_playlist_move_up(gp_widget_event *ev)
 	if (playlist_move_up(sel))
 		gp_widget_table_sel_set(info_widgets.playlist, sel-1);
 
+	track_preload_next();
+
 	gp_widget_table_refresh(info_widgets.playlist);
 	return 0;
 }
@@ -324,6 +372,8 @@ int button_playlist_move_down(gp_widget_event *ev)
 	if (playlist_move_down(sel))
 		gp_widget_table_sel_set(info_widgets.playlist, sel+1);
 
+	track_preload_next();
+
 	gp_widget_table_refresh(info_widgets.playlist);
 	return 0;
 }
@@ -336,6 +386,7 @@ int playlist_repeat(gp_widget_event *ev)
 	break;
 	case GP_WIDGET_EVENT_WIDGET:
 		gpplayer_conf_playlist_repeat_set(gp_widget_bool_get(ev->self));
+		track_preload_next();
 	break;
 	}
 
@@ -351,6 +402,7 @@ int playlist_shuffle(gp_widget_event *ev)
 	case GP_WIDGET_EVENT_WIDGET:
 		gpplayer_conf_playlist_shuffle_set(gp_widget_bool_get(ev->self));
 		playlist_shuffle_set(gp_widget_bool_get(ev->self));
+		track_preload_next();
 	break;
 	}
 
@@ -366,7 +418,7 @@ int seek_on_event(gp_widget_event *ev)
 
 	GP_DEBUG(1, "Seeking to %"PRIu64" min %"PRIu64" sec", val/60, val%60);
 
-	audio_decoder_track_seek(ad_ops, 1000 * val);
+	audio_decoder_track_seek(ad, 1000 * val);
 
 	return 0;
 }
@@ -462,7 +514,7 @@ int set_softvol(gp_widget_event *ev)
 	int64_t max = gp_widget_int_max_get(ev->self);
 	int64_t val = gp_widget_int_val_get(ev->self);
 
-	audio_decoder_softvol_set(ad_ops, val);
+	audio_decoder_softvol_set(ad, val);
 	gpplayer_conf_softvol_set(val);
 
 	if (!info_widgets.softvol_icon)
@@ -482,11 +534,43 @@ int set_softvol(gp_widget_event *ev)
 	return 0;
 }
 
+static unsigned int output_latency_get(struct audio_decoder_inst GP_UNUSED(*self), const char *device)
+{
+	return gpplayer_conf_output_latency_get(device);
+}
+
+static void output_latency_set(struct audio_decoder_inst GP_UNUSED(*self),
+                               const char *device, unsigned int latency_us)
+{
+	gpplayer_conf_output_latency_set(device, latency_us);
+}
+
+static int synth_get(struct audio_decoder_inst GP_UNUSED(*self), const char *cpu,
+                     char *synth, size_t size)
+{
+	return gpplayer_conf_synth_get(cpu, synth, size);
+}
+
+static void synth_set(struct audio_decoder_inst GP_UNUSED(*self), const char *cpu, const char *synth)
+{
+	gpplayer_conf_synth_set(cpu, synth);
+}
+
+static char *cache_path(struct audio_decoder_inst GP_UNUSED(*self), const char *fname)
+{
+	return gpplayer_conf_cache_path(fname);
+}
+
 static struct audio_decoder_callbacks ad_callbacks = {
 	.track_info = track_info,
 		.track_art = track_art,
 	.track_duration = track_duration,
 	.track_pos = track_pos,
+	.output_latency_get = output_latency_get,
+	.output_latency_set = output_latency_set,
+	.synth_get = synth_get,
+	.synth_set = synth_set,
+	.cache_path = cache_path,
 };
 
 gp_app_info app_info = {
@@ -503,10 +587,18 @@ gp_app_info app_info = {
 
 static void init_decoder(void)
 {
-	ad_ops = audio_decoder_init(gpplayer_conf->decoder, &ad_callbacks);
+	ad = audio_decoder_create(gpplayer_conf->decoder, &ad_callbacks, NULL);
+
+	decoder_fd.fd = audio_decoder_poll_fd(ad);
+	if (decoder_fd.fd >= 0)
+		gp_widget_poll_add(&decoder_fd);
 
 	/* Restore softvolume from config */
-	audio_decoder_softvol_set(ad_ops, gpplayer_conf->softvol);
+	audio_decoder_softvol_set(ad, gpplayer_conf->softvol);
+
+	audio_decoder_resample(ad, gpplayer_conf->resample);
+
+	audio_decoder_mem_limit(ad, (size_t)gpplayer_conf->mem_limit_mb * 1024 * 1024);
 }
 
 int main(int argc, char *argv[])
@@ -563,8 +655,8 @@ int main(int argc, char *argv[])
 
 	if (playlist_cur()) {
 		tracks.playing = 1;
-		audio_decoder_track_load(ad_ops, playlist_cur());
-		gp_widgets_timer_ins(&playback_timer);
+		track_load_cur();
+		playback_timer_start();
 	}
 
 	gp_widgets_main_loop(layout, NULL, 0, NULL);
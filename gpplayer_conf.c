@@ -5,8 +5,16 @@
 
  */
 
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include <core/gp_debug.h>
 #include <utils/gp_json_serdes.h>
 #include <utils/gp_app_cfg.h>
 #include <utils/gp_path.h>
@@ -17,6 +25,7 @@
 
 static struct gpplayer_conf conf = {
 	.softvol = 100,
+	.mem_limit_mb = 128,
 };
 
 const struct gpplayer_conf *gpplayer_conf = &conf;
@@ -27,6 +36,8 @@ static gp_json_struct conf_desc[] = {
 	GP_JSON_SERDES_BOOL(struct gpplayer_conf, playlist_repeat, 0),
 	GP_JSON_SERDES_BOOL(struct gpplayer_conf, playlist_shuffle, 0),
 	GP_JSON_SERDES_UINT8(struct gpplayer_conf, softvol, 0, 0, AUDIO_DECODER_SOFTVOL_MAX),
+	GP_JSON_SERDES_UINT8(struct gpplayer_conf, resample, 0, 0, AUDIO_DECODER_RESAMPLE_MAX),
+	GP_JSON_SERDES_UINT32(struct gpplayer_conf, mem_limit_mb, 0, 0, 4096),
 	{}
 };
 
@@ -114,3 +125,164 @@ void gpplayer_conf_playlist_shuffle_set(bool val)
 	conf.playlist_shuffle = val;
 	conf.dirty = 1;
 }
+
+struct output_conf {
+	uint32_t latency_us;
+};
+
+static gp_json_struct output_conf_desc[] = {
+	GP_JSON_SERDES_UINT32(struct output_conf, latency_us, 0, 0, UINT32_MAX),
+	{}
+};
+
+static char *named_conf_path(const char *prefix, const char *name)
+{
+	char fname[128];
+	size_t i;
+
+	snprintf(fname, sizeof(fname), "%s-%s.json", prefix, name);
+
+	/* Device names such as hw:0,0 and CPU models are not nice file names */
+	for (i = 0; fname[i]; i++) {
+		if (!isalnum(fname[i]) && fname[i] != '.' && fname[i] != '-')
+			fname[i] = '_';
+	}
+
+	return gp_app_cfg_path(gp_app_info_name(), fname);
+}
+
+static char *output_conf_path(const char *device)
+{
+	return named_conf_path("output", device);
+}
+
+unsigned int gpplayer_conf_output_latency_get(const char *device)
+{
+	struct output_conf out = {};
+	char *conf_path;
+
+	conf_path = output_conf_path(device);
+	if (!conf_path)
+		return 0;
+
+	if (!access(conf_path, F_OK))
+		gp_json_load_struct(conf_path, output_conf_desc, &out);
+
+	free(conf_path);
+
+	return out.latency_us;
+}
+
+void gpplayer_conf_output_latency_set(const char *device, unsigned int latency_us)
+{
+	struct output_conf out = {.latency_us = latency_us};
+	char *conf_path;
+
+	if (gp_app_cfg_mkpath(gp_app_info_name()))
+		return;
+
+	conf_path = output_conf_path(device);
+	if (!conf_path)
+		return;
+
+	gp_json_save_struct(conf_path, output_conf_desc, &out);
+
+	free(conf_path);
+}
+
+#define SYNTH_MAX 32
+
+struct cpu_conf {
+	char synth[SYNTH_MAX];
+};
+
+static gp_json_struct cpu_conf_desc[] = {
+	GP_JSON_SERDES_STR_CPY(struct cpu_conf, synth, 0, SYNTH_MAX),
+	{}
+};
+
+int gpplayer_conf_synth_get(const char *cpu, char *synth, size_t size)
+{
+	struct cpu_conf cpu_conf = {};
+	char *conf_path;
+
+	conf_path = named_conf_path("cpu", cpu);
+	if (!conf_path)
+		return 1;
+
+	if (!access(conf_path, F_OK))
+		gp_json_load_struct(conf_path, cpu_conf_desc, &cpu_conf);
+
+	free(conf_path);
+
+	if (!cpu_conf.synth[0])
+		return 1;
+
+	snprintf(synth, size, "%s", cpu_conf.synth);
+
+	return 0;
+}
+
+void gpplayer_conf_synth_set(const char *cpu, const char *synth)
+{
+	struct cpu_conf cpu_conf = {};
+	char *conf_path;
+
+	if (gp_app_cfg_mkpath(gp_app_info_name()))
+		return;
+
+	conf_path = named_conf_path("cpu", cpu);
+	if (!conf_path)
+		return;
+
+	snprintf(cpu_conf.synth, sizeof(cpu_conf.synth), "%s", synth);
+
+	gp_json_save_struct(conf_path, cpu_conf_desc, &cpu_conf);
+
+	free(conf_path);
+}
+
+static int mkdir_exists(const char *path)
+{
+	if (!mkdir(path, 0700) || errno == EEXIST)
+		return 0;
+
+	GP_WARN("Failed to create '%s': %s", path, strerror(errno));
+	return 1;
+}
+
+char *gpplayer_conf_cache_path(const char *fname)
+{
+	const char *xdg_cache = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char *base, *dir = NULL, *path = NULL;
+	int ret;
+
+	if (xdg_cache && xdg_cache[0])
+		ret = asprintf(&base, "%s", xdg_cache);
+	else if (home)
+		ret = asprintf(&base, "%s/.cache", home);
+	else
+		return NULL;
+
+	if (ret < 0)
+		return NULL;
+
+	if (mkdir_exists(base))
+		goto err;
+
+	if (asprintf(&dir, "%s/%s", base, gp_app_info_name()) < 0) {
+		dir = NULL;
+		goto err;
+	}
+
+	if (mkdir_exists(dir))
+		goto err;
+
+	if (asprintf(&path, "%s/%s", dir, fname) < 0)
+		path = NULL;
+err:
+	free(dir);
+	free(base);
+	return path;
+}
@@ -19,6 +19,10 @@ struct gpplayer_conf {
 	char decoder[32];
 	/** @brief Saved softvolume. */
 	uint8_t softvol;
+	/** @brief Resampler quality, enum audio_decoder_resample, set in the config file. */
+	uint8_t resample;
+	/** @brief Memory limit for tracks read into RAM in MiB. */
+	uint32_t mem_limit_mb;
 	/** @brief Last dialog file open path. */
 	char *last_dialog_path;
 
@@ -80,4 +84,58 @@ void gpplayer_conf_playlist_repeat_set(bool val);
  */
 void gpplayer_conf_playlist_shuffle_set(bool val);
 
+/**
+ * @brief Returns a stored output buffer latency for an audio device.
+ *
+ * Output settings are stored in a separate file for each device.
+ *
+ * @param device An audio device name.
+ * @return A latency in microseconds or zero if not stored.
+ */
+unsigned int gpplayer_conf_output_latency_get(const char *device);
+
+/**
+ * @brief Stores an output buffer latency for an audio device.
+ *
+ * The value is written to the disk immediately.
+ *
+ * @param device An audio device name.
+ * @param latency_us A latency in microseconds.
+ */
+void gpplayer_conf_output_latency_set(const char *device, unsigned int latency_us);
+
+/**
+ * @brief Returns a stored mpg123 synth decoder for a CPU model.
+ *
+ * CPU settings are stored in a separate file for each CPU model.
+ *
+ * @param cpu A CPU model name.
+ * @param synth A buffer for the synth decoder name.
+ * @param size A buffer size.
+ * @return Zero if a synth decoder was stored.
+ */
+int gpplayer_conf_synth_get(const char *cpu, char *synth, size_t size);
+
+/**
+ * @brief Stores a mpg123 synth decoder for a CPU model.
+ *
+ * The value is written to the disk immediately.
+ *
+ * @param cpu A CPU model name.
+ * @param synth A synth decoder name.
+ */
+void gpplayer_conf_synth_set(const char *cpu, const char *synth);
+
+/**
+ * @brief Returns a path to a file in the application cache directory.
+ *
+ * The directory is $XDG_CACHE_HOME/gpplayer/ or ~/.cache/gpplayer/ and is
+ * created if it does not exist. Does not touch the configuration, hence can
+ * be called from any thread.
+ *
+ * @param fname A file name.
+ * @return An allocated path or NULL on a failure.
+ */
+char *gpplayer_conf_cache_path(const char *fname);
+
 #endif /* GPPLAYER_CONF_H */
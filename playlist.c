@@ -9,40 +9,181 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 
+#include <core/gp_debug.h>
 #include <utils/gp_vec.h>
 #include <widgets/gp_widgets.h>
 
 #include "playlist.h"
 #include "gpplayer_conf.h"
 
+/*
+ * Paths are not stored one allocation per file. Directories and basenames
+ * are stored in a single string arena, each directory only once, and files
+ * refer to them by 32-bit offsets.
+ */
 struct playlist_file {
-	/** Randomized index for a shuffle. */
-	size_t shuffle_idx;
-	/** Path to the music file. */
-	char *file;
+	/** Position of the file in the shuffle order. */
+	uint32_t shuffle_pos;
+	/** Index to the directory table. */
+	uint32_t dir;
+	/** Basename offset in the string arena. */
+	uint32_t name;
 };
 
 struct playlist {
+	/* Position in the shuffle order if shuffled, file index otherwise */
 	size_t cur;
+	/*
+	 * Follows the shuffle setting, but is journaled and stored in the
+	 * snapshot so that cur is interpreted as it was stored.
+	 */
+	bool shuffled;
 	struct playlist_file *files;
+
+	/*
+	 * Shuffle order, maps a position to a file index, this is a permutation
+	 * and shuffle_pos in the files is the inverse.
+	 */
+	uint32_t *shuffle;
+	/* Seed of the current shuffle and xoshiro128** generator state */
+	uint64_t seed;
+	uint32_t rng[4];
+
+	/* String arena, the vector length is the capacity */
+	char *strs;
+	size_t strs_used;
+	/* Bytes of removed basenames left in the arena */
+	size_t strs_dead;
+
+	/* Directory offsets in the string arena */
+	uint32_t *dirs;
+	/* Open addressing hash of directory indexes plus one, zero is free */
+	uint32_t *dirs_hash;
+	size_t dirs_hash_size;
+	/* Last interned directory, files are usually added directory by directory */
+	uint32_t dirs_last;
 };
 
 struct playlist playlist;
 
 const char *save_path;
 
+enum journal_op {
+	JOURNAL_ADD = 1,
+	JOURNAL_REM,
+	JOURNAL_SWAP,
+	JOURNAL_CLEAR,
+	JOURNAL_CUR,
+	JOURNAL_SHUFFLE,
+};
+
+static void journal_rec(enum journal_op op, const uint32_t *args, size_t args_cnt,
+                        const char *str, size_t str_len);
+static void journal_add(size_t idx, size_t pos);
+static void journal_flush(void);
+static void journal_init(const char *path);
+static void journal_exit(void);
+static void shuffle_mode(bool shuffle);
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+	return z ^ (z >> 31);
+}
+
+static void rng_seed(uint64_t seed)
+{
+	uint64_t x = seed, r;
+
+	playlist.seed = seed;
+
+	r = splitmix64(&x);
+	playlist.rng[0] = r;
+	playlist.rng[1] = r >> 32;
+
+	r = splitmix64(&x);
+	playlist.rng[2] = r;
+	playlist.rng[3] = r >> 32;
+}
+
+static inline uint32_t rotl(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+/*
+ * The xoshiro128** generator by Blackman and Vigna.
+ */
+static uint32_t rng_next(void)
+{
+	uint32_t *s = playlist.rng;
+	uint32_t ret = rotl(s[1] * 5, 7) * 9;
+	uint32_t t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 11);
+
+	return ret;
+}
+
+/*
+ * Returns an unbiased random number in [0, range), Lemire's multiply and
+ * reject method, the division is done only in the rare biased case.
+ */
+static uint32_t rng_range(uint32_t range)
+{
+	uint64_t m = (uint64_t)rng_next() * range;
+
+	if ((uint32_t)m < range) {
+		uint32_t t = -range % range;
+
+		while ((uint32_t)m < t)
+			m = (uint64_t)rng_next() * range;
+	}
+
+	return m >> 32;
+}
+
 void playlist_init(const char *path)
 {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rng_seed(((uint64_t)getpid() << 32) ^ ts.tv_sec * 1000000000ull ^ ts.tv_nsec);
+
 	playlist.cur = 0;
+	playlist.shuffled = gpplayer_conf->playlist_shuffle;
 	playlist.files = gp_vec_new(0, sizeof(struct playlist_file));
+	playlist.shuffle = gp_vec_new(0, sizeof(uint32_t));
+	playlist.strs = gp_vec_new(0, 1);
+	playlist.dirs = gp_vec_new(0, sizeof(uint32_t));
 
 	if (path) {
 		save_path = strdup(path);
-		playlist_load(path);
+		journal_init(path);
+	}
+
+	/* The setting may have been changed while the player was not running */
+	if (playlist.shuffled != gpplayer_conf->playlist_shuffle) {
+		shuffle_mode(gpplayer_conf->playlist_shuffle);
+		journal_flush();
 	}
 }
 
@@ -114,308 +255,1859 @@ void playlist_exit(void)
 	if (!save_path)
 		return;
 
-	playlist_save(save_path);
+	journal_exit();
 }
 
-static void add_path(const char *path, const char *fname)
+/*
+ * Makes sure that there is space for len more bytes in the arena.
+ */
+static int strs_reserve(size_t len)
 {
+	size_t cap = gp_vec_len(playlist.strs);
 	void *new;
-	size_t len = gp_vec_len(playlist.files);
-	const char *cwd = getenv("PWD");
 
-	new = gp_vec_expand(playlist.files, 1);
-	if (!new)
-		return;
-
-	playlist.files = new;
+	if (playlist.strs_used + len <= cap)
+		return 0;
 
-	if (path) {
-		if (path[0] == '/') {
-			if (asprintf(&playlist.files[len].file, "%s/%s", path, fname) < 0)
-				playlist.files[len].file = NULL;
-		} else {
-			if (asprintf(&playlist.files[len].file, "%s/%s/%s", cwd, path, fname) < 0)
-				playlist.files[len].file = NULL;
-		}
-	} else {
-		if (fname[0] == '/') {
-			playlist.files[len].file = strdup(fname);
-		} else {
-			if (asprintf(&playlist.files[len].file, "%s/%s", cwd, fname) < 0)
-				playlist.files[len].file = NULL;
-		}
+	if (playlist.strs_used + len > UINT32_MAX) {
+		GP_WARN("Playlist string arena full");
+		return 1;
 	}
 
-	if (!playlist.files[len].file) {
-		playlist.files = gp_vec_shrink(playlist.files, 1);
-		return;
-	}
+	len = GP_MAX(len, cap / 2);
+	len = GP_MIN(len, (size_t)UINT32_MAX - cap);
 
-	size_t new_idx = gp_vec_len(playlist.files) - 1;
-	size_t rnd_idx = new_idx ? random() % new_idx : 0;
+	new = gp_vec_expand(playlist.strs, len);
+	if (!new)
+		return 1;
 
-	playlist.files[new_idx].shuffle_idx = playlist.files[rnd_idx].shuffle_idx;
-	playlist.files[rnd_idx].shuffle_idx = new_idx;
+	playlist.strs = new;
+
+	return 0;
 }
 
-void playlist_load(const char *path)
+/*
+ * Returns the unused space reserved for a batch.
+ */
+static void strs_trim(void)
 {
-	int fd = open_cfg_file(path);
-	char buf[4096];
+	size_t unused = gp_vec_len(playlist.strs) - playlist.strs_used;
 
-	if (fd < 0)
-		return;
-
-	FILE *f = fdopen(fd, "r");
+	if (unused)
+		playlist.strs = gp_vec_shrink(playlist.strs, unused);
+}
 
-	if (!f)
-		return;
+static uint32_t strs_add(const char *str, size_t len)
+{
+	uint32_t off = playlist.strs_used;
 
-	while (fgets(buf, sizeof(buf), f)) {
-		size_t len = strlen(buf);
-		if (buf[len-1] == '\n')
-			buf[len-1] = 0;
-		if (!buf[0])
-			continue;
-		add_path(NULL, buf);
-	}
+	memcpy(playlist.strs + off, str, len);
+	playlist.strs[off + len] = 0;
+	playlist.strs_used += len + 1;
 
-	fclose(f);
+	return off;
 }
 
-void playlist_save(const char *path)
+#define FNV1A_INIT 2166136261u
+
+static uint32_t fnv1a(uint32_t hash, const void *buf, size_t len)
 {
-	int fd;
+	const unsigned char *b = buf;
 	size_t i;
 
-	fd = creat_cfg_file(path, 0755, 0644);
-	if (fd < 0)
-		return;
-
-	for (i = 0; i < gp_vec_len(playlist.files); i++) {
-		write(fd, playlist.files[i].file, strlen(playlist.files[i].file));
-		write(fd, "\n", 1);
-	}
+	for (i = 0; i < len; i++)
+		hash = (hash ^ b[i]) * 16777619u;
 
-	close(fd);
+	return hash;
 }
 
-int playlist_next(void)
+static uint32_t dir_hash(const char *dir, size_t len)
 {
-	if (playlist.cur + 1 >= gp_vec_len(playlist.files)) {
-		if (gpplayer_conf->playlist_repeat) {
-			playlist.cur = 0;
-			return 1;
-		}
-	} else {
-		playlist.cur++;
-		return 1;
-	}
-
-	return 0;
+	return fnv1a(FNV1A_INIT, dir, len);
 }
 
-int playlist_prev(void)
+static void dirs_hash_put(uint32_t id)
 {
-	if (playlist.cur == 0) {
-		if (gpplayer_conf->playlist_repeat) {
-			playlist.cur = gp_vec_len(playlist.files) - 1;
-			return 1;
-		}
-	} else {
-		playlist.cur--;
-		return 1;
-	}
+	const char *dir = playlist.strs + playlist.dirs[id];
+	size_t mask = playlist.dirs_hash_size - 1;
+	size_t i = dir_hash(dir, strlen(dir)) & mask;
 
-	return 0;
+	while (playlist.dirs_hash[i])
+		i = (i + 1) & mask;
+
+	playlist.dirs_hash[i] = id + 1;
 }
 
-int playlist_move_up(size_t pos)
+/*
+ * Grows the hash so that it's at most half full with one more directory.
+ */
+static int dirs_hash_grow(void)
 {
-	if (pos <= 0)
-		return 0;
+	size_t size = GP_MAX((size_t)64, 2 * playlist.dirs_hash_size);
+	size_t cnt = gp_vec_len(playlist.dirs);
+	uint32_t *hash, i;
 
-	if (pos >= gp_vec_len(playlist.files))
-		return 0;
+	while (size < 2 * (cnt + 1))
+		size *= 2;
 
-	GP_SWAP(playlist.files[pos-1].file, playlist.files[pos].file);
+	hash = calloc(size, sizeof(*hash));
+	if (!hash)
+		return 1;
 
-	return 1;
+	free(playlist.dirs_hash);
+	playlist.dirs_hash = hash;
+	playlist.dirs_hash_size = size;
+
+	for (i = 0; i < gp_vec_len(playlist.dirs); i++)
+		dirs_hash_put(i);
+
+	return 0;
 }
 
-int playlist_move_down(size_t pos)
+/*
+ * Returns an index of the directory, the directory is added if not present.
+ */
+static int dir_is(uint32_t id, const char *dir, size_t len)
 {
-	if (pos + 1 >= gp_vec_len(playlist.files))
-		return 0;
+	const char *str = playlist.strs + playlist.dirs[id];
 
-	GP_SWAP(playlist.files[pos+1].file, playlist.files[pos].file);
-
-	return 1;
+	return !strncmp(str, dir, len) && !str[len];
 }
 
-int playlist_set(size_t pos)
+static int dir_intern(const char *dir, size_t len, uint32_t *id)
 {
-	size_t i;
+	size_t mask = playlist.dirs_hash_size - 1;
+	size_t i, cnt = gp_vec_len(playlist.dirs);
+	void *new;
 
-	if (pos >= gp_vec_len(playlist.files))
+	if (playlist.dirs_last < cnt && dir_is(playlist.dirs_last, dir, len)) {
+		*id = playlist.dirs_last;
 		return 0;
+	}
 
-	if (gpplayer_conf->playlist_shuffle) {
-		for (i = 0; i < gp_vec_len(playlist.files); i++) {
-			if (playlist.files[i].shuffle_idx == pos) {
-				pos = i;
-				break;
+	if (playlist.dirs_hash_size) {
+		for (i = dir_hash(dir, len) & mask; playlist.dirs_hash[i]; i = (i + 1) & mask) {
+			if (dir_is(playlist.dirs_hash[i] - 1, dir, len)) {
+				*id = playlist.dirs_last = playlist.dirs_hash[i] - 1;
+				return 0;
 			}
 		}
 	}
 
-	playlist.cur = pos;
-	return 1;
-}
+	if (2 * (cnt + 1) > playlist.dirs_hash_size && dirs_hash_grow())
+		return 1;
 
-static size_t playlist_cur_idx(void)
-{
-	size_t cur_idx = playlist.cur;
+	if (strs_reserve(len + 1))
+		return 1;
 
-	if (gpplayer_conf->playlist_shuffle)
-		cur_idx = playlist.files[cur_idx].shuffle_idx;
+	new = gp_vec_expand(playlist.dirs, 1);
+	if (!new)
+		return 1;
 
-	return cur_idx;
-}
+	playlist.dirs = new;
+	playlist.dirs[cnt] = strs_add(dir, len);
+	dirs_hash_put(cnt);
 
-const char *playlist_cur(void)
-{
-	if (!gp_vec_len(playlist.files))
-		return NULL;
+	*id = playlist.dirs_last = cnt;
 
-	return playlist.files[playlist_cur_idx()].file;
+	return 0;
 }
 
-static int cmp(const void *a, const void *b)
+/*
+ * Interns an absolute directory for a path that may be relative to the
+ * current working directory. Trailing slashes are removed.
+ */
+static int dir_intern_path(const char *path, size_t len, uint32_t *id)
 {
-	const struct playlist_file *fa = a;
-	const struct playlist_file *fb = b;
+	const char *cwd = getenv("PWD");
+	char buf[PATH_MAX];
+	int ret;
+
+	while (len && path[len-1] == '/')
+		len--;
+
+	if (path[0] == '/')
+		return dir_intern(path, len, id);
+
+	ret = snprintf(buf, sizeof(buf), "%s%s%.*s", cwd ? cwd : "",
+	               len ? "/" : "", (int)len, path);
+	if (ret < 0 || (size_t)ret >= sizeof(buf))
+		return 1;
 
-	return strcmp(fa->file, fb->file);
+	return dir_intern(buf, ret, id);
 }
 
-void playlist_add(const char *path)
+/*
+ * Grows the file table for a batch of files at once.
+ *
+ * Returns an index of the first new file or SIZE_MAX on a failure.
+ */
+static size_t files_expand(size_t cnt)
 {
-	struct stat path_stat;
-	DIR *dir;
-	struct dirent *ent;
+	size_t first = gp_vec_len(playlist.files);
+	void *new;
 
-	stat(path, &path_stat);
+	if (first + cnt > UINT32_MAX) {
+		GP_WARN("Too many files in playlist");
+		return SIZE_MAX;
+	}
 
-	if (S_ISREG(path_stat.st_mode)) {
-		add_path(NULL, path);
-		return;
+	new = gp_vec_expand(playlist.shuffle, cnt);
+	if (!new)
+		return SIZE_MAX;
+
+	playlist.shuffle = new;
+
+	new = gp_vec_expand(playlist.files, cnt);
+	if (!new) {
+		playlist.shuffle = gp_vec_shrink(playlist.shuffle, cnt);
+		return SIZE_MAX;
 	}
 
-	dir = opendir(path);
-	if (!dir)
+	playlist.files = new;
+
+	return first;
+}
+
+/*
+ * Drops unused files from the end of a batch.
+ */
+static void files_shrink(size_t cnt)
+{
+	if (!cnt)
 		return;
 
-	size_t first = gp_vec_len(playlist.files);
+	playlist.files = gp_vec_shrink(playlist.files, cnt);
+	playlist.shuffle = gp_vec_shrink(playlist.shuffle, cnt);
+}
 
-	while ((ent = readdir(dir))) {
-		if (!(ent->d_type & DT_REG))
-			continue;
+/*
+ * Inserts files [first, last) into the shuffle order, this is a step of the
+ * inside-out Fisher-Yates shuffle for each of them.
+ *
+ * When shuffle is on new files are placed after the current position, so
+ * that the current song stays in place and new songs are played before the
+ * playlist wraps around.
+ */
+static void shuffle_insert(size_t i, size_t j)
+{
+	uint32_t moved = j < i ? playlist.shuffle[j] : i;
 
-		size_t name_len = strlen(ent->d_name);
+	playlist.shuffle[i] = moved;
+	playlist.files[moved].shuffle_pos = i;
 
-		if (name_len < 4)
-			continue;
+	playlist.shuffle[j] = i;
+	playlist.files[i].shuffle_pos = j;
+}
 
-		//if (strcmp(ent->d_name + name_len - 4, ".mp3"))
-		//	continue;
+static void shuffle_extend(size_t first, size_t last)
+{
+	size_t i, lo = 0;
 
-		add_path(path, ent->d_name);
-	}
+	if (playlist.shuffled && first)
+		lo = playlist.cur + 1;
 
-	size_t last = gp_vec_len(playlist.files);
+	for (i = first; i < last; i++) {
+		size_t j = lo + rng_range(i + 1 - lo);
 
-	qsort(&playlist.files[first], last-first, sizeof(struct playlist_file), cmp);
+		shuffle_insert(i, j);
+		journal_add(i, j);
+	}
+}
 
-	closedir(dir);
+/*
+ * Fills in a file expanded by files_expand(), the arena must have enough
+ * space reserved for the name.
+ */
+static void file_set(size_t new_idx, uint32_t dir, const char *name, size_t name_len)
+{
+	playlist.files[new_idx].dir = dir;
+	playlist.files[new_idx].name = strs_add(name, name_len);
 }
 
-static size_t shuffle_idx_max(void)
+static const char *file_dir(size_t idx)
 {
-	size_t i, max = 0, ret = 0;
+	return playlist.strs + playlist.dirs[playlist.files[idx].dir];
+}
 
-	for (i = 0; i < gp_vec_len(playlist.files); i++) {
-		if (playlist.files[i].shuffle_idx > max) {
-			max = playlist.files[i].shuffle_idx;
-			ret = i;
-		}
-	}
+static const char *file_name(size_t idx)
+{
+	return playlist.strs + playlist.files[idx].name;
+}
 
-	return ret;
+static const char *file_path(size_t idx, char *buf, size_t buf_size)
+{
+	snprintf(buf, buf_size, "%s/%s", file_dir(idx), file_name(idx));
+
+	return buf;
 }
 
-void playlist_rem(size_t off, size_t len)
+/* A glibc malloc chunk for an allocation */
+#define HEAP_CHUNK(size) GP_MAX((size_t)32, ((size) + 8 + 15) & ~(size_t)15)
+
+/*
+ * Compares the memory used per file with a path allocated for each file,
+ * which is how the playlist was stored previously.
+ */
+static void playlist_stats(void)
 {
-	size_t i;
+	size_t i, cnt = gp_vec_len(playlist.files), bytes, heap = 0;
 
-	if (off >= gp_vec_len(playlist.files))
+	if (gp_get_debug_level() < 1 || !cnt)
 		return;
 
-	len = GP_MIN(gp_vec_len(playlist.files) - off, len);
-
-	for (i = 0; i < len; i++) {
-		size_t rem_idx = i+off;
-		size_t max_idx = shuffle_idx_max();
+	bytes = cnt * (sizeof(struct playlist_file) + sizeof(uint32_t)) +
+	        gp_vec_len(playlist.strs) +
+	        gp_vec_len(playlist.dirs) * sizeof(uint32_t) +
+	        playlist.dirs_hash_size * sizeof(uint32_t);
 
-		playlist.files[max_idx].shuffle_idx = playlist.files[rem_idx].shuffle_idx;
+	for (i = 0; i < cnt; i++) {
+		size_t len = strlen(file_dir(i)) + strlen(file_name(i)) + 2;
 
-		free(playlist.files[rem_idx].file);
+		heap += 2 * sizeof(size_t) + HEAP_CHUNK(len);
 	}
 
-	playlist.files = gp_vec_del(playlist.files, off, len);
+	GP_DEBUG(1, "Playlist %zu files in %zu dirs, %.1f bytes per file, was %.1f",
+	         cnt, gp_vec_len(playlist.dirs), (double)bytes / cnt, (double)heap / cnt);
 }
 
-void playlist_clear(void)
+/*
+ * Fills in an expanded file given by a path which may be relative to the
+ * current working directory, the path does not have to be null terminated.
+ */
+static int file_fill(size_t idx, const char *path, size_t len)
 {
-	size_t i;
+	const char *name = memrchr(path, '/', len);
+	size_t name_len;
+	uint32_t dir;
+
+	if (len >= PATH_MAX) {
+		GP_WARN("Path '%.32s...' too long", path);
+		return 1;
+	}
 
-	for (i = 0; i < gp_vec_len(playlist.files); i++)
-		free(playlist.files[i].file);
+	name = name ? name + 1 : path;
+	name_len = path + len - name;
 
-	playlist.files = gp_vec_resize(playlist.files, 0);
+	if (!name_len || dir_intern_path(path, name - path, &dir))
+		return 1;
+
+	if (strs_reserve(name_len + 1))
+		return 1;
+
+	file_set(idx, dir, name, name_len);
+
+	return 0;
 }
 
-void playlist_list(void)
+static void add_file(const char *path)
 {
-	size_t i;
+	size_t idx = files_expand(1);
 
-	printf("PLAYLIST\n--------\n\n");
+	if (idx == SIZE_MAX)
+		return;
 
-	for (i = 0; i < gp_vec_len(playlist.files); i++) {
-		printf("- (c=%3zu s=%3zu) '%s'\n", i,
-		       playlist.files[i].shuffle_idx,
-		       playlist.files[i].file);
+	if (file_fill(idx, path, strlen(path))) {
+		files_shrink(1);
+		return;
 	}
+
+	shuffle_extend(idx, idx + 1);
 }
 
-void playlist_shuffle_set(bool shuffle)
+static char *cfg_full_path(const char *path)
 {
-	gpplayer_conf_playlist_shuffle_set(shuffle);
+	char *home_path = getenv("HOME"), *full_path;
+
+	if (!home_path)
+		return NULL;
 
-	if (!shuffle && playlist.files)
-		playlist.cur = playlist.files[playlist.cur].shuffle_idx;
+	if (asprintf(&full_path, "%s/.config/%s", home_path, path) < 0)
+		return NULL;
+
+	return full_path;
 }
 
-void playlist_repeat_set(bool repeat)
+/*
+ * Files are replaced by writing a temporary file which is renamed over the
+ * original once it's on the disk, so a crash never leaves a truncated file
+ * behind.
+ */
+static int tmp_open(const char *path, char **tmp)
 {
-	gpplayer_conf_playlist_repeat_set(repeat);
+	int fd;
+
+	if (asprintf(tmp, "%s.tmp", path) < 0)
+		return -1;
+
+	fd = creat_cfg_file(*tmp, 0755, 0644);
+	if (fd < 0)
+		free(*tmp);
+
+	return fd;
 }
 
-static int playlist_seek_row(gp_widget *self, int op, unsigned int pos)
+static void tmp_abort(int fd, char *tmp)
 {
-	gp_widget_table_priv *tbl_priv = gp_widget_table_priv_get(self);
+	char *full_tmp = cfg_full_path(tmp);
 
-	switch (op) {
+	close(fd);
+
+	if (full_tmp)
+		unlink(full_tmp);
+
+	free(full_tmp);
+	free(tmp);
+}
+
+static int tmp_commit(int fd, char *tmp, const char *path)
+{
+	char *full_tmp = cfg_full_path(tmp);
+	char *full_path = cfg_full_path(path);
+	int ret = 1, dir_fd;
+
+	if (!full_tmp || !full_path || fdatasync(fd)) {
+		GP_WARN("Failed to write '%s': %s", path, strerror(errno));
+		tmp_abort(fd, tmp);
+		goto out;
+	}
+
+	close(fd);
+	free(tmp);
+
+	if (rename(full_tmp, full_path)) {
+		GP_WARN("rename('%s', '%s'): %s", full_tmp, full_path, strerror(errno));
+		unlink(full_tmp);
+		goto out;
+	}
+
+	/* Make the rename durable as well */
+	*strrchr(full_path, '/') = 0;
+
+	dir_fd = open(full_path, O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	ret = 0;
+out:
+	free(full_tmp);
+	free(full_path);
+	return ret;
+}
+
+/*
+ * Validates that the stored order is a permutation while building the
+ * inverse.
+ */
+static int shuffle_check(void)
+{
+	size_t i, cnt = gp_vec_len(playlist.files);
+
+	for (i = 0; i < cnt; i++)
+		playlist.files[i].shuffle_pos = UINT32_MAX;
+
+	for (i = 0; i < cnt; i++) {
+		uint32_t idx = playlist.shuffle[i];
+
+		if (idx >= cnt || playlist.files[idx].shuffle_pos != UINT32_MAX)
+			return 1;
+
+		playlist.files[idx].shuffle_pos = i;
+	}
+
+	return 0;
+}
+
+/*
+ * Snapshot is a binary image of the playlist stored next to the text
+ * playlist, the arrays are stored as they are in memory so that they can be
+ * loaded with a single read. Along with the files it stores the shuffle
+ * state and the current position, so a restarted player continues the same
+ * shuffle.
+ *
+ * The playlist size and modification time are stored as well and the
+ * snapshot is ignored if the text playlist was changed behind our back. The
+ * arrays are checksummed and validated on load, a corrupted snapshot is
+ * ignored and the text playlist is parsed instead. The snapshot is in native
+ * byte order, it's a cache rather than a data format.
+ */
+#define SNAPSHOT_MAGIC "gpplsnap"
+#define SNAPSHOT_VERSION 4
+
+/*
+ * Identifies the text playlist a snapshot or a journal belongs to, all zeroes
+ * if there is no text playlist yet. The playlist is replaced by a rename on
+ * each save, so the inode number changes even if the mtime does not.
+ */
+struct pl_stamp {
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+static void stamp_set(struct pl_stamp *stamp, const struct stat *pl_st)
+{
+	stamp->ino = pl_st->st_ino;
+	stamp->size = pl_st->st_size;
+	stamp->mtime_sec = pl_st->st_mtim.tv_sec;
+	stamp->mtime_nsec = pl_st->st_mtim.tv_nsec;
+}
+
+static int stamp_eq(const struct pl_stamp *stamp, const struct stat *pl_st)
+{
+	return stamp->ino == (uint64_t)pl_st->st_ino &&
+	       stamp->size == (uint64_t)pl_st->st_size &&
+	       stamp->mtime_sec == pl_st->st_mtim.tv_sec &&
+	       stamp->mtime_nsec == pl_st->st_mtim.tv_nsec;
+}
+
+struct snapshot_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t files_cnt;
+	uint32_t dirs_cnt;
+	uint32_t strs_used;
+	uint32_t strs_dead;
+	uint32_t rng[4];
+	uint32_t shuffled;
+	/* FNV-1a of the arrays */
+	uint32_t hash;
+	uint64_t seed;
+	uint64_t cur;
+	struct pl_stamp pl;
+};
+
+/*
+ * The order of the arrays after the header.
+ */
+static void snapshot_iov(struct iovec iov[4], const struct snapshot_hdr *hdr)
+{
+	iov[0].iov_base = playlist.files;
+	iov[0].iov_len = hdr->files_cnt * sizeof(struct playlist_file);
+	iov[1].iov_base = playlist.shuffle;
+	iov[1].iov_len = hdr->files_cnt * sizeof(uint32_t);
+	iov[2].iov_base = playlist.dirs;
+	iov[2].iov_len = hdr->dirs_cnt * sizeof(uint32_t);
+	iov[3].iov_base = playlist.strs;
+	iov[3].iov_len = hdr->strs_used;
+}
+
+static size_t iov_size(const struct iovec iov[4])
+{
+	return iov[0].iov_len + iov[1].iov_len + iov[2].iov_len + iov[3].iov_len;
+}
+
+static uint32_t iov_hash(const struct iovec iov[4])
+{
+	uint32_t hash = FNV1A_INIT;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		hash = fnv1a(hash, iov[i].iov_base, iov[i].iov_len);
+
+	return hash;
+}
+
+static char *snapshot_path(const char *path)
+{
+	char *ret;
+
+	if (asprintf(&ret, "%s.snap", path) < 0)
+		return NULL;
+
+	return ret;
+}
+
+static void snapshot_save(const char *path, const struct stat *pl_st)
+{
+	struct snapshot_hdr hdr = {
+		.magic = SNAPSHOT_MAGIC,
+		.version = SNAPSHOT_VERSION,
+		.files_cnt = gp_vec_len(playlist.files),
+		.dirs_cnt = gp_vec_len(playlist.dirs),
+		.strs_used = playlist.strs_used,
+		.strs_dead = playlist.strs_dead,
+		.shuffled = playlist.shuffled,
+		.seed = playlist.seed,
+		.cur = playlist.cur,
+	};
+	char *spath = snapshot_path(path), *tmp;
+	struct iovec iov[5];
+	int fd;
+
+	if (!spath)
+		return;
+
+	stamp_set(&hdr.pl, pl_st);
+	memcpy(hdr.rng, playlist.rng, sizeof(hdr.rng));
+
+	fd = tmp_open(spath, &tmp);
+	if (fd < 0)
+		goto out;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	snapshot_iov(&iov[1], &hdr);
+	hdr.hash = iov_hash(&iov[1]);
+
+	if (writev(fd, iov, 5) != (ssize_t)(sizeof(hdr) + iov_size(&iov[1]))) {
+		GP_WARN("Failed to write playlist snapshot");
+		tmp_abort(fd, tmp);
+		goto out;
+	}
+
+	tmp_commit(fd, tmp, spath);
+out:
+	free(spath);
+}
+
+static int vec_resize(void *pvec, size_t len)
+{
+	void **vec = pvec;
+	void *new = gp_vec_resize(*vec, len);
+
+	if (!new)
+		return 1;
+
+	*vec = new;
+
+	return 0;
+}
+
+/*
+ * Returns non-zero unless the offset points to a start of a string in the
+ * arena.
+ */
+static int str_check(uint32_t off)
+{
+	if (off >= playlist.strs_used)
+		return 1;
+
+	return off && playlist.strs[off - 1];
+}
+
+/*
+ * Checks that all offsets and indexes point into the arrays and that the
+ * offsets point to starts of strings, the strings are terminated since the
+ * arena ends with a null byte.
+ */
+static int snapshot_check(void)
+{
+	size_t i, files_cnt = gp_vec_len(playlist.files);
+	size_t dirs_cnt = gp_vec_len(playlist.dirs);
+
+	if (!playlist.strs_used || playlist.strs[playlist.strs_used - 1] ||
+	    playlist.strs_dead > playlist.strs_used)
+		return 1;
+
+	for (i = 0; i < dirs_cnt; i++) {
+		if (str_check(playlist.dirs[i]))
+			return 1;
+	}
+
+	for (i = 0; i < files_cnt; i++) {
+		if (playlist.files[i].dir >= dirs_cnt ||
+		    str_check(playlist.files[i].name))
+			return 1;
+	}
+
+	return shuffle_check();
+}
+
+/*
+ * Loads a snapshot into an empty playlist.
+ *
+ * Returns zero if the playlist was loaded.
+ */
+static int snapshot_load(const char *path, const struct stat *pl_st)
+{
+	char *spath = snapshot_path(path);
+	struct snapshot_hdr hdr;
+	struct iovec iov[4];
+	int fd;
+
+	if (!spath)
+		return 1;
+
+	fd = open_cfg_file(spath);
+	free(spath);
+	if (fd < 0)
+		return 1;
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto err0;
+
+	if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != SNAPSHOT_VERSION || !hdr.files_cnt)
+		goto err0;
+
+	if (!stamp_eq(&hdr.pl, pl_st)) {
+		GP_DEBUG(1, "Playlist changed, snapshot ignored");
+		goto err0;
+	}
+
+	if (hdr.cur >= hdr.files_cnt || hdr.shuffled > 1)
+		goto err0;
+
+	if (vec_resize(&playlist.files, hdr.files_cnt) ||
+	    vec_resize(&playlist.shuffle, hdr.files_cnt) ||
+	    vec_resize(&playlist.dirs, hdr.dirs_cnt) ||
+	    vec_resize(&playlist.strs, hdr.strs_used))
+		goto err1;
+
+	playlist.strs_used = hdr.strs_used;
+	playlist.strs_dead = hdr.strs_dead;
+
+	snapshot_iov(iov, &hdr);
+
+	if (readv(fd, iov, 4) != (ssize_t)iov_size(iov) ||
+	    iov_hash(iov) != hdr.hash || snapshot_check()) {
+		GP_WARN("Corrupted playlist snapshot");
+		goto err1;
+	}
+
+	close(fd);
+
+	free(playlist.dirs_hash);
+	playlist.dirs_hash = NULL;
+	playlist.dirs_hash_size = 0;
+
+	if (dirs_hash_grow()) {
+		playlist_clear();
+		return 1;
+	}
+
+	rng_seed(hdr.seed);
+	memcpy(playlist.rng, hdr.rng, sizeof(playlist.rng));
+	playlist.cur = hdr.cur;
+	playlist.shuffled = hdr.shuffled;
+
+	GP_DEBUG(1, "Loaded playlist snapshot, shuffle seed %016llx at %zu",
+	         (unsigned long long)hdr.seed, playlist.cur);
+
+	return 0;
+err1:
+	playlist_clear();
+err0:
+	close(fd);
+	return 1;
+}
+
+/*
+ * Parses the text playlist mapped into memory, the lines are counted first
+ * so that the file table is grown once, the arena is reserved for the file
+ * size.
+ */
+static void load_text(int fd, size_t size)
+{
+	const char *map, *end, *p, *nl;
+	size_t cnt = 0, first, i;
+
+	if (!size)
+		return;
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		GP_WARN("mmap(): %s", strerror(errno));
+		return;
+	}
+
+	madvise((void *)map, size, MADV_SEQUENTIAL);
+
+	end = map + size;
+
+	for (p = map; p < end; p = nl + 1) {
+		nl = memchr(p, '\n', end - p);
+		if (!nl)
+			nl = end;
+		if (nl > p)
+			cnt++;
+	}
+
+	if (!cnt || strs_reserve(size + 1))
+		goto out;
+
+	first = files_expand(cnt);
+	if (first == SIZE_MAX)
+		goto out;
+
+	for (p = map, i = first; p < end && i < first + cnt; p = nl + 1) {
+		nl = memchr(p, '\n', end - p);
+		if (!nl)
+			nl = end;
+		if (nl > p && !file_fill(i, p, nl - p))
+			i++;
+	}
+
+	files_shrink(first + cnt - i);
+	shuffle_extend(first, i);
+
+	strs_trim();
+out:
+	munmap((void *)map, size);
+}
+
+/*
+ * The snapshot is used if the playlist is empty and the snapshot is up to
+ * date, otherwise the text playlist is parsed.
+ */
+static void load(const char *path, struct stat *st)
+{
+	int fd = open_cfg_file(path);
+
+	memset(st, 0, sizeof(*st));
+
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, st))
+		goto out;
+
+	if (!gp_vec_len(playlist.files) && !snapshot_load(path, st))
+		goto out;
+
+	load_text(fd, st->st_size);
+out:
+	close(fd);
+
+	playlist_stats();
+}
+
+void playlist_load(const char *path)
+{
+	struct stat st;
+
+	load(path, &st);
+
+	journal_flush();
+}
+
+static int write_all(int fd, const char *buf, size_t size)
+{
+	while (size) {
+		ssize_t ret = write(fd, buf, size);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+
+		buf += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+#define SAVE_BUF_SIZE (1024 * 1024)
+
+/*
+ * Writes the text playlist through a temporary file in large chunks and
+ * then the snapshot, the st is filled in with the new text playlist.
+ */
+static int save(const char *path, struct stat *st)
+{
+	size_t i, used = 0, cnt = gp_vec_len(playlist.files);
+	char *buf, *tmp;
+	int fd;
+
+	buf = malloc(SAVE_BUF_SIZE);
+	if (!buf)
+		return 1;
+
+	fd = tmp_open(path, &tmp);
+	if (fd < 0) {
+		free(buf);
+		return 1;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		const char *dir = file_dir(i);
+		const char *name = file_name(i);
+		size_t dir_len = strlen(dir), name_len = strlen(name);
+
+		if (used + dir_len + name_len + 2 > SAVE_BUF_SIZE) {
+			if (write_all(fd, buf, used))
+				goto err;
+			used = 0;
+		}
+
+		memcpy(buf + used, dir, dir_len);
+		used += dir_len;
+		buf[used++] = '/';
+		memcpy(buf + used, name, name_len);
+		used += name_len;
+		buf[used++] = '\n';
+	}
+
+	if (write_all(fd, buf, used) || fstat(fd, st))
+		goto err;
+
+	free(buf);
+
+	if (tmp_commit(fd, tmp, path))
+		return 1;
+
+	snapshot_save(path, st);
+
+	return 0;
+err:
+	GP_WARN("Failed to write playlist: %s", strerror(errno));
+	tmp_abort(fd, tmp);
+	free(buf);
+	return 1;
+}
+
+void playlist_save(const char *path)
+{
+	struct stat st;
+
+	save(path, &st);
+}
+
+int playlist_next(void)
+{
+	if (playlist.cur + 1 >= gp_vec_len(playlist.files)) {
+		if (!gpplayer_conf->playlist_repeat)
+			return 0;
+
+		playlist.cur = 0;
+	} else {
+		playlist.cur++;
+	}
+
+	journal_flush();
+	return 1;
+}
+
+int playlist_prev(void)
+{
+	if (playlist.cur == 0) {
+		if (!gpplayer_conf->playlist_repeat)
+			return 0;
+
+		playlist.cur = gp_vec_len(playlist.files) - 1;
+	} else {
+		playlist.cur--;
+	}
+
+	journal_flush();
+	return 1;
+}
+
+/*
+ * Swaps two files, the files keep their shuffle positions and the current
+ * song follows the file it points to.
+ */
+static void file_swap(size_t a, size_t b)
+{
+	uint32_t args[2] = {a, b};
+
+	journal_rec(JOURNAL_SWAP, args, 2, NULL, 0);
+
+	GP_SWAP(playlist.files[a], playlist.files[b]);
+
+	playlist.shuffle[playlist.files[a].shuffle_pos] = a;
+	playlist.shuffle[playlist.files[b].shuffle_pos] = b;
+
+	if (playlist.shuffled)
+		return;
+
+	if (playlist.cur == a)
+		playlist.cur = b;
+	else if (playlist.cur == b)
+		playlist.cur = a;
+}
+
+int playlist_move_up(size_t pos)
+{
+	if (pos <= 0)
+		return 0;
+
+	if (pos >= gp_vec_len(playlist.files))
+		return 0;
+
+	file_swap(pos-1, pos);
+	journal_flush();
+
+	return 1;
+}
+
+int playlist_move_down(size_t pos)
+{
+	if (pos + 1 >= gp_vec_len(playlist.files))
+		return 0;
+
+	file_swap(pos+1, pos);
+	journal_flush();
+
+	return 1;
+}
+
+int playlist_set(size_t pos)
+{
+	if (pos >= gp_vec_len(playlist.files))
+		return 0;
+
+	if (playlist.shuffled)
+		pos = playlist.files[pos].shuffle_pos;
+
+	playlist.cur = pos;
+	journal_flush();
+	return 1;
+}
+
+static size_t playlist_cur_idx(void)
+{
+	size_t cur_idx = playlist.cur;
+
+	if (playlist.shuffled)
+		cur_idx = playlist.shuffle[cur_idx];
+
+	return cur_idx;
+}
+
+const char *playlist_cur(void)
+{
+	static char path[PATH_MAX];
+
+	if (!gp_vec_len(playlist.files))
+		return NULL;
+
+	return file_path(playlist_cur_idx(), path, sizeof(path));
+}
+
+const char *playlist_peek_next(void)
+{
+	static char path[PATH_MAX];
+	size_t next_idx = playlist.cur + 1;
+
+	if (next_idx >= gp_vec_len(playlist.files)) {
+		if (!gpplayer_conf->playlist_repeat || !gp_vec_len(playlist.files))
+			return NULL;
+
+		next_idx = 0;
+	}
+
+	if (playlist.shuffled)
+		next_idx = playlist.shuffle[next_idx];
+
+	return file_path(next_idx, path, sizeof(path));
+}
+
+static int cmp(const void *a, const void *b)
+{
+	const struct playlist_file *fa = a;
+	const struct playlist_file *fb = b;
+
+	return strcmp(playlist.strs + fa->name, playlist.strs + fb->name);
+}
+
+static int is_file(struct dirent *ent)
+{
+	return (ent->d_type & DT_REG) && strlen(ent->d_name) >= 4;
+}
+
+/*
+ * Files in a directory are added in a batch, the directory is read twice so
+ * that the file table and the arena are grown only once.
+ */
+static void add_dir(const char *path, DIR *dir)
+{
+	size_t cnt = 0, bytes = 0, first, last, i;
+	struct dirent *ent;
+	uint32_t dir_id;
+
+	if (dir_intern_path(path, strlen(path), &dir_id))
+		return;
+
+	while ((ent = readdir(dir))) {
+		if (!is_file(ent))
+			continue;
+
+		//if (strcmp(ent->d_name + name_len - 4, ".mp3"))
+		//	continue;
+
+		cnt++;
+		bytes += strlen(ent->d_name) + 1;
+	}
+
+	if (!cnt || strs_reserve(bytes))
+		return;
+
+	first = files_expand(cnt);
+	if (first == SIZE_MAX)
+		return;
+
+	rewinddir(dir);
+
+	for (i = first; i < first + cnt && (ent = readdir(dir)); ) {
+		size_t name_len;
+
+		if (!is_file(ent))
+			continue;
+
+		name_len = strlen(ent->d_name);
+
+		/* Directory has changed between the passes */
+		if (name_len + 1 > bytes)
+			break;
+
+		bytes -= name_len + 1;
+		file_set(i++, dir_id, ent->d_name, name_len);
+	}
+
+	last = i;
+
+	files_shrink(first + cnt - last);
+
+	strs_trim();
+
+	/* Sort before shuffle, the shuffle positions would be moved around */
+	qsort(&playlist.files[first], last-first, sizeof(struct playlist_file), cmp);
+
+	shuffle_extend(first, last);
+}
+
+void playlist_add(const char *path)
+{
+	struct stat path_stat;
+	DIR *dir;
+
+	stat(path, &path_stat);
+
+	if (S_ISREG(path_stat.st_mode)) {
+		add_file(path);
+		journal_flush();
+		return;
+	}
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	add_dir(path, dir);
+
+	closedir(dir);
+
+	journal_flush();
+
+	playlist_stats();
+}
+
+static void strs_reset(void)
+{
+	playlist.strs = gp_vec_resize(playlist.strs, 0);
+	playlist.strs_used = 0;
+	playlist.strs_dead = 0;
+	playlist.dirs = gp_vec_resize(playlist.dirs, 0);
+
+	if (playlist.dirs_hash)
+		memset(playlist.dirs_hash, 0, playlist.dirs_hash_size * sizeof(uint32_t));
+}
+
+/*
+ * Rebuilds the arena once most of it is taken by removed basenames, unused
+ * directories are dropped as well.
+ *
+ * Everything is allocated before the playlist is modified, the live strings
+ * fit into the new arena and the directories are a subset of the old ones,
+ * so the playlist stays as it was if an allocation fails.
+ */
+static void strs_compact(void)
+{
+	char *old_strs = playlist.strs;
+	uint32_t *old_dirs = playlist.dirs;
+	size_t i, cnt = gp_vec_len(playlist.files);
+	size_t old_used = playlist.strs_used;
+	size_t live = old_used - playlist.strs_dead;
+	size_t dirs_cnt = 0, old_dirs_cnt = gp_vec_len(old_dirs);
+	uint32_t *remap;
+
+	if (playlist.strs_dead < old_used / 2)
+		return;
+
+	/* Maps old directory indexes to new ones */
+	remap = malloc(old_dirs_cnt * sizeof(*remap));
+	playlist.strs = gp_vec_new(live, 1);
+	playlist.dirs = gp_vec_new(old_dirs_cnt, sizeof(uint32_t));
+
+	if (!remap || !playlist.strs || !playlist.dirs) {
+		free(remap);
+		gp_vec_free(playlist.strs);
+		gp_vec_free(playlist.dirs);
+		playlist.strs = old_strs;
+		playlist.dirs = old_dirs;
+		return;
+	}
+
+	memset(remap, 0xff, old_dirs_cnt * sizeof(*remap));
+
+	playlist.strs_used = 0;
+	playlist.strs_dead = 0;
+
+	for (i = 0; i < cnt; i++) {
+		struct playlist_file *file = &playlist.files[i];
+		const char *name = old_strs + file->name;
+
+		if (remap[file->dir] == UINT32_MAX) {
+			const char *dir = old_strs + old_dirs[file->dir];
+
+			playlist.dirs[dirs_cnt] = strs_add(dir, strlen(dir));
+			remap[file->dir] = dirs_cnt++;
+		}
+
+		file->dir = remap[file->dir];
+		file->name = strs_add(name, strlen(name));
+	}
+
+	playlist.dirs = gp_vec_shrink(playlist.dirs, old_dirs_cnt - dirs_cnt);
+	playlist.dirs_last = 0;
+
+	memset(playlist.dirs_hash, 0, playlist.dirs_hash_size * sizeof(uint32_t));
+
+	for (i = 0; i < dirs_cnt; i++)
+		dirs_hash_put(i);
+
+	GP_DEBUG(1, "Playlist arena compacted from %zu to %zu bytes",
+	         old_used, playlist.strs_used);
+
+	free(remap);
+	gp_vec_free(old_strs);
+	gp_vec_free(old_dirs);
+}
+
+static int cmp_pos(const void *a, const void *b)
+{
+	uint32_t pa = *(const uint32_t *)a;
+	uint32_t pb = *(const uint32_t *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+/*
+ * Returns number of removed shuffle positions that are smaller than pos.
+ *
+ * The binary search is branchless, the positions are random so a branch
+ * would be mispredicted half of the time.
+ */
+static size_t pos_rank(const uint32_t *rem_pos, size_t len, size_t pos)
+{
+	const uint32_t *base = rem_pos;
+
+	while (len > 1) {
+		size_t half = len / 2;
+
+		base = base[half] < pos ? base + half : base;
+		len -= half;
+	}
+
+	return (base - rem_pos) + (base[0] < pos);
+}
+
+/*
+ * Removes files [off, off + len) from the shuffle order given their sorted
+ * shuffle positions, the relative order of the remaining files is kept.
+ *
+ * Everything is done in sequential passes, rebuilding the inverse from the
+ * shuffle order would be a cache miss per file on large playlists.
+ */
+static void shuffle_rem(const uint32_t *rem_pos, size_t off, size_t len)
+{
+	size_t i, w = rem_pos[0], cnt = gp_vec_len(playlist.shuffle);
+	size_t end = off + len;
+
+	for (i = 0; i < len; i++) {
+		size_t from = rem_pos[i] + 1;
+		size_t to = i + 1 < len ? rem_pos[i+1] : cnt;
+
+		memmove(&playlist.shuffle[w], &playlist.shuffle[from],
+		        (to - from) * sizeof(uint32_t));
+		w += to - from;
+	}
+
+	playlist.shuffle = gp_vec_shrink(playlist.shuffle, len);
+
+	for (i = 0; i < w; i++)
+		playlist.shuffle[i] -= (playlist.shuffle[i] >= end) * len;
+
+	for (i = 0; i < w; i++) {
+		struct playlist_file *file = &playlist.files[i];
+
+		file->shuffle_pos -= pos_rank(rem_pos, len, file->shuffle_pos);
+	}
+}
+
+void playlist_rem(size_t off, size_t len)
+{
+	uint32_t *rem_pos, args[2];
+	size_t i;
+
+	if (off >= gp_vec_len(playlist.files))
+		return;
+
+	len = GP_MIN(gp_vec_len(playlist.files) - off, len);
+	if (!len)
+		return;
+
+	rem_pos = malloc(len * sizeof(*rem_pos));
+	if (!rem_pos)
+		return;
+
+	args[0] = off;
+	args[1] = len;
+	journal_rec(JOURNAL_REM, args, 2, NULL, 0);
+
+	for (i = off; i < off + len; i++) {
+		playlist.strs_dead += strlen(file_name(i)) + 1;
+		rem_pos[i - off] = playlist.files[i].shuffle_pos;
+	}
+
+	qsort(rem_pos, len, sizeof(*rem_pos), cmp_pos);
+
+	/* Move the current position to the next remaining song */
+	if (playlist.shuffled)
+		playlist.cur -= pos_rank(rem_pos, len, playlist.cur);
+	else if (playlist.cur >= off + len)
+		playlist.cur -= len;
+	else if (playlist.cur >= off)
+		playlist.cur = off;
+
+	playlist.files = gp_vec_del(playlist.files, off, len);
+
+	shuffle_rem(rem_pos, off, len);
+
+	free(rem_pos);
+
+	if (playlist.cur >= gp_vec_len(playlist.files))
+		playlist.cur = 0;
+
+	strs_compact();
+
+	journal_flush();
+}
+
+void playlist_clear(void)
+{
+	playlist.files = gp_vec_resize(playlist.files, 0);
+	playlist.shuffle = gp_vec_resize(playlist.shuffle, 0);
+	playlist.cur = 0;
+
+	strs_reset();
+
+	journal_rec(JOURNAL_CLEAR, NULL, 0, NULL, 0);
+	journal_flush();
+}
+
+void playlist_list(void)
+{
+	char path[PATH_MAX];
+	size_t i;
+
+	printf("PLAYLIST\n--------\n\n");
+
+	for (i = 0; i < gp_vec_len(playlist.files); i++) {
+		printf("- (c=%3zu s=%3u) '%s'\n", i,
+		       playlist.files[i].shuffle_pos,
+		       file_path(i, path, sizeof(path)));
+	}
+}
+
+/*
+ * Generates a new shuffle order for a seed, the current song is placed first.
+ */
+static void shuffle_seeded(uint64_t seed, size_t cur_idx)
+{
+	size_t i, cnt = gp_vec_len(playlist.files);
+
+	rng_seed(seed);
+
+	playlist.cur = 0;
+
+	for (i = 0; i < cnt; i++)
+		shuffle_insert(i, rng_range(i + 1));
+
+	if (cnt) {
+		size_t pos = playlist.files[cur_idx].shuffle_pos;
+
+		playlist.shuffle[pos] = playlist.shuffle[0];
+		playlist.files[playlist.shuffle[0]].shuffle_pos = pos;
+		playlist.shuffle[0] = cur_idx;
+		playlist.files[cur_idx].shuffle_pos = 0;
+	}
+
+	GP_DEBUG(1, "Shuffled %zu files with seed %016llx",
+	         cnt, (unsigned long long)seed);
+}
+
+/*
+ * Converts cur between a file index and a shuffle position.
+ */
+static void shuffle_mode_apply(bool shuffle, uint64_t seed)
+{
+	playlist.shuffled = shuffle;
+
+	if (!gp_vec_len(playlist.files))
+		return;
+
+	if (shuffle)
+		shuffle_seeded(seed, playlist.cur);
+	else
+		playlist.cur = playlist.shuffle[playlist.cur];
+}
+
+/*
+ * Enabling the shuffle reshuffles the files with the current one first, the
+ * seed is drawn from the current one, so the order is reproducible.
+ */
+static void shuffle_mode(bool shuffle)
+{
+	uint64_t seed = 0;
+	uint32_t args[3];
+
+	if (shuffle == playlist.shuffled)
+		return;
+
+	if (shuffle) {
+		seed = (uint64_t)rng_next() << 32;
+		seed |= rng_next();
+	}
+
+	shuffle_mode_apply(shuffle, seed);
+
+	args[0] = shuffle;
+	args[1] = seed;
+	args[2] = seed >> 32;
+	journal_rec(JOURNAL_SHUFFLE, args, 3, NULL, 0);
+}
+
+void playlist_shuffle_set(bool shuffle)
+{
+	gpplayer_conf_playlist_shuffle_set(shuffle);
+
+	shuffle_mode(shuffle);
+
+	journal_flush();
+}
+
+/*
+ * Playlist changes are appended to a journal as they happen, so that a crash
+ * does not lose them. The journal is replayed on the top of the text playlist
+ * (or its snapshot) on startup and compacted, i.e. the playlist is saved and
+ * the journal is truncated, once it grows too big and on exit.
+ *
+ * The journal header stores the stamp of the text playlist it applies to, if
+ * the player crashes after the playlist was saved but before the journal was
+ * truncated the stale journal is ignored.
+ *
+ * Records are batched in memory for each playlist operation and written with
+ * a single write() followed by fdatasync(). Each record has a checksum so
+ * that a torn write at the end of the journal is detected. Records are in
+ * native byte order.
+ *
+ * Adding a file records its position in the shuffle order and a reshuffle
+ * records the seed, so the replay does not depend on the generator state.
+ * The current position is recorded after each operation that changed it,
+ * the shuffle on and off switches are recorded as well since they change
+ * what the position refers to.
+ */
+#define JOURNAL_MAGIC "gppljrnl"
+#define JOURNAL_VERSION 2
+#define JOURNAL_MIN_SIZE (256 * 1024)
+
+struct journal_hdr {
+	char magic[8];
+	uint32_t version;
+	/* Shuffle state the records start from */
+	uint32_t shuffled;
+	struct pl_stamp pl;
+};
+
+struct journal_rec {
+	uint32_t hash;
+	uint16_t op;
+	uint16_t len;
+};
+
+static struct journal {
+	/* -1 if changes are not journaled, e.g. during replay */
+	int fd;
+	/* Records not written yet */
+	char *buf;
+	/* Size of the journal file */
+	size_t size;
+	/* Current position stored in the journal */
+	size_t cur;
+} journal = {.fd = -1};
+
+static uint32_t rec_hash(const struct journal_rec *rec, const void *payload)
+{
+	uint32_t hash = fnv1a(FNV1A_INIT, &rec->op, sizeof(rec->op));
+
+	hash = fnv1a(hash, &rec->len, sizeof(rec->len));
+
+	return fnv1a(hash, payload, rec->len);
+}
+
+static void journal_rec(enum journal_op op, const uint32_t *args, size_t args_cnt,
+                        const char *str, size_t str_len)
+{
+	size_t args_size = args_cnt * sizeof(uint32_t);
+	struct journal_rec rec = {
+		.op = op,
+		.len = args_size + str_len,
+	};
+	size_t off;
+	char *new;
+
+	if (journal.fd < 0)
+		return;
+
+	off = gp_vec_len(journal.buf);
+
+	new = gp_vec_expand(journal.buf, sizeof(rec) + rec.len);
+	if (!new) {
+		GP_WARN("Failed to journal playlist change");
+		return;
+	}
+
+	journal.buf = new;
+
+	if (args_size)
+		memcpy(new + off + sizeof(rec), args, args_size);
+
+	if (str_len)
+		memcpy(new + off + sizeof(rec) + args_size, str, str_len);
+
+	rec.hash = rec_hash(&rec, new + off + sizeof(rec));
+	memcpy(new + off, &rec, sizeof(rec));
+}
+
+static void journal_add(size_t idx, size_t pos)
+{
+	char path[PATH_MAX];
+	uint32_t arg = pos;
+	int len;
+
+	if (journal.fd < 0)
+		return;
+
+	len = snprintf(path, sizeof(path), "%s/%s", file_dir(idx), file_name(idx));
+	if (len < 0 || len >= (int)sizeof(path))
+		return;
+
+	journal_rec(JOURNAL_ADD, &arg, 1, path, len);
+}
+
+static char *journal_path(const char *path)
+{
+	char *ret;
+
+	if (asprintf(&ret, "%s.journal", path) < 0)
+		return NULL;
+
+	return ret;
+}
+
+/*
+ * Starts a new empty journal for the text playlist.
+ */
+static void journal_reset(const struct stat *pl_st)
+{
+	struct journal_hdr hdr = {
+		.magic = JOURNAL_MAGIC,
+		.version = JOURNAL_VERSION,
+		.shuffled = playlist.shuffled,
+	};
+	char *jpath = journal_path(save_path), *full_path, *tmp;
+	int fd;
+
+	if (journal.fd >= 0) {
+		close(journal.fd);
+		journal.fd = -1;
+	}
+
+	if (!jpath)
+		return;
+
+	stamp_set(&hdr.pl, pl_st);
+
+	fd = tmp_open(jpath, &tmp);
+	if (fd < 0)
+		goto out;
+
+	if (write_all(fd, (const char *)&hdr, sizeof(hdr))) {
+		tmp_abort(fd, tmp);
+		goto out;
+	}
+
+	if (tmp_commit(fd, tmp, jpath))
+		goto out;
+
+	full_path = cfg_full_path(jpath);
+	if (!full_path)
+		goto out;
+
+	journal.fd = open(full_path, O_WRONLY | O_APPEND);
+	journal.size = sizeof(hdr);
+	journal.cur = playlist.cur;
+
+	free(full_path);
+out:
+	free(jpath);
+
+	if (journal.fd < 0)
+		GP_WARN("Playlist changes are not journaled");
+}
+
+/*
+ * Saves the playlist and starts a new journal.
+ */
+static void journal_compact(void)
+{
+	struct stat st;
+
+	if (save(save_path, &st))
+		return;
+
+	journal_reset(&st);
+
+	GP_DEBUG(1, "Playlist journal compacted");
+}
+
+static void journal_flush(void)
+{
+	uint32_t arg = playlist.cur;
+	size_t len;
+
+	if (journal.fd < 0)
+		return;
+
+	if (journal.cur != playlist.cur) {
+		journal_rec(JOURNAL_CUR, &arg, 1, NULL, 0);
+		journal.cur = playlist.cur;
+	}
+
+	len = gp_vec_len(journal.buf);
+	if (!len)
+		return;
+
+	if (write_all(journal.fd, journal.buf, len) || fdatasync(journal.fd))
+		GP_WARN("Failed to write playlist journal: %s", strerror(errno));
+
+	journal.buf = gp_vec_resize(journal.buf, 0);
+	journal.size += len;
+
+	if (journal.size > GP_MAX((size_t)JOURNAL_MIN_SIZE, playlist.strs_used / 4))
+		journal_compact();
+}
+
+static int journal_apply(const struct journal_rec *rec, const char *payload)
+{
+	size_t cnt = gp_vec_len(playlist.files);
+	size_t args_cnt = GP_MIN(rec->len / sizeof(uint32_t), (size_t)3);
+	uint32_t args[3] = {0};
+	size_t idx;
+
+	memcpy(args, payload, args_cnt * sizeof(uint32_t));
+
+	switch (rec->op) {
+	case JOURNAL_ADD:
+		if (rec->len < sizeof(uint32_t) || args[0] > cnt)
+			return 1;
+
+		idx = files_expand(1);
+		if (idx == SIZE_MAX)
+			return 1;
+
+		if (file_fill(idx, payload + sizeof(uint32_t), rec->len - sizeof(uint32_t))) {
+			files_shrink(1);
+			return 1;
+		}
+
+		shuffle_insert(idx, args[0]);
+	break;
+	case JOURNAL_REM:
+		playlist_rem(args[0], args[1]);
+	break;
+	case JOURNAL_SWAP:
+		if (args[0] >= cnt || args[1] >= cnt)
+			return 1;
+
+		file_swap(args[0], args[1]);
+	break;
+	case JOURNAL_CLEAR:
+		playlist_clear();
+	break;
+	case JOURNAL_CUR:
+		if (args[0] >= GP_MAX(cnt, (size_t)1))
+			return 1;
+
+		playlist.cur = args[0];
+	break;
+	case JOURNAL_SHUFFLE:
+		if (rec->len != 3 * sizeof(uint32_t) || args[0] > 1 ||
+		    args[0] == playlist.shuffled)
+			return 1;
+
+		shuffle_mode_apply(args[0], args[1] | (uint64_t)args[2] << 32);
+	break;
+	default:
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns number of replayed records, the end is set to the end of the valid
+ * records or to zero if the journal is not valid for the playlist.
+ */
+static size_t journal_replay(const char *path, const struct stat *pl_st, size_t *end)
+{
+	char *jpath = journal_path(path), *buf = NULL;
+	const struct journal_hdr *hdr;
+	size_t off, cnt = 0;
+	struct stat st;
+	int fd;
+
+	*end = 0;
+
+	if (!jpath)
+		return 0;
+
+	fd = open_cfg_file(jpath);
+	free(jpath);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr))
+		goto out;
+
+	buf = malloc(st.st_size);
+	if (!buf || read(fd, buf, st.st_size) != st.st_size)
+		goto out;
+
+	hdr = (void *)buf;
+
+	if (memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != JOURNAL_VERSION || hdr->shuffled > 1)
+		goto out;
+
+	if (!stamp_eq(&hdr->pl, pl_st)) {
+		GP_DEBUG(1, "Playlist journal is stale, ignoring it");
+		goto out;
+	}
+
+	playlist.shuffled = hdr->shuffled;
+
+	for (off = sizeof(*hdr); off + sizeof(struct journal_rec) <= (size_t)st.st_size; ) {
+		struct journal_rec rec;
+		const char *payload = buf + off + sizeof(rec);
+
+		memcpy(&rec, buf + off, sizeof(rec));
+
+		if (off + sizeof(rec) + rec.len > (size_t)st.st_size ||
+		    rec.hash != rec_hash(&rec, payload)) {
+			GP_WARN("Playlist journal truncated at %zu", off);
+			break;
+		}
+
+		if (journal_apply(&rec, payload)) {
+			GP_WARN("Invalid playlist journal record at %zu", off);
+			break;
+		}
+
+		off += sizeof(rec) + rec.len;
+		cnt++;
+	}
+
+	*end = off;
+
+	GP_DEBUG(1, "Replayed %zu playlist journal records", cnt);
+out:
+	free(buf);
+	close(fd);
+	return cnt;
+}
+
+/*
+ * Continues a valid journal, the invalid tail is cut off.
+ */
+static int journal_append(const char *path, size_t end)
+{
+	char *jpath = journal_path(path);
+	char *full_path = jpath ? cfg_full_path(jpath) : NULL;
+	int fd = -1;
+
+	if (full_path)
+		fd = open(full_path, O_WRONLY | O_APPEND);
+
+	free(jpath);
+	free(full_path);
+
+	if (fd < 0)
+		return 1;
+
+	if (ftruncate(fd, end)) {
+		close(fd);
+		return 1;
+	}
+
+	journal.fd = fd;
+	journal.size = end;
+	journal.cur = playlist.cur;
+
+	return 0;
+}
+
+static void journal_init(const char *path)
+{
+	struct stat st;
+	size_t end;
+
+	journal.buf = gp_vec_new(0, 1);
+
+	load(path, &st);
+
+	/* If the compaction fails the replayed journal must be kept */
+	if (journal_replay(path, &st, &end))
+		journal_compact();
+
+	if (journal.fd >= 0)
+		return;
+
+	if (end && !journal_append(path, end))
+		return;
+
+	journal_reset(&st);
+}
+
+static void journal_exit(void)
+{
+	journal_flush();
+	journal_compact();
+
+	if (journal.fd >= 0) {
+		close(journal.fd);
+		journal.fd = -1;
+	}
+}
+
+void playlist_repeat_set(bool repeat)
+{
+	gpplayer_conf_playlist_repeat_set(repeat);
+}
+
+static int playlist_seek_row(gp_widget *self, int op, unsigned int pos)
+{
+	gp_widget_table_priv *tbl_priv = gp_widget_table_priv_get(self);
+
+	switch (op) {
 	case GP_TABLE_ROW_RESET:
 		tbl_priv->row_idx = 0;
 	break;
@@ -442,15 +2134,9 @@ static int playlist_get(gp_widget *self, gp_widget_table_cell *cell, unsigned in
 	if (col_id)
 		return 0;
 
-	const char *fname = rindex(playlist.files[row].file, '/');
-	if (fname)
-		fname++;
-	else
-		fname = playlist.files[row].file;
-
 	size_t cur_idx = playlist_cur_idx();
 
-	cell->text = fname;
+	cell->text = file_name(row);
 	cell->tattr = (row == cur_idx) ? GP_TATTR_BOLD : 0;
 
 	return 1;
@@ -11,6 +11,9 @@
 /**
  * @brief Inialize playlist strucutres.
  *
+ * If a path is passed, changes done to the playlist are journaled and the
+ * journal left after a crash is replayed here.
+ *
  * @path If non-NULL playlist is loaded from the file.
  */
 void playlist_init(const char *path);
@@ -49,6 +52,13 @@ int playlist_set(size_t pos);
  */
 const char *playlist_cur(void);
 
+/**
+ * @brief Returns a path to the song playlist_next() would move to.
+ *
+ * @return A path to the next song or NULL if there is none.
+ */
+const char *playlist_peek_next(void);
+
 /**
  * @brief Moves a song one position up.
  *
@@ -77,6 +87,9 @@ void playlist_add(const char *path);
 /**
  * @brief Removes songs from the playlist.
  *
+ * If the current song is removed the playlist moves to the song that would
+ * have been played next.
+ *
  * @param off Offset to first song to remove.
  * @param len Number of songs to remove.
  */
@@ -89,13 +102,32 @@ void playlist_clear(void);
 
 void playlist_list(void);
 
+/**
+ * @brief Saves the playlist.
+ *
+ * Writes the text playlist and a binary snapshot with the shuffle state
+ * next to it. Both are written into temporary files which are renamed over
+ * the old ones.
+ *
+ * @param fname A path relative to the config directory.
+ */
 void playlist_save(const char *fname);
 
+/**
+ * @brief Loads a playlist.
+ *
+ * If the playlist is empty and the snapshot matches the text playlist the
+ * snapshot is loaded instead, otherwise the text playlist is appended.
+ *
+ * @param fname A path relative to the config directory.
+ */
 void playlist_load(const char *fname);
 
 /**
  * @brief Sets shuffle state.
  *
+ * Enabling shuffle generates a new order that starts with the current song.
+ *
  * @param shuffle A shuffle value.
  */
 void playlist_shuffle_set(bool shuffle);